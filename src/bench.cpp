@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "blockcodec.h"
+#include "pack24.h"
+#ifdef FT_EMULATOR
+#include "ftemu.h"
+#endif
+
+using namespace std;
+
+typedef chrono::steady_clock clock_type;
+
+static const size_t WORDS = 16 * 1024;          // micro benchmark input, stream words
+static const size_t FRAME_WORDS = 1023;
+static const auto BATCH_TIME = chrono::microseconds(20);
+static const auto SINGLE_TIME = chrono::microseconds(1);   // two clock reads are a few % of this
+
+// keeps results alive past the optimiser
+static volatile uint64_t sink;
+
+
+static bool Selected(const BenchConfig& config, const char* name)
+{
+    return config.filter.empty() || strstr(name, config.filter.c_str()) != nullptr;
+}
+
+static BenchResult Summarize(const char* name, uint64_t bytes, uint64_t iterations, vector<double>& ns)
+{
+    BenchResult result;
+    result.name = name;
+    result.bytes = bytes;
+    result.iterations = iterations;
+    if (ns.empty())
+        return result;
+
+    sort(ns.begin(), ns.end());
+    auto rank = [&ns](double p) {return ns[min(ns.size() - 1, static_cast<size_t>(p * ns.size()))];};
+    double total = 0;
+    for (double value: ns)
+        total += value;
+    result.mean_ns = total / ns.size();
+    result.p50_ns = rank(0.50);
+    result.p90_ns = rank(0.90);
+    result.p99_ns = rank(0.99);
+    result.max_ns = ns.back();
+    return result;
+}
+
+// Times every call of fn() on its own when one takes at least SINGLE_TIME;
+// faster ones in batches long enough for the clock reads not to matter,
+// each batch giving one sample of its mean
+template<typename Fn>
+static BenchResult Measure(const BenchConfig& config, const char* name, uint64_t bytes, Fn fn)
+{
+    size_t batch = 1;
+    for (;;)
+    {
+        clock_type::time_point start = clock_type::now();
+        for (size_t idx = 0; idx < batch; ++idx)
+            fn();
+        clock_type::duration elapsed = clock_type::now() - start;
+        if (elapsed >= BATCH_TIME || batch >= (1u << 20))
+        {
+            if (elapsed / batch >= SINGLE_TIME)
+                batch = 1;
+            break;
+        }
+        batch *= 2;
+    }
+
+    // warm-up
+    clock_type::time_point end = clock_type::now() + config.duration / 10;
+    while (clock_type::now() < end)
+        fn();
+
+    vector<double> ns;
+    uint64_t iterations = 0;
+    end = clock_type::now() + config.duration;
+    for (clock_type::time_point now = clock_type::now(); now < end;)
+    {
+        for (size_t idx = 0; idx < batch; ++idx)
+            fn();
+        clock_type::time_point next = clock_type::now();
+        ns.push_back(chrono::duration<double, nano>(next - now).count() / batch);
+        iterations += batch;
+        now = next;
+    }
+    BenchResult result = Summarize(name, bytes, iterations, ns);
+    result.batch = batch;
+    return result;
+}
+
+// Slowly turning tone with a little noise: compresses like real captures
+static vector<uint32_t> Samples(size_t count)
+{
+    vector<uint32_t> words(count);
+    uint32_t noise = 1;
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        noise = noise * 1664525 + 1013904223;
+        double angle = 2 * M_PI * idx / 97;
+        int i = static_cast<int>(1500 * cos(angle)) + static_cast<int>(noise >> 29);
+        int q = static_cast<int>(1500 * sin(angle)) + static_cast<int>((noise >> 26) & 7);
+        words[idx] = IQ_SAMPLE::Pack(static_cast<int16_t>(i), static_cast<int16_t>(q));
+    }
+    return words;
+}
+
+// Wire stream as the board sends it: full frames, a message after every 4th
+static vector<uint32_t> Wire(const vector<uint32_t>& samples)
+{
+    vector<uint32_t> wire;
+    for (size_t pos = 0, frame = 0; pos < samples.size(); pos += FRAME_WORDS, ++frame)
+    {
+        size_t count = min(FRAME_WORDS, samples.size() - pos);
+        wire.push_back(F2FIFO(static_cast<uint16_t>(count)));
+        wire.insert(wire.end(), samples.begin() + pos, samples.begin() + pos + count);
+        if (frame % 4 == 3)
+        {
+            wire.push_back(F2CPU(static_cast<uint8_t>(2), static_cast<uint8_t>(2)));
+            wire.push_back(static_cast<uint32_t>(frame));
+            wire.push_back(static_cast<uint32_t>(pos));
+        }
+    }
+    return wire;
+}
+
+static void Micro(const BenchConfig& config, vector<BenchResult>& results)
+{
+    const vector<uint32_t> samples = Samples(WORDS);
+    const vector<uint32_t> wire = Wire(samples);
+    const size_t sample_bytes = WORDS * sizeof(uint32_t);
+    const size_t wire_bytes = wire.size() * sizeof(uint32_t);
+
+    if (Selected(config, "header_decode"))
+    {
+        // every word taken as a header: the decode alone, no payload skipping
+        results.push_back(Measure(config, "header_decode", wire_bytes, [&]
+        {
+            uint64_t total = 0;
+            for (uint32_t word: wire)
+                total += SDR_HEADER::IsCmd(word)? F2CPU(word).num() + F2CPU(word).id(): F2FIFO(word).num();
+            sink = total;
+        }));
+    }
+
+    if (Selected(config, "parse"))
+    {
+        uint64_t packets = 0;
+        IPacketStream parser(nullptr, [&packets](uint8_t, const PacketRef&) {++packets;},
+                             IPacketStream::SOURCE::EXTERNAL);
+        results.push_back(Measure(config, "parse", wire_bytes, [&]
+        {
+            parser.Feed(wire.data(), wire_bytes);
+        }));
+        sink = packets;
+    }
+
+    if (Selected(config, "unpack_iq"))
+    {
+        vector<int16_t> i(WORDS), q(WORDS);
+        results.push_back(Measure(config, "unpack_iq", sample_bytes, [&]
+        {
+            for (size_t idx = 0; idx < WORDS; ++idx)
+            {
+                IQ_SAMPLE sample(samples[idx]);
+                i[idx] = sample.i();
+                q[idx] = sample.q();
+            }
+            sink = i[WORDS / 2] + q[WORDS / 3];
+        }));
+    }
+
+    vector<uint8_t> packed(3 * WORDS);
+    Pack24(samples.data(), WORDS, packed.data());
+    if (Selected(config, "pack24"))
+    {
+        results.push_back(Measure(config, "pack24", sample_bytes, [&]
+        {
+            Pack24(samples.data(), WORDS, packed.data());
+        }));
+    }
+    if (Selected(config, "unpack24"))
+    {
+        vector<uint32_t> words(WORDS);
+        results.push_back(Measure(config, "unpack24", sample_bytes, [&]
+        {
+            Unpack24(packed.data(), WORDS, words.data());
+        }));
+    }
+
+    vector<uint8_t> encoded(BlockCodec::MaxEncodedSize(WORDS));
+    size_t encoded_bytes = BlockCodec::EncodeBlock(samples.data(), WORDS, encoded.data());
+    if (Selected(config, "codec_encode"))
+    {
+        results.push_back(Measure(config, "codec_encode", sample_bytes, [&]
+        {
+            sink = BlockCodec::EncodeBlock(samples.data(), WORDS, encoded.data());
+        }));
+    }
+    if (Selected(config, "codec_decode"))
+    {
+        vector<uint32_t> words(WORDS);
+        results.push_back(Measure(config, "codec_decode", sample_bytes, [&]
+        {
+            sink = BlockCodec::DecodeBlock(encoded.data(), encoded_bytes, words.data(), WORDS);
+        }));
+    }
+
+    // framing needs somewhere to write; the emulator consumes it for free
+    if (config.device != nullptr && Selected(config, "tx_framing"))
+    {
+        OPacketStream out(config.device);
+        const char* bytes = reinterpret_cast<const char*>(samples.data());
+        results.push_back(Measure(config, "tx_framing", sample_bytes, [&]
+        {
+            out.write(bytes, sample_bytes);
+        }));
+        out.flush();
+    }
+}
+
+#ifdef FT_EMULATOR
+static void Emulate(FtEmulator::PATTERN pattern)
+{
+    FtEmulator::Config emu = FtEmulator::Config::Default();
+    emu.pattern = pattern;
+    emu.sample_rate = 0;
+    emu.frame_words = FRAME_WORDS;
+    emu.loopback = false;
+    emu.latency = chrono::microseconds(0);
+    emu.error_rate = 0;
+    emu.fail_at = 0;
+    FtEmulator::Configure(emu);
+}
+#endif
+
+static void Macro(const BenchConfig& config, vector<BenchResult>& results)
+{
+    if (config.device == nullptr)
+        return;
+
+    if (Selected(config, "rx_stream"))
+    {
+#ifdef FT_EMULATOR
+        Emulate(FtEmulator::PATTERN::COUNTER);
+#endif
+        // time between stream packets as the callback sees them
+        vector<double> ns;
+        ns.reserve(1 << 22);
+        uint64_t packets = 0;
+        clock_type::time_point last;
+        IPacketStream in(config.device, [&](uint8_t, const PacketRef& body)
+        {
+            if (body.IsMessage())
+                return;
+            clock_type::time_point now = clock_type::now();
+            if (packets++ > 0 && ns.size() < ns.capacity())
+                ns.push_back(chrono::duration<double, nano>(now - last).count());
+            last = now;
+        });
+        this_thread::sleep_for(config.duration);
+        in.Stop();
+        results.push_back(Summarize("rx_stream", FRAME_WORDS * sizeof(uint32_t), packets, ns));
+    }
+
+    if (Selected(config, "tx_stream"))
+    {
+#ifdef FT_EMULATOR
+        Emulate(FtEmulator::PATTERN::NONE);
+#endif
+        const vector<uint32_t> samples = Samples(WORDS);
+        const size_t bytes = WORDS * sizeof(uint32_t);
+        OPacketStream out(config.device);
+        out.Combine(OPacketStream::WriteCombine());
+
+        vector<double> ns;
+        uint64_t writes = 0;
+        clock_type::time_point end = clock_type::now() + config.duration;
+        for (clock_type::time_point now = clock_type::now(); now < end; ++writes)
+        {
+            out.write(reinterpret_cast<const char*>(samples.data()), bytes);
+            clock_type::time_point next = clock_type::now();
+            ns.push_back(chrono::duration<double, nano>(next - now).count());
+            now = next;
+        }
+        out.flush();
+        results.push_back(Summarize("tx_stream", bytes, writes, ns));
+    }
+
+    if (Selected(config, "message_rtt"))
+    {
+#ifdef FT_EMULATOR
+        Emulate(FtEmulator::PATTERN::NONE);
+#endif
+        // needs the far end to echo messages, as the emulator does
+        atomic<uint32_t> answered(0);
+        WaitPoint reply;
+        IPacketStream in(config.device, [&](uint8_t, const PacketRef& body)
+        {
+            if (body.IsMessage() && body.size() > 1)
+            {
+                answered.store(body[1], memory_order_release);
+                reply.Notify();
+            }
+        });
+        OPacketStream out(config.device);
+
+        vector<double> ns;
+        clock_type::time_point end = clock_type::now() + config.duration;
+        for (uint32_t seq = 1; clock_type::now() < end; ++seq)
+        {
+            clock_type::time_point start = clock_type::now();
+            if (!out.SendMessage(5, &seq, 1) ||
+                !reply.WaitFor([&] {return answered.load(memory_order_acquire) == seq;}, chrono::milliseconds(100)))
+            {
+                printf("message_rtt: no answer to message %u, stopped\r\n", seq);
+                break;
+            }
+            ns.push_back(chrono::duration<double, nano>(clock_type::now() - start).count());
+        }
+        in.Stop();
+        results.push_back(Summarize("message_rtt", 0, ns.size(), ns));
+    }
+
+#ifdef FT_EMULATOR
+    FtEmulator::Configure(FtEmulator::Config::Default());
+#endif
+}
+
+vector<BenchResult> RunBenchmarks(const BenchConfig& config)
+{
+    vector<BenchResult> results;
+    Micro(config, results);
+    Macro(config, results);
+    return results;
+}
+
+bool WriteBenchJson(const string& path, const vector<BenchResult>& results)
+{
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+    {
+        printf("Failed to create %s\r\n", path.c_str());
+        return false;
+    }
+
+#ifdef FT_EMULATOR
+    const char* transport = "emulator";
+#else
+    const char* transport = "device";
+#endif
+    fprintf(file, "{\n  \"transport\": \"%s\",\n  \"results\": [", transport);
+    for (size_t idx = 0; idx < results.size(); ++idx)
+    {
+        const BenchResult& r = results[idx];
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"batch\": %llu, \"bytes\": %llu, "
+                "\"mib_per_s\": %.2f, \"ns\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}",
+                idx? ",": "", r.name.c_str(), static_cast<unsigned long long>(r.iterations),
+                static_cast<unsigned long long>(r.batch), static_cast<unsigned long long>(r.bytes), r.MiBps(),
+                r.mean_ns, r.p50_ns, r.p90_ns, r.p99_ns, r.max_ns);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+int RunBench(int argc, char* argv[])
+{
+    BenchConfig config;
+    if (argc >= 1)
+        config.json = argv[0];
+    if (argc >= 2)
+        config.filter = argv[1];
+
+    FT_HANDLE handle = nullptr;
+    if (FT_OK != FT_Create(0, FT_OPEN_BY_INDEX, &handle) || !handle)
+    {
+        printf("No device, device benchmarks skipped\r\n");
+        handle = nullptr;
+    }
+    config.device = handle;
+
+    vector<BenchResult> results = RunBenchmarks(config);
+    if (handle)
+        FT_Close(handle);
+
+    printf("%-14s %12s %6s %10s %10s %10s %10s %10s\r\n", "benchmark", "MiB/s", "batch", "mean ns", "p50", "p90", "p99", "max");
+    for (const BenchResult& r: results)
+        printf("%-14s %12.1f %6llu %10.1f %10.1f %10.1f %10.1f %10.1f\r\n",
+               r.name.c_str(), r.MiBps(), static_cast<unsigned long long>(r.batch),
+               r.mean_ns, r.p50_ns, r.p90_ns, r.p99_ns, r.max_ns);
+
+    return WriteBenchJson(config.json, results)? 0: 1;
+}
@@ -0,0 +1,46 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <string>
+#include <vector>
+#include "streamer.h"
+
+// Repeatable benchmarks of the packet stack, run by `streamer bench`.
+// Micro benchmarks time one operation on a fixed in-memory input (header
+// decode, parse, sample unpack, pack24, block codec, TX framing); macro
+// benchmarks run the whole RX and TX paths against the device, which in
+// an EMULATOR=1 build is the software one. Every call slower than a
+// microsecond is timed on its own, so the percentiles are per iteration;
+// faster ones are timed in batches and their percentiles are of batch
+// means (batch > 1). Results go to stdout and to a JSON file for comparing
+// runs.
+struct BenchConfig
+{
+    string json = "bench.json";
+    string filter;                              // only names containing this
+    chrono::milliseconds duration{300};         // per benchmark, after warm-up
+    FT_HANDLE device = nullptr;                 // device benchmarks are skipped without one
+};
+
+struct BenchResult
+{
+    string name;
+    uint64_t iterations = 0;
+    uint64_t bytes = 0;                         // per iteration, 0 if not a byte stream
+    uint64_t batch = 1;                         // iterations per timed sample
+    double mean_ns = 0;
+    double p50_ns = 0;
+    double p90_ns = 0;
+    double p99_ns = 0;
+    double max_ns = 0;
+
+    double MiBps() const {return (bytes && mean_ns > 0)? bytes / mean_ns * 1e9 / (1024 * 1024): 0;}
+};
+
+// streamer bench [out.json] [filter]
+int RunBench(int argc, char* argv[]);
+
+vector<BenchResult> RunBenchmarks(const BenchConfig& config);
+bool WriteBenchJson(const string& path, const vector<BenchResult>& results);
+
+#endif // BENCH_H
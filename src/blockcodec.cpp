@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "blockcodec.h"
+#include "mapfile.h"
+#include "workpool.h"
+
+using namespace std;
+
+static const size_t GROUP = 64;
+
+// Zigzag deltas of one group, 0-padded to GROUP; returns the OR of all
+// values for the width
+static void Deltas(const uint32_t* words, size_t count, int32_t& prev_i, int32_t& prev_q,
+                   uint16_t* zi, uint16_t* zq, uint32_t& or_i, uint32_t& or_q)
+{
+    size_t idx = 0;
+    or_i = 0;
+    or_q = 0;
+
+#ifdef __SSE2__
+    __m128i last_i = _mm_set1_epi32(prev_i);
+    __m128i last_q = _mm_set1_epi32(prev_q);
+    __m128i acc_i = _mm_setzero_si128();
+    __m128i acc_q = _mm_setzero_si128();
+
+    for (; idx + 4 <= count; idx += 4)
+    {
+        __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + idx));
+        __m128i i = _mm_srai_epi32(_mm_slli_epi32(w, 20), 20);
+        __m128i q = _mm_srai_epi32(_mm_slli_epi32(w, 4), 20);
+        // previous sample per lane: shift one lane up, last of the previous round in front
+        __m128i pi = _mm_or_si128(_mm_slli_si128(i, 4), _mm_srli_si128(last_i, 12));
+        __m128i pq = _mm_or_si128(_mm_slli_si128(q, 4), _mm_srli_si128(last_q, 12));
+        __m128i di = _mm_sub_epi32(i, pi);
+        __m128i dq = _mm_sub_epi32(q, pq);
+        di = _mm_xor_si128(_mm_slli_epi32(di, 1), _mm_srai_epi32(di, 31));
+        dq = _mm_xor_si128(_mm_slli_epi32(dq, 1), _mm_srai_epi32(dq, 31));
+        acc_i = _mm_or_si128(acc_i, di);
+        acc_q = _mm_or_si128(acc_q, dq);
+        // at most 13 bits, packs without saturating
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(zi + idx), _mm_packs_epi32(di, di));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(zq + idx), _mm_packs_epi32(dq, dq));
+        last_i = i;
+        last_q = q;
+    }
+
+    uint32_t lanes[4];
+    acc_i = _mm_or_si128(acc_i, _mm_srli_si128(acc_i, 8));
+    acc_i = _mm_or_si128(acc_i, _mm_srli_si128(acc_i, 4));
+    acc_q = _mm_or_si128(acc_q, _mm_srli_si128(acc_q, 8));
+    acc_q = _mm_or_si128(acc_q, _mm_srli_si128(acc_q, 4));
+    or_i = _mm_cvtsi128_si32(acc_i);
+    or_q = _mm_cvtsi128_si32(acc_q);
+    if (idx > 0)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), last_i);
+        prev_i = lanes[3];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), last_q);
+        prev_q = lanes[3];
+    }
+#endif
+
+    for (; idx < count; ++idx)
+    {
+        IQ_SAMPLE sample(words[idx]);
+        int32_t di = sample.i() - prev_i;
+        int32_t dq = sample.q() - prev_q;
+        prev_i = sample.i();
+        prev_q = sample.q();
+        zi[idx] = static_cast<uint16_t>((di << 1) ^ (di >> 31));
+        zq[idx] = static_cast<uint16_t>((dq << 1) ^ (dq >> 31));
+        or_i |= zi[idx];
+        or_q |= zq[idx];
+    }
+    for (; idx < GROUP; ++idx)
+    {
+        zi[idx] = 0;
+        zq[idx] = 0;
+    }
+}
+
+static unsigned Width(uint32_t value)
+{
+    return value? 32 - __builtin_clz(value): 0;
+}
+
+// GROUP values of width bits into 8 * width bytes
+static uint8_t* PackBits(const uint16_t* values, unsigned width, uint8_t* out)
+{
+    uint64_t acc = 0;
+    unsigned fill = 0;
+
+    if (width == 0)
+        return out;
+    for (size_t idx = 0; idx < GROUP; ++idx)
+    {
+        acc |= static_cast<uint64_t>(values[idx]) << fill;
+        fill += width;
+        if (fill >= 32)
+        {
+            uint32_t word = static_cast<uint32_t>(acc);
+            memcpy(out, &word, sizeof(word));
+            out += sizeof(word);
+            acc >>= 32;
+            fill -= 32;
+        }
+    }
+    return out;
+}
+
+static const uint8_t* UnpackBits(const uint8_t* in, unsigned width, uint16_t* values)
+{
+    uint64_t acc = 0;
+    unsigned fill = 0;
+    const uint64_t mask = (1u << width) - 1;
+
+    if (width == 0)
+    {
+        memset(values, 0, GROUP * sizeof(uint16_t));
+        return in;
+    }
+    for (size_t idx = 0; idx < GROUP; ++idx)
+    {
+        if (fill < width)
+        {
+            uint32_t word;
+            memcpy(&word, in, sizeof(word));
+            in += sizeof(word);
+            acc |= static_cast<uint64_t>(word) << fill;
+            fill += 32;
+        }
+        values[idx] = static_cast<uint16_t>(acc & mask);
+        acc >>= width;
+        fill -= width;
+    }
+    return in;
+}
+
+size_t BlockCodec::EncodeBlock(const uint32_t* words, size_t count, uint8_t* out)
+{
+    uint8_t* start = out;
+    int32_t prev_i = 0;
+    int32_t prev_q = 0;
+    uint16_t zi[GROUP];
+    uint16_t zq[GROUP];
+
+    for (size_t first = 0; first < count; first += GROUP)
+    {
+        uint32_t or_i, or_q;
+        Deltas(words + first, min(GROUP, count - first), prev_i, prev_q, zi, zq, or_i, or_q);
+        unsigned width_i = Width(or_i);
+        unsigned width_q = Width(or_q);
+        *out++ = static_cast<uint8_t>(width_i | (width_q << 4));
+        out = PackBits(zi, width_i, out);
+        out = PackBits(zq, width_q, out);
+    }
+    return out - start;
+}
+
+bool BlockCodec::DecodeBlock(const uint8_t* in, size_t bytes, uint32_t* words, size_t count)
+{
+    const uint8_t* end = in + bytes;
+    int32_t prev_i = 0;
+    int32_t prev_q = 0;
+    uint16_t zi[GROUP];
+    uint16_t zq[GROUP];
+
+    for (size_t first = 0; first < count; first += GROUP)
+    {
+        if (in == end)
+            return false;
+        unsigned width_i = *in & 0xf;
+        unsigned width_q = *in >> 4;
+        ++in;
+        if (width_i > 13 || width_q > 13 || static_cast<size_t>(end - in) < 8 * (width_i + width_q))
+            return false;
+        in = UnpackBits(in, width_i, zi);
+        in = UnpackBits(in, width_q, zq);
+
+        size_t n = min(GROUP, count - first);
+        for (size_t idx = 0; idx < n; ++idx)
+        {
+            prev_i += static_cast<int32_t>(zi[idx] >> 1) ^ -static_cast<int32_t>(zi[idx] & 1);
+            prev_q += static_cast<int32_t>(zq[idx] >> 1) ^ -static_cast<int32_t>(zq[idx] & 1);
+            words[first + idx] = IQ_SAMPLE::Pack(prev_i, prev_q);
+        }
+    }
+    return in == end;
+}
+
+
+CompressedReader::CompressedReader()
+: pool(BufferPool::Default())
+, data(nullptr)
+, words(0)
+{
+}
+
+CompressedReader::~CompressedReader()
+{
+    Close();
+}
+
+bool CompressedReader::Open(const string& path)
+{
+#ifdef __linux__
+    Close();
+
+    size_t size = 0;
+    data = static_cast<const uint32_t*>(MapFile(path, size));
+    words = size / sizeof(uint32_t);
+    return data != nullptr;
+#else
+    printf("Compressed capture replay needs mmap, not available on this platform: %s\r\n", path.c_str());
+    return false;
+#endif
+}
+
+void CompressedReader::Close()
+{
+#ifdef __linux__
+    UnmapFile(data, words * sizeof(uint32_t));
+#endif
+    data = nullptr;
+    words = 0;
+}
+
+bool CompressedReader::Next(size_t& pos, Record& record) const
+{
+    uint32_t header = data[pos];
+
+    if (SDR_HEADER::IsCmd(header))
+    {
+        record.message = true;
+        record.offset = pos;
+        record.count = 1 + F2CPU(header).num();
+        record.bytes = 0;
+        if (pos + record.count > words)
+            return false;
+        pos += record.count;
+        return true;
+    }
+
+    if (pos + 2 > words)
+        return false;
+    record.message = false;
+    record.count = F2FIFO(header).num();
+    record.bytes = data[pos + 1];
+    record.offset = pos + 2;
+    size_t padded = (record.bytes + 3) / 4;
+    if (record.offset + padded > words || record.bytes > BlockCodec::MaxEncodedSize(record.count))
+        return false;
+    pos = record.offset + padded;
+    return true;
+}
+
+bool CompressedReader::Decode(Record& record)
+{
+    if (record.message)
+    {
+        record.packet = pool.Get(record.count);
+        memcpy(record.packet.data(), data + record.offset, record.count * sizeof(uint32_t));
+        record.packet.msgId(F2CPU(data[record.offset]).id());
+        record.packet.IsMessage(true);
+        return true;
+    }
+
+    record.packet = pool.Get(record.count);
+    record.packet.msgId(0);
+    record.packet.IsMessage(false);
+    return BlockCodec::DecodeBlock(reinterpret_cast<const uint8_t*>(data + record.offset), record.bytes,
+                                   record.packet.data(), record.count);
+}
+
+bool CompressedReader::Replay(IPacketStream::Callback_t callback, WorkPool* workers, size_t batch)
+{
+    vector<Record> records(max<size_t>(batch, 1));
+    size_t pos = 0;
+
+    while (pos < words)
+    {
+        size_t count = 0;
+        while (count < records.size() && pos < words)
+        {
+            if (!Next(pos, records[count]))
+                return false;
+            ++count;
+        }
+
+        atomic<bool> ok(true);
+        if (workers != nullptr && count > 1)
+        {
+            // blocks are independent: decode the run in parallel, deliver in order
+            for (size_t idx = 0; idx < count; ++idx)
+                workers->Submit([this, &records, &ok, idx] {if (!Decode(records[idx])) ok = false;});
+            workers->Wait();
+        }
+        else
+        {
+            for (size_t idx = 0; idx < count; ++idx)
+            {
+                if (!Decode(records[idx]))
+                    ok = false;
+            }
+        }
+        if (!ok)
+            return false;
+
+        for (size_t idx = 0; idx < count; ++idx)
+        {
+            Record& record = records[idx];
+            callback(record.packet.msgId(), record.packet);
+            record.packet.reset();
+        }
+    }
+    return true;
+}
@@ -0,0 +1,64 @@
+#ifndef BLOCKCODEC_H
+#define BLOCKCODEC_H
+
+#include <string>
+#include <vector>
+#include "streamer.h"
+
+class WorkPool;
+
+// Lossless codec for stream payloads. A block is one frame: I and Q are
+// delta coded separately (the first sample against zero, so every block
+// decodes on its own), zigzag mapped and bit-packed in groups of 64 samples
+// at the smallest width that holds the group:
+//   per group: 1 byte widths (I in bits 3:0, Q in bits 7:4),
+//              8 * width_i bytes of I deltas, 8 * width_q bytes of Q deltas
+// Noise-floor data needs a few bits per sample instead of 12. Like Pack24,
+// word bits 15:12 and 31:28 are not kept.
+namespace BlockCodec
+{
+    // Upper bound of EncodeBlock() output for count samples
+    constexpr size_t MaxEncodedSize(size_t count) {return (count + 63) / 64 * (1 + 2 * 8 * 13);}
+
+    // Returns the encoded size
+    size_t EncodeBlock(const uint32_t* words, size_t count, uint8_t* out);
+    // false if the block is shorter than its widths say
+    bool DecodeBlock(const uint8_t* in, size_t bytes, uint32_t* words, size_t count);
+}
+
+// Reader for captures a Recorder wrote with compress set. The files are the
+// wire stream with each stream payload replaced by its encoded size in
+// bytes and the encoded block, padded to whole words.
+class CompressedReader
+{
+public:
+    CompressedReader();
+    ~CompressedReader();
+
+    bool Open(const string& path);
+    void Close();
+
+    // Delivers the packets in order on the calling thread. With a pool, runs
+    // of blocks are decoded on its workers. false on a corrupt or truncated file.
+    bool Replay(IPacketStream::Callback_t callback, WorkPool* pool = nullptr, size_t batch = 64);
+
+private:
+    struct Record
+    {
+        size_t offset;              // block or message start, in words
+        size_t count;               // samples, or message words with the header
+        size_t bytes;               // encoded block size
+        bool message;
+        PacketRef packet;
+    };
+
+    BufferPool& pool;
+    const uint32_t* data;
+    size_t words;
+
+    // false at a malformed record
+    bool Next(size_t& pos, Record& record) const;
+    bool Decode(Record& record);
+};
+
+#endif // BLOCKCODEC_H
@@ -0,0 +1,172 @@
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+#include "bufpool.h"
+
+using namespace std;
+
+
+BufferPool::BufferPool(size_t buffers_per_class, const MemPolicy& policy)
+{
+    size_t total = 0;
+    for (size_t idx = 0; idx < CLASSES; ++idx)
+        total += (sizeof(PacketBuf) + (MIN_WORDS << (2 * idx)) * sizeof(uint32_t)) * buffers_per_class;
+
+    slab = static_cast<uint8_t*>(HugeAlloc(total, policy, &placement));
+
+    uint8_t* next = slab;
+    for (size_t idx = 0; idx < CLASSES; ++idx)
+    {
+        SizeClass& cls = classes[idx];
+
+        cls.words = MIN_WORDS << (2 * idx);
+        cls.count = buffers_per_class;
+        cls.stride = sizeof(PacketBuf) + cls.words * sizeof(uint32_t);
+        cls.slab = next;
+        cls.head = 0;
+        cls.in_use = 0;
+        cls.misses = 0;
+        next += cls.stride * cls.count;
+
+        for (uint32_t index = 0; index < cls.count; ++index)
+        {
+            PacketBuf* buf = new (At(cls, index)) PacketBuf();
+            buf->capacity = cls.words;
+            buf->size_class = idx;
+            buf->index = index;
+            buf->pool = this;
+            Push(cls, buf);
+        }
+    }
+}
+
+BufferPool::~BufferPool()
+{
+    // outstanding handles must not outlive the pool
+    HugeFree(slab, placement);
+}
+
+BufferPool& BufferPool::Default()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool& BufferPool::ForNode(int node)
+{
+    // the node mask HugeAlloc passes to mbind has 64 bits
+    static atomic<BufferPool*> pools[64];
+    static mutex create_lock;
+
+    // Default() already sits on the node of whoever made it first
+    if (node < 0 || node >= 64 || Default().Placement().numa_node == node)
+        return Default();
+
+    BufferPool* pool = pools[node].load(memory_order_acquire);
+    if (pool != nullptr)
+        return *pool;
+
+    lock_guard<mutex> guard(create_lock);
+    pool = pools[node].load(memory_order_relaxed);
+    if (pool == nullptr)
+    {
+        // outlives every stream: handles may be released during exit
+        MemPolicy policy;
+        policy.numa_node = node;
+        pool = new BufferPool(32, policy);
+        pools[node].store(pool, memory_order_release);
+    }
+    return *pool;
+}
+
+PacketBuf* BufferPool::Pop(SizeClass& cls)
+{
+    uint64_t head = cls.head.load(memory_order_acquire);
+
+    while (true)
+    {
+        uint32_t top = static_cast<uint32_t>(head);
+        if (top == 0)
+            return nullptr;
+
+        PacketBuf* buf = At(cls, top - 1);
+        uint64_t next = ((head >> 32) + 1) << 32 | buf->next.load(memory_order_relaxed);
+        if (cls.head.compare_exchange_weak(head, next, memory_order_acquire, memory_order_acquire))
+            return buf;
+    }
+}
+
+void BufferPool::Push(SizeClass& cls, PacketBuf* buf)
+{
+    uint64_t head = cls.head.load(memory_order_relaxed);
+
+    while (true)
+    {
+        buf->next.store(static_cast<uint32_t>(head), memory_order_relaxed);
+        uint64_t next = ((head >> 32) + 1) << 32 | (buf->index + 1);
+        if (cls.head.compare_exchange_weak(head, next, memory_order_release, memory_order_relaxed))
+            return;
+    }
+}
+
+PacketRef BufferPool::Get(size_t words)
+{
+    PacketBuf* buf = nullptr;
+
+    size_t idx = 0;
+    while (idx < CLASSES && classes[idx].words < words)
+        ++idx;
+
+    if (idx < CLASSES)
+    {
+        buf = Pop(classes[idx]);
+        if (buf != nullptr)
+            classes[idx].in_use.fetch_add(1, memory_order_relaxed);
+        else
+            classes[idx].misses.fetch_add(1, memory_order_relaxed);
+    }
+    else
+    {
+        classes[CLASSES - 1].misses.fetch_add(1, memory_order_relaxed);
+    }
+
+    if (buf == nullptr)
+    {
+        void* mem = nullptr;
+        if (posix_memalign(&mem, alignof(PacketBuf), sizeof(PacketBuf) + words * sizeof(uint32_t)) != 0)
+            throw bad_alloc();
+
+        buf = new (mem) PacketBuf();
+        buf->capacity = words;
+        buf->pool = nullptr;
+    }
+
+    buf->refs.store(1, memory_order_relaxed);
+    buf->size = words;
+    buf->msgId = 0;
+    buf->message = false;
+    return PacketRef(buf);
+}
+
+void BufferPool::Recycle(PacketBuf* buf)
+{
+    BufferPool* pool = buf->pool;
+    if (pool == nullptr)
+    {
+        buf->~PacketBuf();
+        free(buf);
+        return;
+    }
+
+    SizeClass& cls = pool->classes[buf->size_class];
+    cls.in_use.fetch_sub(1, memory_order_relaxed);
+    pool->Push(cls, buf);
+}
+
+BufferPool::Stats BufferPool::ClassStats(size_t size_class) const
+{
+    const SizeClass& cls = classes[size_class];
+    return Stats{cls.words, cls.count,
+                 cls.in_use.load(memory_order_relaxed),
+                 cls.misses.load(memory_order_relaxed)};
+}
@@ -0,0 +1,158 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "hugemem.h"
+
+class BufferPool;
+
+// Header in front of every pooled buffer, payload words follow it
+struct alignas(64) PacketBuf
+{
+    std::atomic<uint32_t> refs;
+    std::atomic<uint32_t> next;     // free list link (index + 1, 0 ends the list)
+    uint32_t capacity;              // words
+    uint32_t size;                  // words in use
+    uint8_t msgId;
+    bool message;                   // F2CPU message (header included) rather than stream payload
+    uint8_t size_class;
+    uint32_t index;
+    BufferPool* pool;               // nullptr for heap fallback buffers
+
+    uint32_t* data() {return reinterpret_cast<uint32_t*>(this + 1);}
+};
+
+// Intrusive reference-counted handle to a pooled buffer. Copies share the
+// buffer; the last handle released returns it to its pool from any thread.
+class PacketRef
+{
+public:
+    PacketRef(): buf(nullptr) {}
+    explicit PacketRef(PacketBuf* buf): buf(buf) {}
+    PacketRef(const PacketRef& other): buf(other.buf) {AddRef();}
+    PacketRef(PacketRef&& other) noexcept: buf(other.buf) {other.buf = nullptr;}
+    ~PacketRef() {Release();}
+
+    PacketRef& operator=(const PacketRef& other)
+    {
+        if (buf != other.buf)
+        {
+            Release();
+            buf = other.buf;
+            AddRef();
+        }
+        return *this;
+    }
+    PacketRef& operator=(PacketRef&& other) noexcept
+    {
+        if (this != &other)
+        {
+            Release();
+            buf = other.buf;
+            other.buf = nullptr;
+        }
+        return *this;
+    }
+
+    explicit operator bool() const {return buf != nullptr;}
+    void reset() {Release(); buf = nullptr;}
+
+    uint32_t* data() const {return buf->data();}
+    size_t size() const {return buf? buf->size: 0;}
+    size_t capacity() const {return buf? buf->capacity: 0;}
+    void resize(size_t words) {buf->size = static_cast<uint32_t>(words);}
+    uint8_t msgId() const {return buf->msgId;}
+    void msgId(uint8_t id) {buf->msgId = id;}
+    bool IsMessage() const {return buf->message;}
+    void IsMessage(bool message) {buf->message = message;}
+
+    uint32_t* begin() const {return data();}
+    uint32_t* end() const {return data() + size();}
+    uint32_t& operator[](size_t idx) const {return data()[idx];}
+
+    uint32_t use_count() const {return buf? buf->refs.load(std::memory_order_relaxed): 0;}
+
+private:
+    PacketBuf* buf;
+
+    void AddRef()
+    {
+        if (buf != nullptr)
+            buf->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void Release();
+};
+
+// Fixed size classes of preallocated buffers with lock-free free lists.
+// Requests beyond a class's capacity fall back to the heap and are counted.
+class BufferPool
+{
+public:
+    static constexpr size_t CLASSES = 5;
+    static constexpr size_t MIN_WORDS = 256;        // class n holds MIN_WORDS << 2n words
+    static constexpr size_t MAX_WORDS = MIN_WORDS << (2 * (CLASSES - 1));
+
+    // All classes share one slab placed according to policy
+    explicit BufferPool(size_t buffers_per_class = 32, const MemPolicy& policy = MemPolicy());
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Handle with size() == words, contents uninitialised
+    PacketRef Get(size_t words);
+
+    static BufferPool& Default();
+    // Pool whose slab is placed on node, created on first use and kept for
+    // the life of the process. Default() serves its own node and node -1.
+    static BufferPool& ForNode(int node);
+    // The pool of the node the calling thread runs on
+    static BufferPool& Local() {return ForNode(CurrentNumaNode());}
+
+    struct Stats
+    {
+        size_t words;
+        size_t buffers;
+        size_t in_use;
+        uint64_t misses;            // served from the heap
+    };
+    Stats ClassStats(size_t size_class) const;
+    const MemPlacement& Placement() const {return placement;}
+
+private:
+    friend class PacketRef;
+
+    struct alignas(64) SizeClass
+    {
+        size_t words;
+        size_t count;
+        size_t stride;
+        uint8_t* slab;
+        std::atomic<uint64_t> head;     // tag << 32 | (index + 1)
+        std::atomic<size_t> in_use;
+        std::atomic<uint64_t> misses;
+    };
+
+    SizeClass classes[CLASSES];
+    uint8_t* slab;
+    MemPlacement placement;
+
+    PacketBuf* At(const SizeClass& cls, uint32_t index) const
+    {
+        return reinterpret_cast<PacketBuf*>(cls.slab + index * cls.stride);
+    }
+
+    PacketBuf* Pop(SizeClass& cls);
+    void Push(SizeClass& cls, PacketBuf* buf);
+    static void Recycle(PacketBuf* buf);
+};
+
+inline void PacketRef::Release()
+{
+    if (buf != nullptr && buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        BufferPool::Recycle(buf);
+}
+
+#endif // BUFPOOL_H
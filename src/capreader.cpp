@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "blockcodec.h"
+#include "capreader.h"
+#include "mapfile.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+
+CaptureReader::CaptureReader()
+: pool(BufferPool::Default())
+, region(nullptr)
+, region_size(0)
+, size(0)
+, header()
+, samples(0)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+    Close();
+}
+
+bool CaptureReader::Open(const string& path)
+{
+#ifdef __linux__
+    Close();
+
+    if (!LoadIndex(path) || !MapData(path))
+    {
+        Close();
+        return false;
+    }
+
+    // count the samples after the last seek point
+    samples = 0;
+    if (!seeks.empty() && !Walk(seeks.back(), UINT64_MAX, UINT64_MAX, nullptr))
+        printf("%s: capture ends in a partial packet\r\n", path.c_str());
+    return true;
+#else
+    printf("Capture replay needs mmap, not available on this platform: %s\r\n", path.c_str());
+    return false;
+#endif
+}
+
+void CaptureReader::Close()
+{
+#ifdef __linux__
+    if (region != nullptr)
+        munmap(region, region_size);
+#endif
+    region = nullptr;
+    region_size = 0;
+    size = 0;
+    seeks.clear();
+    messages.clear();
+    samples = 0;
+}
+
+bool CaptureReader::LoadIndex(const string& path)
+{
+    string name = path + ".idx";
+    FILE* file = fopen(name.c_str(), "rb");
+    if (file == nullptr)
+    {
+        printf("Failed to open %s (%s)\r\n", name.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "SDRIDX1", sizeof(header.magic)) != 0)
+    {
+        printf("%s is not a capture index\r\n", name.c_str());
+        fclose(file);
+        return false;
+    }
+
+    CaptureIndexEntry entry;
+    while (fread(&entry, sizeof(entry), 1, file) == 1)
+    {
+        if (SDR_HEADER::IsCmd(entry.header))
+            messages.push_back(entry);
+        else
+            seeks.push_back(entry);
+    }
+    fclose(file);
+    return true;
+}
+
+bool CaptureReader::MapData(const string& path)
+{
+#ifdef __linux__
+    vector<string> names;
+    vector<size_t> sizes;
+
+    for (size_t idx = 0; ; ++idx)
+    {
+        string name = path;
+        if (header.file_bytes != 0)
+        {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), ".%04zu", idx);
+            name += suffix;
+        }
+        struct stat st;
+        if (stat(name.c_str(), &st) != 0)
+            break;
+        // rotated files are exactly file_bytes, only the last one is short
+        if (!sizes.empty() && sizes.back() != header.file_bytes)
+        {
+            printf("%s follows a short file\r\n", name.c_str());
+            return false;
+        }
+        names.push_back(name);
+        sizes.push_back(st.st_size);
+        size += st.st_size;
+        if (header.file_bytes == 0)
+            break;
+    }
+    if (names.empty())
+    {
+        printf("No capture data at %s\r\n", path.c_str());
+        return false;
+    }
+
+    // reserve the whole range, then lay the files over it
+    region_size = max<size_t>(size, 1);
+    void* base = mmap(nullptr, region_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        printf("Failed to reserve %zu bytes for %s\r\n", size, path.c_str());
+        region_size = 0;
+        return false;
+    }
+    region = static_cast<uint8_t*>(base);
+
+    size_t offset = 0;
+    for (size_t idx = 0; idx < names.size(); ++idx)
+    {
+        if (sizes[idx] > 0 && !MapFileAt(names[idx], region + offset, sizes[idx]))
+            return false;
+        offset += sizes[idx];
+    }
+    return true;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+CaptureReader::time_point CaptureReader::Begin() const
+{
+    return time_point(chrono::duration_cast<time_point::duration>(
+        chrono::nanoseconds(seeks.empty()? 0: seeks.front().time_ns)));
+}
+
+CaptureReader::time_point CaptureReader::End() const
+{
+    return time_point(chrono::duration_cast<time_point::duration>(
+        chrono::nanoseconds(seeks.empty()? 0: seeks.back().time_ns)));
+}
+
+uint64_t CaptureReader::SampleAt(time_point t) const
+{
+    if (seeks.empty())
+        return 0;
+
+    int64_t ns = chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch()).count();
+    auto next = upper_bound(seeks.begin(), seeks.end(), ns,
+                            [](int64_t value, const CaptureIndexEntry& entry) {return value < entry.time_ns;});
+    if (next == seeks.begin())
+        return 0;
+    auto prev = next - 1;
+
+    // past the last seek point: no later timestamp to interpolate against
+    uint64_t next_sample = (next == seeks.end())? samples: next->sample;
+    int64_t next_time = (next == seeks.end())? prev->time_ns: next->time_ns;
+    if (next_time <= prev->time_ns)
+        return prev->sample;
+
+    double fraction = min(1.0, static_cast<double>(ns - prev->time_ns) / (next_time - prev->time_ns));
+    return prev->sample + static_cast<uint64_t>(fraction * (next_sample - prev->sample));
+}
+
+vector<CaptureIndexEntry> CaptureReader::Messages(uint64_t first, uint64_t last) const
+{
+    auto less = [](const CaptureIndexEntry& entry, uint64_t sample) {return entry.sample < sample;};
+    auto begin = lower_bound(messages.begin(), messages.end(), first, less);
+    auto end = lower_bound(begin, messages.end(), last, less);
+    return vector<CaptureIndexEntry>(begin, end);
+}
+
+bool CaptureReader::Replay(uint64_t first, uint64_t count, IPacketStream::Callback_t callback)
+{
+    if (seeks.empty() || first >= samples)
+        return true;
+    uint64_t end = (count > samples - first)? samples: first + count;
+
+    // last seek point at or before first
+    auto from = upper_bound(seeks.begin(), seeks.end(), first,
+                            [](uint64_t sample, const CaptureIndexEntry& entry) {return sample < entry.sample;});
+    if (from != seeks.begin())
+        --from;
+
+    // messages recorded right at first come before the seek point's frame
+    auto message = lower_bound(messages.begin(), messages.end(), first,
+                               [](const CaptureIndexEntry& entry, uint64_t sample) {return entry.sample < sample;});
+    CaptureIndexEntry start = *from;
+    if (message != messages.end() && message->sample == first && message->offset < start.offset)
+    {
+        start = *message;
+        start.sample = first;
+    }
+    return Walk(start, first, end, &callback);
+}
+
+bool CaptureReader::Replay(time_point start, chrono::nanoseconds length, IPacketStream::Callback_t callback)
+{
+    uint64_t first = SampleAt(start);
+    uint64_t last = SampleAt(start + chrono::duration_cast<time_point::duration>(length));
+    return Replay(first, last - first, callback);
+}
+
+// Without a callback only counts the samples to the end of the data
+bool CaptureReader::Walk(const CaptureIndexEntry& from, uint64_t first, uint64_t end,
+                         IPacketStream::Callback_t* callback)
+{
+    uint64_t offset = from.offset;
+    uint64_t sample = from.sample;
+    const bool compressed = header.flags & INDEX_COMPRESSED;
+
+    while (offset + sizeof(uint32_t) <= size && sample < end)
+    {
+        uint32_t word;
+        memcpy(&word, region + offset, sizeof(word));
+
+        if (SDR_HEADER::IsCmd(word))
+        {
+            size_t bytes = (1 + F2CPU(word).num()) * sizeof(uint32_t);
+            if (offset + bytes > size)
+                return false;
+            if (callback && sample >= first)
+            {
+                PacketRef packet = pool.Get(bytes / sizeof(uint32_t));
+                memcpy(packet.data(), region + offset, bytes);
+                packet.msgId(F2CPU(word).id());
+                packet.IsMessage(true);
+                (*callback)(packet.msgId(), packet);
+            }
+            offset += bytes;
+            continue;
+        }
+
+        size_t count = F2FIFO(word).num();
+        size_t bytes = compressed? 0: sizeof(uint32_t) + count * sizeof(uint32_t);
+        if (compressed)
+        {
+            if (offset + 2 * sizeof(uint32_t) > size)
+                return false;
+            uint32_t encoded;
+            memcpy(&encoded, region + offset + sizeof(uint32_t), sizeof(encoded));
+            bytes = 2 * sizeof(uint32_t) + (encoded + 3) / 4 * 4;
+        }
+        if (offset + bytes > size)
+            return false;
+
+        if (callback && sample + count > first)
+        {
+            size_t skip = (first > sample)? first - sample: 0;
+            size_t take = min<uint64_t>(count, end - sample) - skip;
+            bool ok = true;
+            PacketRef packet = Stream(offset, count, skip, take, ok);
+            if (!ok)
+                return false;
+            (*callback)(0, packet);
+        }
+
+        offset += bytes;
+        sample += count;
+        if (!callback)
+            samples = sample;
+    }
+    return offset == size || sample >= end;
+}
+
+// Samples [skip, skip + take) of the stream record at offset
+PacketRef CaptureReader::Stream(uint64_t offset, size_t count, size_t skip, size_t take, bool& ok)
+{
+    PacketRef packet = pool.Get(take);
+    packet.msgId(0);
+    packet.IsMessage(false);
+    ok = true;
+
+    if (!(header.flags & INDEX_COMPRESSED))
+    {
+        memcpy(packet.data(), region + offset + (1 + skip) * sizeof(uint32_t), take * sizeof(uint32_t));
+        return packet;
+    }
+
+    uint32_t encoded;
+    memcpy(&encoded, region + offset + sizeof(uint32_t), sizeof(encoded));
+    const uint8_t* block = region + offset + 2 * sizeof(uint32_t);
+
+    if (skip == 0 && take == count)
+    {
+        ok = BlockCodec::DecodeBlock(block, encoded, packet.data(), count);
+        return packet;
+    }
+    // blocks decode whole: trim a copy
+    PacketRef whole = pool.Get(count);
+    ok = BlockCodec::DecodeBlock(block, encoded, whole.data(), count);
+    memcpy(packet.data(), whole.data() + skip, take * sizeof(uint32_t));
+    return packet;
+}
@@ -0,0 +1,57 @@
+#ifndef CAPREADER_H
+#define CAPREADER_H
+
+#include <string>
+#include <vector>
+#include "recorder.h"
+#include "streamer.h"
+
+// Seekable replay of a Recorder capture. The path.idx index maps samples
+// and arrival times to byte offsets, so a window of an hour-long capture
+// costs a binary search and the pages of that window; the rotated data
+// files are mapped back to back as one stream.
+class CaptureReader
+{
+public:
+    typedef chrono::system_clock::time_point time_point;
+
+    CaptureReader();
+    ~CaptureReader();
+
+    // path as given to Recorder::Config
+    bool Open(const string& path);
+    void Close();
+
+    uint64_t Samples() const {return samples;}
+    time_point Begin() const;
+    time_point End() const;
+
+    // Sample that arrived at t, interpolated between seek points
+    uint64_t SampleAt(time_point t) const;
+    // Index entries of the messages recorded in [first, last)
+    vector<CaptureIndexEntry> Messages(uint64_t first, uint64_t last) const;
+
+    // Delivers samples [first, first + count) and the messages recorded
+    // among them on the calling thread; packets at the edges are trimmed.
+    // false on a corrupt capture.
+    bool Replay(uint64_t first, uint64_t count, IPacketStream::Callback_t callback);
+    bool Replay(time_point start, chrono::nanoseconds length, IPacketStream::Callback_t callback);
+
+private:
+    BufferPool& pool;
+    uint8_t* region;                // all data files, back to back
+    size_t region_size;
+    size_t size;
+    CaptureIndexHeader header;
+    vector<CaptureIndexEntry> seeks;
+    vector<CaptureIndexEntry> messages;
+    uint64_t samples;
+
+    bool LoadIndex(const string& path);
+    bool MapData(const string& path);
+    // Walks packets from an index entry, delivering the ones in range
+    bool Walk(const CaptureIndexEntry& from, uint64_t first, uint64_t end, IPacketStream::Callback_t* callback);
+    PacketRef Stream(uint64_t offset, size_t count, size_t skip, size_t take, bool& ok);
+};
+
+#endif // CAPREADER_H
@@ -0,0 +1,523 @@
+#include <algorithm>
+#include <assert.h>
+#include "coro.h"
+#include "hugemem.h"
+
+using namespace std;
+
+
+IoOp::IoOp(EventLoop& loop, FT_HANDLE handle, uint8_t endpoint)
+: loop(loop)
+, handle(handle)
+, endpoint(endpoint)
+, pending(false)
+, waiter(nullptr)
+{
+    memset(&overlapped, 0, sizeof(overlapped));
+    initialized = (FT_OK == FT_InitializeOverlapped(handle, &overlapped));
+    if (!initialized)
+        printf("Failed to set up overlapped I/O on pipe 0x%02x\r\n", endpoint);
+}
+
+IoOp::~IoOp()
+{
+    if (pending)
+    {
+        loop.Forget(this);
+        FT_AbortPipe(handle, endpoint);
+        ULONG count = 0;
+        FT_GetOverlappedResult(handle, &overlapped, &count, true);
+    }
+    if (initialized)
+        FT_ReleaseOverlapped(handle, &overlapped);
+}
+
+void IoOp::Submit(void* buffer, size_t bytes)
+{
+    assert(!pending);
+    result = IoResult();
+    waiter = nullptr;
+
+    if (!initialized)
+    {
+        result.status = FT_OTHER_ERROR;
+        return;
+    }
+
+    ULONG count = 0;
+    FT_STATUS status = (endpoint & 0x80)?
+        FT_ReadPipe(handle, endpoint, static_cast<PUCHAR>(buffer), bytes, &count, &overlapped):
+        FT_WritePipe(handle, endpoint, static_cast<PUCHAR>(buffer), bytes, &count, &overlapped);
+
+    if (status == FT_IO_PENDING)
+    {
+        pending = true;
+        loop.io.push_back(this);
+        return;
+    }
+
+    result.status = status;
+    result.bytes = count;
+}
+
+bool IoOp::Poll()
+{
+    ULONG count = 0;
+    FT_STATUS status = FT_GetOverlappedResult(handle, &overlapped, &count, false);
+    if (status == FT_IO_INCOMPLETE)
+        return false;
+
+    result.status = status;
+    result.bytes = count;
+    pending = false;
+    return true;
+}
+
+
+EventLoop::EventLoop(const WaitConfig& wait)
+: config(wait)
+, has_posted(false)
+, wake(wait)
+, stopping(false)
+, running(false)
+, run_thread(nullptr)
+{
+}
+
+EventLoop::~EventLoop()
+{
+    Stop();
+    // frames hold IoOps that unregister from io, so they go first
+    tasks.clear();
+    spawned.clear();
+}
+
+void EventLoop::Spawn(Task<> task)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        spawned.push_back(move(task));
+        has_posted.store(true, memory_order_release);
+    }
+    wake.Notify();
+}
+
+void EventLoop::Post(coroutine_handle<> coro)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        posted.push_back(coro);
+        has_posted.store(true, memory_order_release);
+    }
+    wake.Notify();
+}
+
+void EventLoop::Run()
+{
+    Loop(true);
+}
+
+void EventLoop::Start(const ThreadPolicy& policy)
+{
+    assert(run_thread == nullptr);
+    run_thread = new std::thread([this, policy]
+    {
+        ApplyThreadPolicy(policy);
+        printf("%s\r\n", DescribeThread().c_str());
+        Loop(false);
+    });
+}
+
+void EventLoop::Stop()
+{
+    stopping.store(true, memory_order_release);
+    wake.Notify();
+
+    if (run_thread != nullptr)
+    {
+        if (run_thread->joinable())
+            run_thread->join();
+        delete run_thread;
+        run_thread = nullptr;
+    }
+}
+
+EventLoop::TimerId EventLoop::AddTimer(clock::time_point deadline, function<void()> fn)
+{
+    return timers.emplace(deadline, move(fn));
+}
+
+Task<IoResult> EventLoop::Read(FT_HANDLE handle, uint8_t endpoint, void* buffer, size_t bytes)
+{
+    IoOp op(*this, handle, endpoint);
+    op.Submit(buffer, bytes);
+    co_return co_await op;
+}
+
+Task<IoResult> EventLoop::Write(FT_HANDLE handle, uint8_t endpoint, const void* buffer, size_t bytes)
+{
+    IoOp op(*this, handle, endpoint);
+    op.Submit(const_cast<void*>(buffer), bytes);
+    co_return co_await op;
+}
+
+void EventLoop::Loop(bool until_idle)
+{
+    loop_thread = this_thread::get_id();
+    running.store(true, memory_order_release);
+
+    while (!stopping.load(memory_order_acquire))
+    {
+        TakePosted();
+        while (!ready.empty())
+        {
+            coroutine_handle<> coro = ready.front();
+            ready.pop_front();
+            coro.resume();
+        }
+
+        PollIo();
+        FireTimers();
+
+        tasks.erase(remove_if(tasks.begin(), tasks.end(), [](const Task<>& task) {return task.Done();}),
+                    tasks.end());
+
+        if (!ready.empty())
+            continue;
+        if (until_idle && tasks.empty() && !has_posted.load(memory_order_acquire))
+            break;
+        Idle();
+    }
+
+    running.store(false, memory_order_release);
+    loop_thread = std::thread::id();
+}
+
+bool EventLoop::TakePosted()
+{
+    if (!has_posted.load(memory_order_acquire))
+        return false;
+
+    lock_guard<mutex> guard(lock);
+    ready.insert(ready.end(), posted.begin(), posted.end());
+    posted.clear();
+    for (auto& task: spawned)
+    {
+        ready.push_back(task.coro);
+        tasks.push_back(move(task));
+    }
+    spawned.clear();
+    has_posted.store(false, memory_order_relaxed);
+    return true;
+}
+
+void EventLoop::PollIo()
+{
+    for (size_t idx = 0; idx < io.size();)
+    {
+        IoOp* op = io[idx];
+        if (!op->Poll())
+        {
+            ++idx;
+            continue;
+        }
+        io[idx] = io.back();
+        io.pop_back();
+        if (op->waiter)
+            ready.push_back(exchange(op->waiter, nullptr));
+    }
+}
+
+void EventLoop::FireTimers()
+{
+    auto now = clock::now();
+    while (!timers.empty() && timers.begin()->first <= now)
+    {
+        auto fn = move(timers.begin()->second);
+        timers.erase(timers.begin());
+        fn();
+    }
+}
+
+// The driver does not signal completions to us, so with transfers in
+// flight the loop wakes every poll_period to check on them
+void EventLoop::Idle()
+{
+    auto deadline = timers.empty()? clock::time_point::max(): timers.begin()->first;
+    if (!io.empty())
+        deadline = min(deadline, clock::now() + poll_period);
+
+    wake.WaitUntil([this]
+    {
+        return has_posted.load(memory_order_acquire) || stopping.load(memory_order_acquire);
+    }, deadline);
+}
+
+void EventLoop::Forget(IoOp* op)
+{
+    io.erase(remove(io.begin(), io.end(), op), io.end());
+}
+
+
+AsyncDevice::AsyncDevice(EventLoop& loop, FT_HANDLE handle, uint8_t channel)
+: loop(loop)
+, handle(handle)
+, channel(channel)
+, pool(BufferPool::Default())
+, parser(handle, [this](uint8_t msgId, const PacketRef& body) {Deliver(msgId, body);},
+         IPacketStream::SOURCE::EXTERNAL)
+, tx_op(loop, handle, 0x02 + channel)
+, tx_busy(false)
+, dropped(0)
+, stopping(false)
+, pumping(false)
+, pump_done(WaitConfig{WaitMode::BLOCK, 0})
+{
+}
+
+AsyncDevice::~AsyncDevice()
+{
+    Stop();
+    assert(!loop.InLoop());
+    if (loop.Running())
+        pump_done.Wait([this] {return !pumping.load(memory_order_acquire);});
+}
+
+void AsyncDevice::Start()
+{
+    if (pumping.exchange(true))
+        return;
+    stopping = false;
+    loop.Spawn(Pump());
+}
+
+void AsyncDevice::Stop()
+{
+    stopping = true;
+    if (pumping)
+        FT_AbortPipe(handle, 0x82 + channel);
+}
+
+// Two reads stay queued in the driver: one fills while the other is parsed
+Task<> AsyncDevice::Pump()
+{
+    {
+        static const size_t BYTES = 32 * 1024;
+        const uint8_t endpoint = 0x82 + channel;
+        HugeBuffer<uint8_t> first(BYTES), second(BYTES);
+        IoOp first_op(loop, handle, endpoint), second_op(loop, handle, endpoint);
+        uint8_t* buffers[2] = {first.get(), second.get()};
+        IoOp* slots[2] = {&first_op, &second_op};
+
+        for (int idx = 0; idx < 2; ++idx)
+            slots[idx]->Submit(buffers[idx], BYTES);
+
+        for (int idx = 0; !stopping; idx ^= 1)
+        {
+            IoOp& slot = *slots[idx];
+            IoResult result = co_await slot;
+            if (!result.ok() && result.status != FT_TIMEOUT)
+                break;
+
+            parser.Feed(buffers[idx], result.bytes);
+            if (stopping)
+                break;
+            slot.Submit(buffers[idx], BYTES);
+        }
+        // the slot still queued is aborted here, before the buffers go
+    }
+
+    while (!readers.empty())
+    {
+        loop.Resume(readers.front()->waiter);
+        readers.pop_front();
+    }
+    for (auto& queue: replies)
+    {
+        while (!queue.empty())
+            queue.front()->Complete(PacketRef());
+    }
+
+    printf("Async read stopped\r\n");
+    pumping.store(false, memory_order_release);
+    pump_done.Notify();
+}
+
+// Runs on the loop from parser.Feed()
+void AsyncDevice::Deliver(uint8_t msgId, const PacketRef& body)
+{
+    if (body.IsMessage())
+    {
+        auto& queue = replies[msgId & 7];
+        if (!queue.empty())
+        {
+            queue.front()->Complete(body);
+            return;
+        }
+    }
+
+    if (!readers.empty())
+    {
+        PacketAwaiter* reader = readers.front();
+        readers.pop_front();
+        reader->packet = body;
+        loop.Resume(reader->waiter);
+        return;
+    }
+
+    if (backlog.size() >= BACKLOG)
+    {
+        backlog.pop_front();
+        ++dropped;
+    }
+    backlog.push_back(body);
+}
+
+bool AsyncDevice::PacketAwaiter::await_ready()
+{
+    if (!dev.backlog.empty())
+    {
+        packet = move(dev.backlog.front());
+        dev.backlog.pop_front();
+        return true;
+    }
+    return !dev.pumping.load(memory_order_acquire);
+}
+
+Task<bool> AsyncDevice::Send(const uint32_t* words, size_t count)
+{
+    size_t done = 0;
+
+    while (done < count)
+    {
+        // as many frames as fit one pooled buffer go out in one transfer
+        size_t chunk = min(count - done, BATCH_FRAMES * FRAME_WORDS);
+        PacketRef frames = pool.Get(chunk + (chunk + FRAME_WORDS - 1) / FRAME_WORDS);
+        uint32_t* out = frames.data();
+
+        for (size_t pos = 0; pos < chunk; pos += FRAME_WORDS)
+        {
+            size_t elems = min(FRAME_WORDS, chunk - pos);
+            *out++ = F2FIFO(static_cast<uint16_t>(elems));
+            out = copy(words + done + pos, words + done + pos + elems, out);
+        }
+
+        if (!co_await Transmit(move(frames)))
+            co_return false;
+        done += chunk;
+    }
+
+    co_return true;
+}
+
+Task<bool> AsyncDevice::SendMessage(uint8_t msgId, vector<uint32_t> data)
+{
+    if (!F2CPU::Fits(msgId, data.size()))
+        co_return false;
+    PacketRef packet = pool.Get(data.size() + 1);
+
+    packet[0] = F2CPU(msgId, data.size());
+    copy(data.begin(), data.end(), packet.begin() + 1);
+    co_return co_await Transmit(move(packet));
+}
+
+Task<PacketRef> AsyncDevice::Request(uint8_t msgId, vector<uint32_t> data, chrono::milliseconds timeout)
+{
+    // registered before sending: the reply may be parsed before the write completes
+    Reply reply(*this, msgId, timeout);
+
+    if (!co_await SendMessage(msgId, move(data)))
+        co_return PacketRef();
+    co_return co_await reply;
+}
+
+// Writes one buffer; the lock keeps concurrent senders from interleaving
+// partial transfers
+Task<bool> AsyncDevice::Transmit(PacketRef frame)
+{
+    co_await TxLock{*this};
+
+    auto bytes = reinterpret_cast<uint8_t*>(frame.data());
+    size_t size = frame.size() * sizeof(uint32_t);
+    size_t sent = 0;
+    bool ok = true;
+
+    while (sent < size)
+    {
+        tx_op.Submit(bytes + sent, size - sent);
+        IoResult result = co_await tx_op;
+        if (!result.ok() || result.bytes == 0)
+        {
+            ok = false;
+            break;
+        }
+        sent += result.bytes;
+    }
+
+    ReleaseTx();
+    co_return ok;
+}
+
+bool AsyncDevice::TxLock::await_ready()
+{
+    if (dev.tx_busy)
+        return false;
+    dev.tx_busy = true;
+    return true;
+}
+
+// Ownership passes straight to the next waiting sender
+void AsyncDevice::ReleaseTx()
+{
+    if (tx_waiters.empty())
+    {
+        tx_busy = false;
+        return;
+    }
+    loop.Resume(tx_waiters.front());
+    tx_waiters.pop_front();
+}
+
+
+AsyncDevice::Reply::Reply(AsyncDevice& dev, uint8_t msgId, chrono::milliseconds timeout)
+: dev(dev)
+, msgId(msgId)
+, done(false)
+, armed(true)
+, waiter(nullptr)
+{
+    dev.replies[msgId & 7].push_back(this);
+    timer = dev.loop.AddTimer(EventLoop::clock::now() + timeout, [this]
+    {
+        armed = false;
+        Complete(PacketRef());
+    });
+}
+
+AsyncDevice::Reply::~Reply()
+{
+    Cancel();
+}
+
+void AsyncDevice::Reply::Cancel()
+{
+    if (done)
+        return;
+    done = true;
+
+    auto& queue = dev.replies[msgId & 7];
+    queue.erase(find(queue.begin(), queue.end(), this));
+    if (armed)
+        dev.loop.CancelTimer(timer);
+    armed = false;
+}
+
+void AsyncDevice::Reply::Complete(PacketRef reply)
+{
+    if (done)
+        return;
+    Cancel();
+    packet = move(reply);
+    if (waiter)
+        dev.loop.Resume(waiter);
+}
@@ -0,0 +1,361 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "streamer.h"
+
+template <typename T = void>
+class Task;
+
+struct TaskPromiseBase
+{
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept {return {};}
+
+    // Hands control straight to whoever awaited the task
+    struct FinalAwaiter
+    {
+        std::coroutine_handle<> next;
+
+        bool await_ready() noexcept {return false;}
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept
+        {
+            return next? next: std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept {return FinalAwaiter{continuation};}
+
+    void unhandled_exception() {std::terminate();}
+};
+
+template <typename T>
+struct TaskPromise: TaskPromiseBase
+{
+    T value{};
+
+    Task<T> get_return_object();
+    void return_value(T result) {value = std::move(result);}
+    T Result() {return std::move(value);}
+};
+
+template <>
+struct TaskPromise<void>: TaskPromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() {}
+    void Result() {}
+};
+
+// Lazily started coroutine: the body runs when the task is awaited or
+// handed to EventLoop::Spawn, and resumes its awaiter when it returns.
+template <typename T>
+class Task
+{
+public:
+    typedef TaskPromise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    Task(): coro(nullptr) {}
+    explicit Task(handle_type coro): coro(coro) {}
+    Task(Task&& other) noexcept: coro(std::exchange(other.coro, nullptr)) {}
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (coro)
+                coro.destroy();
+            coro = std::exchange(other.coro, nullptr);
+        }
+        return *this;
+    }
+    ~Task() {if (coro) coro.destroy();}
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    bool Done() const {return !coro || coro.done();}
+
+    bool await_ready() const noexcept {return Done();}
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        coro.promise().continuation = awaiting;
+        return coro;
+    }
+    T await_resume() {return coro.promise().Result();}
+
+private:
+    friend class EventLoop;
+    handle_type coro;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+
+struct IoResult
+{
+    FT_STATUS status = FT_OK;
+    ULONG bytes = 0;
+
+    bool ok() const {return status == FT_OK;}
+};
+
+class EventLoop;
+
+// One overlapped FT_ReadPipe/FT_WritePipe slot. Submit() starts a transfer,
+// co_await collects it. Several slots per pipe keep the driver busy while the
+// previous buffer is being processed.
+class IoOp
+{
+public:
+    IoOp(EventLoop& loop, FT_HANDLE handle, uint8_t endpoint);
+    // aborts the pipe if a transfer is still outstanding
+    ~IoOp();
+
+    IoOp(const IoOp&) = delete;
+    IoOp& operator=(const IoOp&) = delete;
+
+    // IN endpoints (0x8x) read into buffer, OUT endpoints write from it
+    void Submit(void* buffer, size_t bytes);
+    bool Pending() const {return pending;}
+
+    bool await_ready() const noexcept {return !pending;}
+    void await_suspend(std::coroutine_handle<> awaiting) noexcept {waiter = awaiting;}
+    IoResult await_resume() const {return result;}
+
+private:
+    friend class EventLoop;
+    EventLoop& loop;
+    FT_HANDLE handle;
+    const uint8_t endpoint;
+    OVERLAPPED overlapped;
+    bool initialized;
+    bool pending;
+    IoResult result;
+    std::coroutine_handle<> waiter;
+
+    // false while the driver is still working on it
+    bool Poll();
+};
+
+// Single-threaded executor for coroutines. Everything a task does between
+// two co_await points runs on the loop thread, so tasks share state without
+// locks. Transfers are overlapped FTD3XX calls polled by the loop; between
+// polls the loop idles according to its WaitConfig.
+class EventLoop
+{
+public:
+    typedef std::chrono::steady_clock clock;
+    typedef std::multimap<clock::time_point, std::function<void()>>::iterator TimerId;
+
+    explicit EventLoop(const WaitConfig& wait = WaitConfig::Default());
+    // Stops the loop; tasks that never finished are destroyed
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Thread-safe. The loop owns the task and starts it on the loop thread.
+    void Spawn(Task<> task);
+
+    // Runs on the calling thread until Stop() or until all spawned tasks finished
+    void Run();
+    // Runs on a dedicated thread until Stop()
+    void Start(const ThreadPolicy& policy = ThreadPolicy("sdr-loop"));
+    // Thread-safe, joins the dedicated thread
+    void Stop();
+    bool Running() const {return running.load(std::memory_order_acquire);}
+    bool InLoop() const {return loop_thread == std::this_thread::get_id();}
+
+    // co_await loop.Schedule() continues on the loop thread; thread-safe
+    struct ScheduleAwaiter
+    {
+        EventLoop& loop;
+
+        bool await_ready() const noexcept {return false;}
+        void await_suspend(std::coroutine_handle<> awaiting) {loop.Post(awaiting);}
+        void await_resume() const noexcept {}
+    };
+    ScheduleAwaiter Schedule() {return ScheduleAwaiter{*this};}
+
+    struct SleepAwaiter
+    {
+        EventLoop& loop;
+        clock::time_point deadline;
+
+        bool await_ready() const noexcept {return clock::now() >= deadline;}
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            loop.AddTimer(deadline, [this, awaiting] {loop.Resume(awaiting);});
+        }
+        void await_resume() const noexcept {}
+    };
+    SleepAwaiter Sleep(clock::duration period) {return SleepAwaiter{*this, clock::now() + period};}
+
+    // Single transfers; for back-to-back transfers keep IoOp slots instead
+    Task<IoResult> Read(FT_HANDLE handle, uint8_t endpoint, void* buffer, size_t bytes);
+    Task<IoResult> Write(FT_HANDLE handle, uint8_t endpoint, const void* buffer, size_t bytes);
+
+    // Loop thread only
+    TimerId AddTimer(clock::time_point deadline, std::function<void()> fn);
+    void CancelTimer(TimerId id) {timers.erase(id);}
+    void Resume(std::coroutine_handle<> coro) {ready.push_back(coro);}
+
+    // Any thread
+    void Post(std::coroutine_handle<> coro);
+
+private:
+    friend class IoOp;
+    const WaitConfig config;
+    const clock::duration poll_period{std::chrono::microseconds(50)};
+
+    // loop thread
+    std::vector<Task<>> tasks;
+    std::deque<std::coroutine_handle<>> ready;
+    std::vector<IoOp*> io;
+    std::multimap<clock::time_point, std::function<void()>> timers;
+
+    // other threads
+    std::mutex lock;
+    std::vector<std::coroutine_handle<>> posted;
+    std::vector<Task<>> spawned;
+    std::atomic<bool> has_posted;
+    WaitPoint wake;
+
+    std::atomic<bool> stopping;
+    std::atomic<bool> running;
+    std::thread::id loop_thread;
+    std::thread* run_thread;
+
+    void Loop(bool until_idle);
+    bool TakePosted();
+    void PollIo();
+    void FireTimers();
+    void Idle();
+    void Forget(IoOp* op);
+};
+
+
+// Awaitable front end for one board: a read pump task feeds the packet
+// parser on the loop, and callers await packets, sends and message replies
+// instead of owning reader and writer threads.
+//   PacketRef packet = co_await dev.NextPacket();
+//   co_await dev.Send(words, count);
+//   PacketRef reply = co_await dev.Request(3, payload);
+// Tasks must be awaited from coroutines running on the loop. Pointers passed
+// to them must stay valid until they complete.
+class AsyncDevice
+{
+public:
+    AsyncDevice(EventLoop& loop, FT_HANDLE handle, uint8_t channel = 0);
+    // Waits for the read pump when the loop runs on another thread; with a
+    // stopped loop destroy the loop first
+    ~AsyncDevice();
+
+    // Spawns the read pump; thread-safe
+    void Start();
+    // Aborts the outstanding reads, pending NextPacket() calls return empty
+    void Stop();
+
+    // Next stream packet or message no Request() is waiting for; empty once stopped
+    struct PacketAwaiter
+    {
+        AsyncDevice& dev;
+        PacketRef packet;
+        std::coroutine_handle<> waiter;
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> awaiting) {waiter = awaiting; dev.readers.push_back(this);}
+        PacketRef await_resume() {return std::move(packet);}
+    };
+    PacketAwaiter NextPacket() {return PacketAwaiter{*this, PacketRef(), nullptr};}
+
+    // Frames the words into F2FIFO packets
+    Task<bool> Send(const uint32_t* words, size_t count);
+    // false if msgId or the payload does not fit an F2CPU header
+    Task<bool> SendMessage(uint8_t msgId, std::vector<uint32_t> data);
+    // Sends a message and waits for the next message with the same id.
+    // Replies to one id are matched in order; empty on timeout.
+    Task<PacketRef> Request(uint8_t msgId, std::vector<uint32_t> data,
+                            std::chrono::milliseconds timeout = std::chrono::milliseconds(100));
+
+    // Packets dropped because nobody was awaiting and the backlog was full
+    size_t Dropped() const {return dropped;}
+
+private:
+    static constexpr size_t BACKLOG = 1024;
+    static constexpr size_t FRAME_WORDS = 1023;     // same frames as OPacketStream
+    static constexpr size_t BATCH_FRAMES = 64;      // frames per USB transfer in Send()
+
+    struct Reply
+    {
+        AsyncDevice& dev;
+        const uint8_t msgId;
+        PacketRef packet;
+        bool done;
+        bool armed;
+        EventLoop::TimerId timer;
+        std::coroutine_handle<> waiter;
+
+        Reply(AsyncDevice& dev, uint8_t msgId, std::chrono::milliseconds timeout);
+        ~Reply();
+        void Complete(PacketRef reply);
+        // unregisters without resuming
+        void Cancel();
+
+        bool await_ready() const noexcept {return done;}
+        void await_suspend(std::coroutine_handle<> awaiting) {waiter = awaiting;}
+        PacketRef await_resume() {return std::move(packet);}
+    };
+
+    struct TxLock
+    {
+        AsyncDevice& dev;
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> awaiting) {dev.tx_waiters.push_back(awaiting);}
+        void await_resume() const noexcept {}
+    };
+
+    EventLoop& loop;
+    FT_HANDLE handle;
+    const uint8_t channel;
+    BufferPool& pool;
+    IPacketStream parser;
+
+    // loop thread
+    std::deque<PacketRef> backlog;
+    std::deque<PacketAwaiter*> readers;
+    std::deque<Reply*> replies[8];
+    IoOp tx_op;
+    bool tx_busy;
+    std::deque<std::coroutine_handle<>> tx_waiters;
+    size_t dropped;
+
+    std::atomic<bool> stopping;
+    std::atomic<bool> pumping;
+    WaitPoint pump_done;
+
+    Task<> Pump();
+    void Deliver(uint8_t msgId, const PacketRef& body);
+    Task<bool> Transmit(PacketRef frame);
+    void ReleaseTx();
+};
+
+#endif // CORO_H
@@ -0,0 +1,187 @@
+#include <assert.h>
+#include <string.h>
+#include "devmgr.h"
+
+using namespace std;
+
+
+DeviceManager::DeviceManager(Callback_t callback)
+: DeviceManager(callback, Config())
+{
+}
+
+DeviceManager::DeviceManager(Callback_t callback, const Config& config)
+: callback(callback)
+, config(config)
+{
+}
+
+DeviceManager::~DeviceManager()
+{
+    Close();
+}
+
+vector<string> DeviceManager::Enumerate()
+{
+    vector<string> serials;
+    DWORD count = 0;
+    FT_DEVICE_LIST_INFO_NODE nodes[16];
+
+    if (FT_OK != FT_CreateDeviceInfoList(&count) || count == 0)
+        return serials;
+
+    count = min<DWORD>(count, 16);
+    if (FT_OK != FT_GetDeviceInfoList(nodes, &count))
+        return serials;
+
+    for (DWORD idx = 0; idx < count; ++idx)
+        serials.push_back(string(nodes[idx].SerialNumber, strnlen(nodes[idx].SerialNumber, sizeof(nodes[idx].SerialNumber))));
+
+    return serials;
+}
+
+ThreadPolicy DeviceManager::Policy(const char* role, size_t device, int offset) const
+{
+    int core = (config.first_core < 0)? -1: config.first_core + 2 * device + offset;
+    return ThreadPolicy(string("sdr-") + role + to_string(device), core, config.priority);
+}
+
+bool DeviceManager::Open(const string& serial)
+{
+    FT_HANDLE handle = nullptr;
+
+    if (FT_OK != FT_Create(const_cast<char*>(serial.c_str()), FT_OPEN_BY_SERIAL_NUMBER, &handle) || !handle)
+    {
+        printf("Failed to open device %s\r\n", serial.c_str());
+        return false;
+    }
+
+    size_t index = devices.size();
+    unique_ptr<Device> dev(new Device());
+    Device* raw = dev.get();
+    dev->serial = serial;
+    dev->handle = handle;
+    dev->tx.reset(new OPacketStream(handle));
+    // readers of earlier devices are running: the callback must not index devices
+    dev->rx.reset(new IPacketStream(handle,
+        [this, raw, index](uint8_t msgId, const PacketRef& body) {Received(*raw, index, msgId, body);},
+        IPacketStream::SOURCE::USB, Policy("rx", index, 0)));
+    devices.push_back(move(dev));
+
+    printf("Device %zu: %s\r\n", index, serial.c_str());
+    return true;
+}
+
+bool DeviceManager::OpenAll(const vector<string>& serials)
+{
+    for (auto& serial: serials)
+    {
+        if (!Open(serial))
+            return false;
+    }
+    return true;
+}
+
+void DeviceManager::Close()
+{
+    stop.Request();
+
+    for (auto& dev: devices)
+    {
+        if (dev->tx_thread.joinable())
+            dev->tx_thread.join();
+        dev->rx.reset();
+        dev->tx.reset();
+        FT_Close(dev->handle);
+    }
+    devices.clear();
+    // every TX thread is joined: devices opened from now on run again
+    stop.Reset();
+}
+
+void DeviceManager::RunTx(size_t device, Producer_t producer)
+{
+    Device& dev = *devices[device];
+    assert(!dev.tx_thread.joinable());
+
+    ThreadPolicy policy = Policy("tx", device, 1);
+    dev.tx_thread = thread([this, &dev, device, producer, policy]
+    {
+        ApplyThreadPolicy(policy);
+        printf("%s\r\n", DescribeThread().c_str());
+
+        while (!stop && producer(device, *dev.tx))
+            ;
+        dev.tx->flush();
+    });
+}
+
+// Runs on the device's RX thread
+void DeviceManager::Received(Device& dev, size_t device, uint8_t msgId, const PacketRef& body)
+{
+    if (body.IsMessage())
+    {
+        if (msgId == config.sync_msg_id)
+        {
+            dev.sync_offset.store(dev.rx_words, memory_order_release);
+            synced.Notify();
+        }
+        if (callback)
+            callback(device, msgId, body, -1);
+        return;
+    }
+
+    int64_t sync = dev.sync_offset.load(memory_order_relaxed);
+    int64_t aligned = (sync < 0)? -1: static_cast<int64_t>(dev.rx_words) - sync;
+    dev.rx_words += body.size();
+
+    if (callback)
+        callback(device, msgId, body, aligned);
+}
+
+bool DeviceManager::Synchronize(size_t master, chrono::milliseconds timeout)
+{
+    if (master >= devices.size())
+        return false;
+
+    for (auto& dev: devices)
+        dev->sync_offset = -1;
+
+    FT_HANDLE handle = devices[master]->handle;
+    DWORD mask = 1 << config.sync_gpio;
+
+    if (FT_OK != FT_EnableGPIO(handle, mask, mask) ||
+        FT_OK != FT_WriteGPIO(handle, mask, 0) ||
+        FT_OK != FT_WriteGPIO(handle, mask, mask) ||
+        FT_OK != FT_WriteGPIO(handle, mask, 0))
+    {
+        printf("Failed to pulse trigger GPIO%u on %s\r\n", config.sync_gpio, devices[master]->serial.c_str());
+        return false;
+    }
+
+    bool all = synced.WaitFor([this]
+    {
+        for (auto& dev: devices)
+        {
+            if (dev->sync_offset.load(memory_order_acquire) < 0)
+                return false;
+        }
+        return true;
+    }, timeout);
+
+    for (size_t idx = 0; idx < devices.size(); ++idx)
+    {
+        int64_t offset = SyncOffset(idx);
+        if (offset < 0)
+            printf("Device %zu (%s) missed the trigger\r\n", idx, devices[idx]->serial.c_str());
+        else
+            printf("Device %zu (%s) synced at sample %lld\r\n", idx, devices[idx]->serial.c_str(), (long long)offset);
+    }
+
+    return all;
+}
+
+int64_t DeviceManager::SyncOffset(size_t device) const
+{
+    return devices[device]->sync_offset.load(memory_order_acquire);
+}
@@ -0,0 +1,76 @@
+#ifndef DEVMGR_H
+#define DEVMGR_H
+
+#include <string>
+#include <vector>
+#include "streamer.h"
+
+// Several FT60x boards streaming from one process. Each device gets its own
+// RX reader and TX engine thread on its own cores. Streams are aligned on a
+// shared trigger: the master raises a GPIO wired to every FPGA, and each FPGA
+// answers with a sync message whose position marks sample zero on that board.
+class DeviceManager
+{
+public:
+    // aligned: stream sample index of body[0] counted from the last sync, -1 before it
+    typedef std::function<void(size_t device, uint8_t msgId, const PacketRef& body, int64_t aligned)> Callback_t;
+    // Called repeatedly on the device's TX thread until it returns false
+    typedef std::function<bool(size_t device, OPacketStream& tx)> Producer_t;
+
+    struct Config
+    {
+        uint8_t sync_msg_id = 7;    // F2CPU id the FPGA sends when it sees the trigger
+        uint32_t sync_gpio = 0;     // master GPIO driving the shared trigger line
+        int first_core = -1;        // device n: RX on first_core + 2n, TX on the next core
+        int priority = 0;           // SCHED_FIFO priority for both engines
+    };
+
+    explicit DeviceManager(Callback_t callback);
+    DeviceManager(Callback_t callback, const Config& config);
+    ~DeviceManager();
+
+    static vector<string> Enumerate();
+
+    // Returns false (and logs) if the board cannot be opened
+    bool Open(const string& serial);
+    bool OpenAll(const vector<string>& serials);
+    // Stops and closes every device; Open() may be called again afterwards
+    void Close();
+
+    void RunTx(size_t device, Producer_t producer);
+
+    // Pulses the trigger and waits until every device has reported its sync message
+    bool Synchronize(size_t master = 0, chrono::milliseconds timeout = chrono::milliseconds(1000));
+
+    size_t Count() const {return devices.size();}
+    const string& Serial(size_t device) const {return devices[device]->serial;}
+    FT_HANDLE Handle(size_t device) const {return devices[device]->handle;}
+    OPacketStream& Tx(size_t device) {return *devices[device]->tx;}
+    // FT_OK while the device's reader runs, else the error that stopped it
+    FT_STATUS RxStatus(size_t device) const {return devices[device]->rx->Status();}
+    // Stream sample count on that device at the sync point, -1 if not synced
+    int64_t SyncOffset(size_t device) const;
+
+private:
+    struct Device
+    {
+        string serial;
+        FT_HANDLE handle;
+        unique_ptr<IPacketStream> rx;
+        unique_ptr<OPacketStream> tx;
+        thread tx_thread;
+        uint64_t rx_words = 0;              // RX thread only
+        atomic<int64_t> sync_offset{-1};
+    };
+
+    Callback_t callback;
+    const Config config;
+    vector<unique_ptr<Device>> devices;
+    StopFlag stop;
+    WaitPoint synced;
+
+    ThreadPolicy Policy(const char* role, size_t device, int offset) const;
+    void Received(Device& dev, size_t device, uint8_t msgId, const PacketRef& body);
+};
+
+#endif // DEVMGR_H
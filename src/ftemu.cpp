@@ -0,0 +1,782 @@
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <math.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "ftemu.h"
+#include "streamer.h"
+
+using namespace std;
+
+static const size_t CHANNELS = 4;
+static const size_t TONE_TABLE = 1024;      // one cycle
+static const char* SERIAL = "EMU00001";
+
+
+namespace
+{
+
+typedef chrono::steady_clock clock_type;
+
+struct Channel
+{
+    mutex lock;
+    condition_variable ready;
+    uint64_t aborts = 0;            // bumped by FT_AbortPipe on the IN endpoint
+
+    // IN side: answers and looped bytes go out between frames
+    deque<uint8_t> reply;
+    vector<uint32_t> frame;
+    size_t frame_pos = 0;           // bytes of frame already read
+    bool started = false;
+    clock_type::time_point start;
+    uint64_t generated = 0;         // stream words
+    uint32_t counter = 0;
+    uint32_t phase = 0;
+    uint32_t noise = 1;
+
+    // OUT side parser
+    uint8_t carry[4];
+    size_t carry_bytes = 0;
+    size_t skip = 0;                // stream payload bytes left in the current frame
+    size_t want = 0;                // message words left
+    vector<uint32_t> message;
+};
+
+struct Pending
+{
+    Channel* channel;
+    PUCHAR buffer;
+    ULONG bytes;
+    uint64_t aborts;
+};
+
+// Small seeds leave xorshift near zero for its first outputs (seed 1
+// rolls 6e-5), so they are spread over all 32 bits first
+static uint32_t MixSeed(uint32_t seed)
+{
+    seed ^= seed >> 16;
+    seed *= 0x7feb352du;
+    seed ^= seed >> 15;
+    seed *= 0x846ca68bu;
+    seed ^= seed >> 16;
+    return seed? seed: 1;
+}
+
+struct Device
+{
+    mutex lock;                     // config, chip, gpio, pending, rng
+    FtEmulator::Config config;
+    int16_t cosine[TONE_TABLE];
+    int16_t sine[TONE_TABLE];
+    Channel channels[CHANNELS];
+    FT_60XCONFIGURATION chip;
+    DWORD gpio_direction = 0;
+    DWORD gpio_level = 0;
+    map<LPOVERLAPPED, Pending> pending;
+    uint64_t transfers = 0;
+    uint32_t rng = 1;
+
+    atomic<uint64_t> read_bytes{0};
+    atomic<uint64_t> write_bytes{0};
+    atomic<uint64_t> frames{0};
+    atomic<uint64_t> messages{0};
+    atomic<uint64_t> errors{0};
+
+    Device()
+    {
+        memset(&chip, 0, sizeof(chip));
+        chip.VendorID = 0x0403;
+        chip.ProductID = 0x601f;
+        chip.FIFOClock = CONFIGURATION_FIFO_CLK_100;
+        chip.FIFOMode = CONFIGURATION_FIFO_MODE_600;
+        chip.ChannelConfig = CONFIGURATION_CHANNEL_CONFIG_4;
+        chip.OptionalFeatureSupport = CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN;
+        Apply(FtEmulator::Config::Default());
+    }
+
+    void Apply(const FtEmulator::Config& next)
+    {
+        config = next;
+        config.frame_words = min<size_t>(max<size_t>(config.frame_words, 1), 0xffff);
+        rng = MixSeed(config.seed);
+        // FIFOs start empty, so a new run does not begin mid-frame
+        for (size_t idx = 0; idx < CHANNELS; ++idx)
+        {
+            Channel& ch = channels[idx];
+            lock_guard<mutex> lock(ch.lock);
+            ch.reply.clear();
+            ch.frame.clear();
+            ch.frame_pos = 0;
+            ch.started = false;
+            ch.generated = 0;
+            ch.noise = rng + static_cast<uint32_t>(idx) * 0x9e3779b9u;
+            ch.carry_bytes = 0;
+            ch.skip = 0;
+            ch.want = 0;
+            ch.message.clear();
+        }
+        for (size_t idx = 0; idx < TONE_TABLE; ++idx)
+        {
+            double angle = 2 * M_PI * idx / TONE_TABLE;
+            cosine[idx] = static_cast<int16_t>(lround(config.amplitude * cos(angle)));
+            sine[idx] = static_cast<int16_t>(lround(config.amplitude * sin(angle)));
+        }
+    }
+};
+
+Device& Emu()
+{
+    static Device device;
+    return device;
+}
+
+}
+
+
+static uint32_t XorShift(uint32_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static void Generate(Device& dev, const FtEmulator::Config& config, Channel& ch)
+{
+    size_t words = config.frame_words;
+    ch.frame.resize(1 + words);
+    ch.frame[0] = F2FIFO(static_cast<uint16_t>(words));
+    uint32_t* out = ch.frame.data() + 1;
+
+    switch (config.pattern)
+    {
+        case FtEmulator::PATTERN::COUNTER:
+            // same ramp as DataReaderThreadArray
+            for (size_t idx = 0; idx < words; ++idx, ++ch.counter)
+            {
+                uint32_t val = ch.counter % 4096;
+                out[idx] = val + (val << 16);
+            }
+            break;
+        case FtEmulator::PATTERN::TONE:
+        {
+            uint32_t step = static_cast<uint32_t>(llround(config.tone * 4294967296.0));
+            for (size_t idx = 0; idx < words; ++idx, ch.phase += step)
+            {
+                size_t at = ch.phase >> 22;
+                out[idx] = IQ_SAMPLE::Pack(dev.cosine[at], dev.sine[at]);
+            }
+            break;
+        }
+        case FtEmulator::PATTERN::NOISE:
+            for (size_t idx = 0; idx < words; ++idx)
+            {
+                uint32_t r = XorShift(ch.noise);
+                int i = (static_cast<int>(r & 0xfff) - 2048) * config.amplitude / 2048;
+                int q = (static_cast<int>((r >> 12) & 0xfff) - 2048) * config.amplitude / 2048;
+                out[idx] = IQ_SAMPLE::Pack(static_cast<int16_t>(i), static_cast<int16_t>(q));
+            }
+            break;
+        case FtEmulator::PATTERN::NONE:
+            break;
+    }
+
+    ch.frame_pos = 0;
+    ch.generated += words;
+    dev.frames.fetch_add(1, memory_order_relaxed);
+}
+
+static bool Generating(const FtEmulator::Config& config)
+{
+    return config.pattern != FtEmulator::PATTERN::NONE && !config.loopback;
+}
+
+// When the next frame's samples are due at the configured rate
+static clock_type::time_point NextFrame(const FtEmulator::Config& config, const Channel& ch)
+{
+    if (config.sample_rate <= 0)
+        return clock_type::time_point::min();
+    return ch.start + chrono::duration_cast<clock_type::duration>(
+        chrono::duration<double>((ch.generated + config.frame_words) / config.sample_rate));
+}
+
+// Copies what is available now; caller holds ch.lock
+static size_t Fill(Device& dev, const FtEmulator::Config& config, Channel& ch, uint8_t* out, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        size_t frame_bytes = ch.frame.size() * sizeof(uint32_t);
+        if (ch.frame_pos < frame_bytes)
+        {
+            size_t take = min(len - done, frame_bytes - ch.frame_pos);
+            memcpy(out + done, reinterpret_cast<const uint8_t*>(ch.frame.data()) + ch.frame_pos, take);
+            ch.frame_pos += take;
+            done += take;
+            continue;
+        }
+        if (!ch.reply.empty())
+        {
+            size_t take = min(len - done, ch.reply.size());
+            copy(ch.reply.begin(), ch.reply.begin() + take, out + done);
+            ch.reply.erase(ch.reply.begin(), ch.reply.begin() + take);
+            done += take;
+            continue;
+        }
+        if (!Generating(config) || clock_type::now() < NextFrame(config, ch))
+            break;
+        Generate(dev, config, ch);
+    }
+    return done;
+}
+
+static FT_STATUS Read(Device& dev, const FtEmulator::Config& config, Channel& ch, uint64_t aborts,
+                      uint8_t* out, size_t len, clock_type::time_point deadline, ULONG* count)
+{
+    unique_lock<mutex> lock(ch.lock);
+    if (!ch.started)
+    {
+        ch.started = true;
+        ch.start = clock_type::now();
+    }
+
+    for (;;)
+    {
+        size_t got = Fill(dev, config, ch, out, len);
+        if (got > 0)
+        {
+            *count = got;
+            dev.read_bytes.fetch_add(got, memory_order_relaxed);
+            return FT_OK;
+        }
+        if (ch.aborts != aborts)
+            return FT_OPERATION_ABORTED;
+
+        clock_type::time_point now = clock_type::now();
+        if (now >= deadline)
+            return FT_TIMEOUT;
+        clock_type::time_point wake = deadline;
+        if (Generating(config))
+            wake = min(wake, NextFrame(config, ch));
+        ch.ready.wait_until(lock, wake);
+    }
+}
+
+// Echoes a complete message back with the same header
+static void Answer(Device& dev, Channel& ch)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(ch.message.data());
+    ch.reply.insert(ch.reply.end(), bytes, bytes + ch.message.size() * sizeof(uint32_t));
+    ch.message.clear();
+    dev.messages.fetch_add(1, memory_order_relaxed);
+}
+
+static void Consume(Device& dev, Channel& ch, uint32_t word)
+{
+    if (ch.want > 0)
+    {
+        ch.message.push_back(word);
+        if (--ch.want == 0)
+            Answer(dev, ch);
+        return;
+    }
+
+    if (SDR_HEADER::IsCmd(word))
+    {
+        ch.message.assign(1, word);
+        ch.want = F2CPU(word).num();
+        if (ch.want == 0)
+            Answer(dev, ch);
+    }
+    else
+        ch.skip = F2FIFO(word).num() * sizeof(uint32_t);
+}
+
+static void Write(Device& dev, const FtEmulator::Config& config, Channel& ch, const uint8_t* data, size_t len)
+{
+    lock_guard<mutex> lock(ch.lock);
+    size_t pos = 0;
+
+    if (config.loopback)
+        ch.reply.insert(ch.reply.end(), data, data + len);
+
+    while (!config.loopback && pos < len)
+    {
+        // stream payload is dropped, as the DAC side would
+        if (ch.skip > 0)
+        {
+            size_t take = min(ch.skip, len - pos);
+            ch.skip -= take;
+            pos += take;
+            continue;
+        }
+
+        ch.carry[ch.carry_bytes++] = data[pos++];
+        if (ch.carry_bytes == sizeof(uint32_t))
+        {
+            uint32_t word;
+            memcpy(&word, ch.carry, sizeof(word));
+            ch.carry_bytes = 0;
+            Consume(dev, ch, word);
+        }
+    }
+
+    dev.write_bytes.fetch_add(len, memory_order_relaxed);
+    ch.ready.notify_all();
+}
+
+// Snapshot of the config; applies latency and decides on an injected error
+static FtEmulator::Config Transfer(Device& dev, bool& fail)
+{
+    FtEmulator::Config config;
+    uint64_t count;
+    double roll;
+    {
+        lock_guard<mutex> lock(dev.lock);
+        config = dev.config;
+        count = ++dev.transfers;
+        roll = XorShift(dev.rng) / 4294967296.0;
+    }
+
+    if (config.latency.count() > 0)
+        this_thread::sleep_for(config.latency);
+    fail = (config.fail_at != 0 && count == config.fail_at) ||
+           (config.error_rate > 0 && roll < config.error_rate);
+    if (fail)
+        dev.errors.fetch_add(1, memory_order_relaxed);
+    return config;
+}
+
+static Channel* FifoChannel(FT_HANDLE handle, UCHAR fifo)
+{
+    Device& dev = Emu();
+    if (handle != &dev || fifo >= CHANNELS)
+        return nullptr;
+    return &dev.channels[fifo];
+}
+
+// Endpoints are 0x02 + channel (OUT) and 0x82 + channel (IN)
+static Channel* EndpointChannel(FT_HANDLE handle, UCHAR endpoint)
+{
+    if ((endpoint & 0x7f) < 2)
+        return nullptr;
+    return FifoChannel(handle, static_cast<UCHAR>((endpoint & 0x7f) - 2));
+}
+
+
+FtEmulator::Config& FtEmulator::Config::Default()
+{
+    static Config config = []
+    {
+        Config c;
+        const char* env = getenv("SDR_EMU");
+        if (env != nullptr && !Parse(env, c))
+            printf("SDR_EMU: cannot parse \"%s\"\r\n", env);
+        return c;
+    }();
+    return config;
+}
+
+bool FtEmulator::Config::Parse(const char* text, Config& config)
+{
+    string all(text);
+    size_t pos = 0;
+
+    while (pos < all.size())
+    {
+        size_t end = all.find(',', pos);
+        if (end == string::npos)
+            end = all.size();
+        string item = all.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t eq = item.find('=');
+        if (eq == string::npos)
+            return false;
+        string key = item.substr(0, eq);
+        const char* value = item.c_str() + eq + 1;
+
+        if (key == "pattern")
+        {
+            if (strcmp(value, "none") == 0)
+                config.pattern = PATTERN::NONE;
+            else if (strcmp(value, "counter") == 0)
+                config.pattern = PATTERN::COUNTER;
+            else if (strcmp(value, "tone") == 0)
+                config.pattern = PATTERN::TONE;
+            else if (strcmp(value, "noise") == 0)
+                config.pattern = PATTERN::NOISE;
+            else
+                return false;
+        }
+        else if (key == "rate")
+            config.sample_rate = atof(value);
+        else if (key == "frame")
+            config.frame_words = strtoul(value, nullptr, 0);
+        else if (key == "tone")
+            config.tone = atof(value);
+        else if (key == "amplitude")
+            config.amplitude = atoi(value);
+        else if (key == "loopback")
+            config.loopback = atoi(value) != 0;
+        else if (key == "latency")
+            config.latency = chrono::microseconds(strtoll(value, nullptr, 0));
+        else if (key == "errors")
+            config.error_rate = atof(value);
+        else if (key == "fail")
+            config.fail_at = strtoull(value, nullptr, 0);
+        else if (key == "seed")
+            config.seed = strtoul(value, nullptr, 0);
+        else
+            return false;
+    }
+    return true;
+}
+
+void FtEmulator::Configure(const Config& config)
+{
+    Device& dev = Emu();
+    lock_guard<mutex> lock(dev.lock);
+    dev.Apply(config);
+}
+
+FtEmulator::Stats FtEmulator::GetStats()
+{
+    Device& dev = Emu();
+    Stats stats;
+    stats.read_bytes = dev.read_bytes.load(memory_order_relaxed);
+    stats.write_bytes = dev.write_bytes.load(memory_order_relaxed);
+    stats.frames = dev.frames.load(memory_order_relaxed);
+    stats.messages = dev.messages.load(memory_order_relaxed);
+    stats.errors = dev.errors.load(memory_order_relaxed);
+    return stats;
+}
+
+
+// === FT_* entry points ===
+
+FT_STATUS WINAPI FT_CreateDeviceInfoList(LPDWORD lpdwNumDevs)
+{
+    *lpdwNumDevs = 1;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetDeviceInfoList(FT_DEVICE_LIST_INFO_NODE* ptDest, LPDWORD lpdwNumDevs)
+{
+    memset(ptDest, 0, sizeof(*ptDest));
+    ptDest->Flags = FT_FLAGS_SUPERSPEED;
+    ptDest->Type = FT_DEVICE_601;
+    ptDest->ID = 0x0403601f;
+    strncpy(ptDest->SerialNumber, SERIAL, sizeof(ptDest->SerialNumber) - 1);
+    strncpy(ptDest->Description, "FT601 emulator", sizeof(ptDest->Description) - 1);
+    *lpdwNumDevs = 1;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetDeviceInfoDetail(DWORD dwIndex, LPDWORD lpdwFlags, LPDWORD lpdwType, LPDWORD lpdwID,
+                                        LPDWORD lpdwLocId, LPVOID lpSerialNumber, LPVOID lpDescription,
+                                        FT_HANDLE* pftHandle)
+{
+    if (dwIndex != 0)
+        return FT_DEVICE_NOT_FOUND;
+    if (lpdwFlags)
+        *lpdwFlags = FT_FLAGS_SUPERSPEED;
+    if (lpdwType)
+        *lpdwType = FT_DEVICE_601;
+    if (lpdwID)
+        *lpdwID = 0x0403601f;
+    if (lpdwLocId)
+        *lpdwLocId = 0;
+    if (lpSerialNumber)
+        strcpy(static_cast<char*>(lpSerialNumber), SERIAL);
+    if (lpDescription)
+        strcpy(static_cast<char*>(lpDescription), "FT601 emulator");
+    if (pftHandle)
+        *pftHandle = &Emu();
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_Create(PVOID pvArg, DWORD dwFlags, FT_HANDLE* pftHandle)
+{
+    bool found = (dwFlags == FT_OPEN_BY_INDEX && pvArg == nullptr) ||
+                 (dwFlags == FT_OPEN_BY_SERIAL_NUMBER && strcmp(static_cast<const char*>(pvArg), SERIAL) == 0);
+    *pftHandle = found? &Emu(): nullptr;
+    return found? FT_OK: FT_DEVICE_NOT_FOUND;
+}
+
+FT_STATUS WINAPI FT_Close(FT_HANDLE ftHandle)
+{
+    return (ftHandle == &Emu())? FT_OK: FT_INVALID_HANDLE;
+}
+
+FT_STATUS WINAPI FT_ResetDevicePort(FT_HANDLE ftHandle)
+{
+    return (ftHandle == &Emu())? FT_OK: FT_INVALID_HANDLE;
+}
+
+FT_STATUS WINAPI FT_ReadPipeEx(FT_HANDLE ftHandle, UCHAR ucFifoID, PUCHAR pucBuffer, ULONG ulBufferLength,
+                               PULONG pulBytesTransferred, DWORD dwTimeoutInMs)
+{
+    *pulBytesTransferred = 0;
+    Channel* ch = FifoChannel(ftHandle, ucFifoID);
+    if (ch == nullptr)
+        return FT_INVALID_PARAMETER;
+
+    Device& dev = Emu();
+    bool fail;
+    FtEmulator::Config config = Transfer(dev, fail);
+    if (fail)
+        return FT_IO_ERROR;
+
+    uint64_t aborts;
+    {
+        lock_guard<mutex> lock(ch->lock);
+        aborts = ch->aborts;
+    }
+    clock_type::time_point deadline = clock_type::now() + chrono::milliseconds(dwTimeoutInMs);
+    return Read(dev, config, *ch, aborts, pucBuffer, ulBufferLength, deadline, pulBytesTransferred);
+}
+
+FT_STATUS WINAPI FT_WritePipeEx(FT_HANDLE ftHandle, UCHAR ucFifoID, PUCHAR pucBuffer, ULONG ulBufferLength,
+                                PULONG pulBytesTransferred, DWORD dwTimeoutInMs)
+{
+    (void)dwTimeoutInMs;
+    *pulBytesTransferred = 0;
+    Channel* ch = FifoChannel(ftHandle, ucFifoID);
+    if (ch == nullptr)
+        return FT_INVALID_PARAMETER;
+
+    Device& dev = Emu();
+    bool fail;
+    FtEmulator::Config config = Transfer(dev, fail);
+    if (fail)
+        return FT_IO_ERROR;
+
+    Write(dev, config, *ch, pucBuffer, ulBufferLength);
+    *pulBytesTransferred = ulBufferLength;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_InitializeOverlapped(FT_HANDLE ftHandle, LPOVERLAPPED pOverlapped)
+{
+    (void)pOverlapped;
+    return (ftHandle == &Emu())? FT_OK: FT_INVALID_HANDLE;
+}
+
+FT_STATUS WINAPI FT_ReleaseOverlapped(FT_HANDLE ftHandle, LPOVERLAPPED pOverlapped)
+{
+    Device& dev = Emu();
+    lock_guard<mutex> lock(dev.lock);
+    dev.pending.erase(pOverlapped);
+    return (ftHandle == &dev)? FT_OK: FT_INVALID_HANDLE;
+}
+
+// Writes complete at once; a read that finds nothing stays pending until
+// FT_GetOverlappedResult finds data for it
+FT_STATUS WINAPI FT_ReadPipe(FT_HANDLE ftHandle, UCHAR ucEndpoint, PUCHAR pucBuffer, ULONG ulBufferLength,
+                             PULONG pulBytesTransferred, LPOVERLAPPED pOverlapped)
+{
+    *pulBytesTransferred = 0;
+    Channel* ch = EndpointChannel(ftHandle, ucEndpoint);
+    if (ch == nullptr || !(ucEndpoint & 0x80))
+        return FT_INVALID_PARAMETER;
+
+    Device& dev = Emu();
+    bool fail;
+    FtEmulator::Config config = Transfer(dev, fail);
+    if (fail)
+        return FT_IO_ERROR;
+
+    uint64_t aborts;
+    {
+        lock_guard<mutex> lock(ch->lock);
+        aborts = ch->aborts;
+    }
+    FT_STATUS status = Read(dev, config, *ch, aborts, pucBuffer, ulBufferLength,
+                            clock_type::time_point::min(), pulBytesTransferred);
+    if (status != FT_TIMEOUT || pOverlapped == nullptr)
+        return status;
+
+    lock_guard<mutex> lock(dev.lock);
+    dev.pending[pOverlapped] = Pending{ch, pucBuffer, ulBufferLength, aborts};
+    return FT_IO_PENDING;
+}
+
+FT_STATUS WINAPI FT_WritePipe(FT_HANDLE ftHandle, UCHAR ucEndpoint, PUCHAR pucBuffer, ULONG ulBufferLength,
+                              PULONG pulBytesTransferred, LPOVERLAPPED pOverlapped)
+{
+    (void)pOverlapped;
+    *pulBytesTransferred = 0;
+    Channel* ch = EndpointChannel(ftHandle, ucEndpoint);
+    if (ch == nullptr || (ucEndpoint & 0x80))
+        return FT_INVALID_PARAMETER;
+
+    Device& dev = Emu();
+    bool fail;
+    FtEmulator::Config config = Transfer(dev, fail);
+    if (fail)
+        return FT_IO_ERROR;
+
+    Write(dev, config, *ch, pucBuffer, ulBufferLength);
+    *pulBytesTransferred = ulBufferLength;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetOverlappedResult(FT_HANDLE ftHandle, LPOVERLAPPED pOverlapped,
+                                        PULONG pulBytesTransferred, BOOL bWait)
+{
+    Device& dev = Emu();
+    *pulBytesTransferred = 0;
+    if (ftHandle != &dev)
+        return FT_INVALID_HANDLE;
+
+    Pending op;
+    FtEmulator::Config config;
+    {
+        lock_guard<mutex> lock(dev.lock);
+        auto found = dev.pending.find(pOverlapped);
+        if (found == dev.pending.end())
+            return FT_INVALID_PARAMETER;
+        op = found->second;
+        config = dev.config;
+    }
+
+    clock_type::time_point deadline = bWait? clock_type::time_point::max(): clock_type::time_point::min();
+    FT_STATUS status = Read(dev, config, *op.channel, op.aborts, op.buffer, op.bytes, deadline, pulBytesTransferred);
+    if (status == FT_TIMEOUT)
+        return FT_IO_INCOMPLETE;
+
+    lock_guard<mutex> lock(dev.lock);
+    dev.pending.erase(pOverlapped);
+    return status;
+}
+
+FT_STATUS WINAPI FT_AbortPipe(FT_HANDLE ftHandle, UCHAR ucEndpoint)
+{
+    Channel* ch = EndpointChannel(ftHandle, ucEndpoint);
+    if (ch == nullptr)
+        return FT_INVALID_PARAMETER;
+
+    // writes never block here, only readers have something to cancel
+    if (ucEndpoint & 0x80)
+    {
+        lock_guard<mutex> lock(ch->lock);
+        ++ch->aborts;
+        ch->ready.notify_all();
+    }
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetReadQueueStatus(FT_HANDLE ftHandle, UCHAR ucFifoID, LPDWORD lpdwAmountInQueue)
+{
+    Channel* ch = FifoChannel(ftHandle, ucFifoID);
+    if (ch == nullptr)
+        return FT_INVALID_PARAMETER;
+
+    lock_guard<mutex> lock(ch->lock);
+    *lpdwAmountInQueue = ch->reply.size() + (ch->frame.size() * sizeof(uint32_t) - ch->frame_pos);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetUnsentBuffer(FT_HANDLE ftHandle, UCHAR ucFifoID, BYTE* byBuffer, LPDWORD lpdwBufferLength)
+{
+    (void)byBuffer;
+    if (FifoChannel(ftHandle, ucFifoID) == nullptr)
+        return FT_INVALID_PARAMETER;
+    // OUT transfers are consumed as they are written
+    *lpdwBufferLength = 0;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_SetTransferParams(FT_TRANSFER_CONF* pConf, DWORD dwFifoID)
+{
+    (void)pConf;
+    return (dwFifoID < CHANNELS)? FT_OK: FT_INVALID_PARAMETER;
+}
+
+FT_STATUS WINAPI FT_GetChipConfiguration(FT_HANDLE ftHandle, PVOID pvConfiguration)
+{
+    Device& dev = Emu();
+    if (ftHandle != &dev)
+        return FT_INVALID_HANDLE;
+    lock_guard<mutex> lock(dev.lock);
+    memcpy(pvConfiguration, &dev.chip, sizeof(dev.chip));
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_SetChipConfiguration(FT_HANDLE ftHandle, PVOID pvConfiguration)
+{
+    Device& dev = Emu();
+    if (ftHandle != &dev)
+        return FT_INVALID_HANDLE;
+    lock_guard<mutex> lock(dev.lock);
+    memcpy(&dev.chip, pvConfiguration, sizeof(dev.chip));
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetFirmwareVersion(FT_HANDLE ftHandle, PULONG pulFirmwareVersion)
+{
+    // past the Rev.A workarounds
+    *pulFirmwareVersion = 0x0112;
+    return (ftHandle == &Emu())? FT_OK: FT_INVALID_HANDLE;
+}
+
+FT_STATUS WINAPI FT_GetDriverVersion(FT_HANDLE ftHandle, LPDWORD lpdwVersion)
+{
+    (void)ftHandle;
+    *lpdwVersion = 0x01000000;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetLibraryVersion(LPDWORD lpdwVersion)
+{
+    *lpdwVersion = 0x01000000;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_GetVIDPID(FT_HANDLE ftHandle, PUSHORT puwVID, PUSHORT puwPID)
+{
+    Device& dev = Emu();
+    if (ftHandle != &dev)
+        return FT_INVALID_HANDLE;
+    lock_guard<mutex> lock(dev.lock);
+    *puwVID = dev.chip.VendorID;
+    *puwPID = dev.chip.ProductID;
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_EnableGPIO(FT_HANDLE ftHandle, DWORD dwMask, DWORD dwDirection)
+{
+    Device& dev = Emu();
+    if (ftHandle != &dev)
+        return FT_INVALID_HANDLE;
+    lock_guard<mutex> lock(dev.lock);
+    dev.gpio_direction = (dev.gpio_direction & ~dwMask) | (dwDirection & dwMask);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_WriteGPIO(FT_HANDLE ftHandle, DWORD dwMask, DWORD dwLevel)
+{
+    Device& dev = Emu();
+    if (ftHandle != &dev)
+        return FT_INVALID_HANDLE;
+    lock_guard<mutex> lock(dev.lock);
+    dev.gpio_level = (dev.gpio_level & ~dwMask) | (dwLevel & dwMask);
+    return FT_OK;
+}
+
+FT_STATUS WINAPI FT_ReadGPIO(FT_HANDLE ftHandle, DWORD* pdwData)
+{
+    Device& dev = Emu();
+    if (ftHandle != &dev)
+        return FT_INVALID_HANDLE;
+    lock_guard<mutex> lock(dev.lock);
+    *pdwData = dev.gpio_level;
+    return FT_OK;
+}
@@ -0,0 +1,55 @@
+#ifndef FTEMU_H
+#define FTEMU_H
+
+#include <chrono>
+#include <stdint.h>
+#include <stddef.h>
+
+// Software stand-in for the FT60x and the FPGA behind it. Built with
+// `make EMULATOR=1`, ftemu.cpp provides the FT_* calls the host uses and
+// links instead of libftd3xx: one device, four channels, each with an
+// IN FIFO fed by a frame generator and an OUT FIFO whose F2CPU messages
+// are answered (echoed back with the same id) and whose stream frames are
+// consumed like a DAC would. Lets the host stack be run and timed on any
+// Linux box.
+class FtEmulator
+{
+public:
+    enum class PATTERN {NONE, COUNTER, TONE, NOISE};
+
+    struct Config
+    {
+        PATTERN pattern = PATTERN::COUNTER;
+        double sample_rate = 0;             // stream words/s per channel, 0: as fast as read
+        size_t frame_words = 1023;          // payload per F2FIFO frame
+        double tone = 1.0 / 64;             // cycles per sample
+        int amplitude = 1800;               // of the 12-bit I/Q
+        bool loopback = false;              // OUT bytes come back on IN unparsed
+        std::chrono::microseconds latency{0};   // added to every transfer
+        double error_rate = 0;              // chance a transfer fails with FT_IO_ERROR
+        uint64_t fail_at = 0;               // the nth transfer fails, 0: never
+        uint32_t seed = 1;
+
+        // Process-wide default, from SDR_EMU="pattern=tone,rate=20e6,loopback=1,..."
+        static Config& Default();
+        // Comma separated key=value: pattern, rate, frame, tone, amplitude,
+        // loopback, latency (us), errors, fail, seed
+        static bool Parse(const char* text, Config& config);
+    };
+
+    struct Stats
+    {
+        uint64_t read_bytes;
+        uint64_t write_bytes;
+        uint64_t frames;            // generated
+        uint64_t messages;          // answered
+        uint64_t errors;            // injected
+    };
+
+    // Replaces the SDR_EMU settings and empties the FIFOs; call while no
+    // transfer is in flight
+    static void Configure(const Config& config);
+    static Stats GetStats();
+};
+
+#endif // FTEMU_H
@@ -0,0 +1,141 @@
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hugemem.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+using namespace std;
+
+static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+static const size_t SMALL_PAGE = 4096;
+
+
+string MemPlacement::Describe() const
+{
+    char text[128];
+    snprintf(text, sizeof(text), "%zu KiB, %s pages, %s, node %d",
+             size / 1024, hugepages? "2 MiB": "4 KiB",
+             locked? "locked": "pageable", numa_node);
+    return text;
+}
+
+int NumaNodeOfCpu(int cpu)
+{
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR* dir = opendir(path);
+    if (dir == nullptr)
+        return -1;
+
+    int node = -1;
+    while (dirent* entry = readdir(dir))
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%d", &node) == 1)
+            break;
+    }
+    closedir(dir);
+    return node;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+int CurrentNumaNode()
+{
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    return cpu < 0? -1: NumaNodeOfCpu(cpu);
+#else
+    return -1;
+#endif
+}
+
+void* HugeAlloc(size_t size, const MemPolicy& policy, MemPlacement* placement)
+{
+    MemPlacement local;
+    MemPlacement& place = placement? *placement: local;
+    place = MemPlacement();
+
+#ifdef __linux__
+    void* ptr = MAP_FAILED;
+
+    if (policy.hugepages)
+    {
+        place.size = (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        ptr = mmap(nullptr, place.size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        place.hugepages = (ptr != MAP_FAILED);
+    }
+
+    if (ptr == MAP_FAILED)
+    {
+        // no reserved hugepages: ask for transparent ones instead
+        place.size = (size + SMALL_PAGE - 1) & ~(SMALL_PAGE - 1);
+        ptr = mmap(nullptr, place.size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            throw bad_alloc();
+        if (policy.hugepages)
+            madvise(ptr, place.size, MADV_HUGEPAGE);
+    }
+
+    int node = (policy.numa_node >= 0)? policy.numa_node: CurrentNumaNode();
+    if (node >= 0 && node < 64)
+    {
+        // preferred rather than bound, so a full node degrades instead of failing
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_mbind, ptr, place.size, MPOL_PREFERRED, &mask, 64, 0) == 0)
+            place.numa_node = node;
+    }
+
+    if (policy.lock)
+    {
+        place.locked = (mlock(ptr, place.size) == 0);
+        if (!place.locked)
+            printf("mlock of %zu KiB failed, check RLIMIT_MEMLOCK\r\n", place.size / 1024);
+    }
+
+    // first touch places the pages
+    memset(ptr, 0, place.size);
+    return ptr;
+#else
+    (void)policy;
+    place.size = (size + SMALL_PAGE - 1) & ~(SMALL_PAGE - 1);
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, SMALL_PAGE, place.size) != 0)
+        throw bad_alloc();
+    memset(ptr, 0, place.size);
+    return ptr;
+#endif
+}
+
+void HugeFree(void* ptr, const MemPlacement& placement)
+{
+    if (ptr == nullptr)
+        return;
+
+#ifdef __linux__
+    if (placement.locked)
+        munlock(ptr, placement.size);
+    munmap(ptr, placement.size);
+#else
+    (void)placement;
+    free(ptr);
+#endif
+}
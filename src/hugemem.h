@@ -0,0 +1,58 @@
+#ifndef HUGEMEM_H
+#define HUGEMEM_H
+
+#include <stddef.h>
+#include <string>
+
+// Placement of large, long-lived stream buffers (receive rings, pool slabs)
+struct MemPolicy
+{
+    bool hugepages = true;      // 2 MiB pages, falls back to THP-advised 4 KiB pages
+    bool lock = true;           // mlock so the buffer is never paged out
+    int numa_node = -1;         // -1: node of the CPU the allocating thread runs on
+};
+
+// What an allocation actually got, after fallbacks
+struct MemPlacement
+{
+    size_t size = 0;            // mapped length, rounded to the page size
+    bool hugepages = false;
+    bool locked = false;
+    int numa_node = -1;
+
+    std::string Describe() const;
+};
+
+// Memory is zeroed and prefaulted so pages land on the requested node now
+void* HugeAlloc(size_t size, const MemPolicy& policy = MemPolicy(), MemPlacement* placement = nullptr);
+void HugeFree(void* ptr, const MemPlacement& placement);
+
+int NumaNodeOfCpu(int cpu);
+int CurrentNumaNode();
+
+// Owning wrapper for a HugeAlloc'd array
+template <typename T>
+class HugeBuffer
+{
+public:
+    explicit HugeBuffer(size_t count, const MemPolicy& policy = MemPolicy())
+    : count(count)
+    , ptr(static_cast<T*>(HugeAlloc(count * sizeof(T), policy, &placement)))
+    {}
+    ~HugeBuffer() {HugeFree(ptr, placement);}
+
+    HugeBuffer(const HugeBuffer&) = delete;
+    HugeBuffer& operator=(const HugeBuffer&) = delete;
+
+    T* get() const {return ptr;}
+    size_t size() const {return count;}
+    T& operator[](size_t idx) const {return ptr[idx];}
+    const MemPlacement& Placement() const {return placement;}
+
+private:
+    MemPlacement placement;
+    const size_t count;
+    T* ptr;
+};
+
+#endif // HUGEMEM_H
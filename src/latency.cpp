@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "latency.h"
+#ifdef FT_EMULATOR
+#include "ftemu.h"
+#endif
+
+using namespace std;
+
+
+LatencyHistogram::LatencyHistogram()
+: count(0)
+, sum(0)
+, peak(0)
+{
+    for (auto& bucket: counts)
+        bucket.store(0, memory_order_relaxed);
+}
+
+// Values below 128 have a bucket each; above, the top 7 significant bits
+// pick the bucket within the value's power of two
+size_t LatencyHistogram::Index(uint64_t ns)
+{
+    if (ns < (1u << SUB_BITS))
+        return ns;
+    unsigned msb = 63 - __builtin_clzll(ns);
+    unsigned shift = msb - SUB_BITS + 1;
+    return (static_cast<size_t>(shift) << (SUB_BITS - 1)) + (ns >> shift);
+}
+
+uint64_t LatencyHistogram::Upper(size_t idx)
+{
+    if (idx < (1u << SUB_BITS))
+        return idx;
+    unsigned shift = idx / (1u << (SUB_BITS - 1)) - 1;
+    uint64_t sub = idx % (1u << (SUB_BITS - 1)) + (1u << (SUB_BITS - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t ns)
+{
+    ns = min<uint64_t>(ns, (uint64_t(1) << MAX_BITS) - 1);
+    counts[Index(ns)].fetch_add(1, memory_order_relaxed);
+    count.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(ns, memory_order_relaxed);
+    if (ns > peak.load(memory_order_relaxed))
+        peak.store(ns, memory_order_relaxed);
+}
+
+void LatencyHistogram::Reset()
+{
+    for (auto& bucket: counts)
+        bucket.store(0, memory_order_relaxed);
+    count.store(0, memory_order_relaxed);
+    sum.store(0, memory_order_relaxed);
+    peak.store(0, memory_order_relaxed);
+}
+
+double LatencyHistogram::Mean() const
+{
+    uint64_t n = Count();
+    return n? static_cast<double>(sum.load(memory_order_relaxed)) / n: 0;
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const
+{
+    uint64_t n = Count();
+    if (n == 0)
+        return 0;
+
+    uint64_t target = max<uint64_t>(1, static_cast<uint64_t>(p * n + 0.5));
+    uint64_t seen = 0;
+    for (size_t idx = 0; idx < BUCKETS; ++idx)
+    {
+        seen += counts[idx].load(memory_order_relaxed);
+        if (seen >= target)
+            return min(Upper(idx), Max());
+    }
+    return Max();
+}
+
+
+LatencyProbe::LatencyProbe()
+: skip(0)
+, unmatched(0)
+, lost(0)
+{
+}
+
+size_t LatencyProbe::SizeClass(size_t words)
+{
+    return words? min<size_t>(SIZE_CLASSES - 1, 64 - __builtin_clzll(words)): 0;
+}
+
+void LatencyProbe::Transmitted(const uint32_t* words, size_t count)
+{
+    clock::time_point now = clock::now();
+    lock_guard<mutex> guard(lock);
+
+    for (size_t pos = 0; pos < count;)
+    {
+        if (skip > 0)
+        {
+            size_t take = min(skip, count - pos);
+            skip -= take;
+            pos += take;
+            continue;
+        }
+
+        uint32_t header = words[pos++];
+        if (SDR_HEADER::IsCmd(header))
+        {
+            auto& queue = sent_messages[F2CPU(header).id()];
+            if (queue.size() >= MAX_PENDING)
+            {
+                queue.pop_front();
+                lost.fetch_add(1, memory_order_relaxed);
+            }
+            queue.push_back(now);
+            skip = F2CPU(header).num();
+        }
+        else
+        {
+            skip = F2FIFO(header).num();
+            // empty frames never reach the RX callback
+            if (skip == 0)
+                continue;
+            auto& queue = sent_frames[SizeClass(skip)];
+            if (queue.size() >= MAX_PENDING)
+            {
+                queue.pop_front();
+                lost.fetch_add(1, memory_order_relaxed);
+            }
+            queue.push_back(Stamp{skip, now});
+        }
+    }
+}
+
+IPacketStream::Callback_t LatencyProbe::Callback(IPacketStream::Callback_t next)
+{
+    return [this, next](uint8_t msgId, const PacketRef& body)
+    {
+        Received(body);
+        if (next)
+            next(msgId, body);
+    };
+}
+
+void LatencyProbe::Received(const PacketRef& body)
+{
+    clock::time_point now = clock::now();
+    clock::time_point sent;
+    bool matched = false;
+    LatencyHistogram* histogram = nullptr;
+
+    {
+        lock_guard<mutex> guard(lock);
+        if (body.IsMessage())
+        {
+            auto& queue = sent_messages[body.msgId() % MESSAGE_IDS];
+            histogram = &messages[body.msgId() % MESSAGE_IDS];
+            if (!queue.empty())
+            {
+                sent = queue.front();
+                queue.pop_front();
+                matched = true;
+            }
+        }
+        else
+        {
+            // a frame that came back with another size means the ones
+            // ahead of it were lost
+            auto& queue = sent_frames[SizeClass(body.size())];
+            histogram = &frames[SizeClass(body.size())];
+            while (!queue.empty() && !matched)
+            {
+                Stamp stamp = queue.front();
+                queue.pop_front();
+                if (stamp.words == body.size())
+                {
+                    sent = stamp.sent;
+                    matched = true;
+                }
+                else
+                    lost.fetch_add(1, memory_order_relaxed);
+            }
+        }
+    }
+
+    if (matched)
+        histogram->Record(chrono::duration_cast<chrono::nanoseconds>(now - sent).count());
+    else
+        unmatched.fetch_add(1, memory_order_relaxed);
+}
+
+void LatencyProbe::Print() const
+{
+    auto row = [](const char* name, const LatencyHistogram& h)
+    {
+        if (h.Count() == 0)
+            return;
+        printf("%-22s %10llu %10.1f %10.1f %10.1f %10.1f\r\n", name, static_cast<unsigned long long>(h.Count()),
+               h.Percentile(0.50) / 1e3, h.Percentile(0.99) / 1e3, h.Percentile(0.999) / 1e3, h.Max() / 1e3);
+    };
+
+    printf("%-22s %10s %10s %10s %10s %10s\r\n", "round trip (us)", "count", "p50", "p99", "p99.9", "max");
+    char name[32];
+    for (size_t id = 0; id < MESSAGE_IDS; ++id)
+    {
+        snprintf(name, sizeof(name), "message %zu", id);
+        row(name, messages[id]);
+    }
+    for (size_t cls = 0; cls < SIZE_CLASSES; ++cls)
+    {
+        if (cls == 0)
+            snprintf(name, sizeof(name), "frame 0 words");
+        else
+            snprintf(name, sizeof(name), "frame %zu-%zu words", size_t(1) << (cls - 1), (size_t(1) << cls) - 1);
+        row(name, frames[cls]);
+    }
+    printf("unmatched RX: %llu, lost TX: %llu\r\n",
+           static_cast<unsigned long long>(Unmatched()), static_cast<unsigned long long>(Lost()));
+}
+
+
+int RunLatency(int argc, char* argv[])
+{
+    double seconds = (argc >= 1)? atof(argv[0]): 5;
+    chrono::microseconds interval((argc >= 2)? atol(argv[1]): 200);
+
+#ifdef FT_EMULATOR
+    FtEmulator::Config emu = FtEmulator::Config::Default();
+    emu.pattern = FtEmulator::PATTERN::NONE;
+    emu.loopback = true;
+    FtEmulator::Configure(emu);
+#endif
+
+    FT_HANDLE handle = nullptr;
+    if (FT_OK != FT_Create(0, FT_OPEN_BY_INDEX, &handle) || !handle)
+    {
+        printf("Failed to create device\r\n");
+        return 1;
+    }
+
+    LatencyProbe probe;
+    {
+        IPacketStream in(handle, probe.Callback(nullptr));
+        OPacketStream out(handle);
+        out.Instrument(&probe);
+
+        // the frame sizes and message ids of a control loop, in turn
+        static const size_t sizes[] = {16, 256, 1023};
+        vector<uint32_t> payload(1023);
+        StopFlag stop;
+        auto next = chrono::steady_clock::now();
+        auto end = next + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+
+        for (uint32_t seq = 0; next < end; ++seq)
+        {
+            if (seq % 2)
+                out.SendMessage(seq / 2 % LatencyProbe::MESSAGE_IDS, &seq, 1);
+            else
+                out.SendGather(F2FIFO(static_cast<uint16_t>(sizes[seq / 2 % 3])), {{payload.data(), sizes[seq / 2 % 3]}});
+            next += interval;
+            stop.SleepUntil(next);
+        }
+
+        // stragglers
+        this_thread::sleep_for(chrono::milliseconds(100));
+        in.Stop();
+    }
+    FT_Close(handle);
+
+    probe.Print();
+    return 0;
+}
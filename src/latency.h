@@ -0,0 +1,107 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include "streamer.h"
+
+// Log-linear histogram of nanosecond values, HDR style: 64 linear
+// sub-buckets per power of two, so a reported value is within 1/64 of the
+// recorded one, from 1 ns up to 2^40 ns (18 minutes; larger values are
+// clamped). Record() is meant for one thread; readers may run alongside.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void Record(uint64_t ns);
+    void Reset();
+
+    uint64_t Count() const {return count.load(memory_order_relaxed);}
+    uint64_t Max() const {return peak.load(memory_order_relaxed);}
+    double Mean() const;
+    // Upper edge of the bucket holding quantile p in [0, 1], at most Max()
+    uint64_t Percentile(double p) const;
+
+private:
+    static constexpr unsigned SUB_BITS = 7;
+    static constexpr unsigned MAX_BITS = 40;
+    static constexpr size_t BUCKETS = (MAX_BITS - SUB_BITS + 2) << (SUB_BITS - 1);
+
+    array<atomic<uint64_t>, BUCKETS> counts;
+    atomic<uint64_t> count;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> peak;
+
+    static size_t Index(uint64_t ns);
+    static uint64_t Upper(size_t idx);
+};
+
+// Round-trip latency over a loopback: the FPGA loopback image or the
+// emulator with loopback=1 send back every packet they receive. TX writes
+// stamp each packet header as it goes to the pipe (OPacketStream and
+// TxScheduler call Transmitted() when instrumented); RX arrivals are
+// matched in order per message id and per frame size and recorded per
+// message id and per power-of-two frame size class.
+//   LatencyProbe probe;
+//   IPacketStream in(handle, probe.Callback(nullptr));
+//   OPacketStream out(handle);
+//   out.Instrument(&probe);
+class LatencyProbe
+{
+public:
+    static constexpr size_t MESSAGE_IDS = 8;
+    static constexpr size_t SIZE_CLASSES = 17;  // class k > 0: frames of [2^(k-1), 2^k) words
+
+    LatencyProbe();
+
+    LatencyProbe(const LatencyProbe&) = delete;
+    LatencyProbe& operator=(const LatencyProbe&) = delete;
+
+    // TX side, right before the words are written. Packets may be split
+    // over calls, but calls must come in wire order.
+    void Transmitted(const uint32_t* words, size_t count);
+
+    // RX side: records, then passes the packet on to next if set
+    IPacketStream::Callback_t Callback(IPacketStream::Callback_t next);
+    void Received(const PacketRef& body);
+
+    const LatencyHistogram& Message(uint8_t id) const {return messages[id % MESSAGE_IDS];}
+    const LatencyHistogram& Frame(size_t words) const {return frames[SizeClass(words)];}
+    // Arrivals nothing was sent for, and sent packets that never came back
+    uint64_t Unmatched() const {return unmatched.load(memory_order_relaxed);}
+    uint64_t Lost() const {return lost.load(memory_order_relaxed);}
+
+    // p50/p99/p99.9/max table of every histogram with samples
+    void Print() const;
+
+private:
+    typedef chrono::steady_clock clock;
+
+    struct Stamp
+    {
+        size_t words;
+        clock::time_point sent;
+    };
+
+    static constexpr size_t MAX_PENDING = 64 * 1024;   // per queue, older stamps count as lost
+
+    mutex lock;                     // pending queues and the TX walker
+    deque<clock::time_point> sent_messages[MESSAGE_IDS];
+    deque<Stamp> sent_frames[SIZE_CLASSES];
+    size_t skip;                    // words of the current TX packet still to come
+
+    LatencyHistogram messages[MESSAGE_IDS];
+    LatencyHistogram frames[SIZE_CLASSES];
+    atomic<uint64_t> unmatched;
+    atomic<uint64_t> lost;
+
+    static size_t SizeClass(size_t words);
+};
+
+// streamer latency [seconds] [interval us]
+int RunLatency(int argc, char* argv[]);
+
+#endif // LATENCY_H
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "mapfile.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+
+#ifdef __linux__
+// Opened file and its length, or -1 with the reason printed
+static int OpenSized(const string& path, size_t& size)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Failed to open %s (%s)\r\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        printf("Failed to stat %s (%s)\r\n", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
+    return fd;
+}
+#endif
+
+bool FileSize(const string& path, size_t& size)
+{
+#ifdef __linux__
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        printf("Failed to stat %s (%s)\r\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    size = st.st_size;
+    return true;
+#else
+    (void)size;
+    printf("File mapping is not available on this platform: %s\r\n", path.c_str());
+    return false;
+#endif
+}
+
+const void* MapFile(const string& path, size_t& size)
+{
+#ifdef __linux__
+    size_t length = 0;
+    int fd = OpenSized(path, length);
+    if (fd < 0)
+        return nullptr;
+
+    // an empty file maps to a valid, unused address
+    void* mapped = mmap(nullptr, max<size_t>(length, 1), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        printf("Failed to map %s (%s)\r\n", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+    madvise(mapped, max<size_t>(length, 1), MADV_SEQUENTIAL);
+    size = length;
+    return mapped;
+#else
+    (void)size;
+    printf("File mapping is not available on this platform: %s\r\n", path.c_str());
+    return nullptr;
+#endif
+}
+
+void UnmapFile(const void* data, size_t size)
+{
+#ifdef __linux__
+    if (data != nullptr)
+        munmap(const_cast<void*>(data), max<size_t>(size, 1));
+#else
+    (void)data;
+    (void)size;
+#endif
+}
+
+bool MapFileAt(const string& path, void* at, size_t size, bool writable)
+{
+#ifdef __linux__
+    size_t length = 0;
+    int fd = OpenSized(path, length);
+    if (fd < 0)
+        return false;
+    // the file may have changed since the caller sized the range
+    if (length < size)
+    {
+        printf("%s shrank to %zu bytes, %zu expected\r\n", path.c_str(), length, size);
+        close(fd);
+        return false;
+    }
+
+    void* mapped = (size == 0)? at:
+        mmap(at, size, writable? PROT_READ | PROT_WRITE: PROT_READ,
+             (writable? MAP_PRIVATE: MAP_SHARED) | MAP_FIXED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        printf("Failed to map %s (%s)\r\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    if (size > 0)
+        madvise(at, size, MADV_SEQUENTIAL);
+    return true;
+#else
+    (void)at;
+    (void)size;
+    (void)writable;
+    printf("File mapping is not available on this platform: %s\r\n", path.c_str());
+    return false;
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stddef.h>
+#include <string>
+
+// Memory-mapped capture and waveform files. Every failure is printed with
+// the file name and the reason, so callers only pass the result on.
+
+// Length of the file; false if it cannot be stat'ed
+bool FileSize(const std::string& path, size_t& size);
+
+// Maps the whole file read-only and shared, advised for sequential reading.
+// size receives the file length. An empty file still maps, to a valid
+// address nothing may read. nullptr if the file cannot be opened, stat'ed
+// or mapped.
+const void* MapFile(const std::string& path, size_t& size);
+// Releases a MapFile() mapping; size as MapFile() reported it
+void UnmapFile(const void* data, size_t size);
+
+// Lays the first size bytes of the file over at, inside a range the caller
+// reserved (MAP_FIXED), advised for sequential reading. writable gives
+// private copy-on-write pages. false if the file is shorter than size.
+bool MapFileAt(const std::string& path, void* at, size_t size, bool writable = false);
+
+#endif // MAPFILE_H
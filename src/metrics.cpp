@@ -0,0 +1,321 @@
+#include <errno.h>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+
+atomic<Metrics::Shard*> Metrics::shards(nullptr);
+Metrics::Gauge Metrics::gauges[Metrics::GAUGES];
+thread_local Metrics::Owner Metrics::owner;
+
+namespace
+{
+    struct CounterInfo
+    {
+        const char* name;
+        const char* help;
+        const char* label;          // nullptr: one value, label 0
+    };
+
+    const CounterInfo counter_info[Metrics::COUNTERS] =
+    {
+        {"sdr_rx_bytes_total", "Bytes read from the device", "channel"},
+        {"sdr_tx_bytes_total", "Bytes written to the device", "channel"},
+        {"sdr_rx_frames_total", "Stream frames received", "channel"},
+        {"sdr_tx_frames_total", "Stream frames sent", "channel"},
+        {"sdr_rx_messages_total", "Messages received", "id"},
+        {"sdr_tx_messages_total", "Messages sent", "id"},
+        {"sdr_drops_total", "Packets the recorder had no buffer for", nullptr},
+        {"sdr_bad_headers_total", "Received packet headers with reserved bits set", nullptr},
+        {"sdr_timeouts_total", "Device reads that returned no data", "channel"},
+        {"sdr_transfer_errors_total", "Failed device transfers", "channel"},
+    };
+
+    const CounterInfo gauge_info[Metrics::GAUGES] =
+    {
+        {"sdr_tx_queue_words", "Stream words queued in the TX scheduler", nullptr},
+        {"sdr_tx_queue_messages", "Messages queued in the TX scheduler", nullptr},
+        {"sdr_recorder_backlog", "Recorder buffers waiting to be written", nullptr},
+    };
+
+    const char SHARED_MAGIC[8] = "SDRMET1";
+}
+
+
+uint64_t Metrics::Snapshot::Total(COUNTER counter) const
+{
+    uint64_t total = 0;
+    for (uint64_t value: counters[counter])
+        total += value;
+    return total;
+}
+
+Metrics::Owner::~Owner()
+{
+    if (shard != nullptr)
+        shard->owned.store(false, memory_order_release);
+    shard = nullptr;
+}
+
+// A shard given up by a finished thread is taken over with its counts;
+// only when none is free is a new one pushed onto the list
+Metrics::Shard& Metrics::Acquire()
+{
+    Shard* shard = shards.load(memory_order_acquire);
+    for (; shard != nullptr; shard = shard->next)
+    {
+        bool expected = false;
+        if (!shard->owned.load(memory_order_relaxed) &&
+            shard->owned.compare_exchange_strong(expected, true, memory_order_acquire))
+            break;
+    }
+
+    if (shard == nullptr)
+    {
+        shard = new Shard();
+        shard->owned.store(true, memory_order_relaxed);
+        shard->next = shards.load(memory_order_relaxed);
+        while (!shards.compare_exchange_weak(shard->next, shard, memory_order_release, memory_order_relaxed))
+            ;
+    }
+
+    owner.shard = shard;
+    return *shard;
+}
+
+Metrics::Snapshot Metrics::Read()
+{
+    Snapshot snapshot = {};
+    snapshot.time_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+
+    for (Shard* shard = shards.load(memory_order_acquire); shard != nullptr; shard = shard->next)
+        for (size_t counter = 0; counter < COUNTERS; ++counter)
+            for (size_t label = 0; label < LABELS; ++label)
+                snapshot.counters[counter][label] += shard->values[counter][label].load(memory_order_relaxed);
+
+    for (size_t gauge = 0; gauge < GAUGES; ++gauge)
+        snapshot.gauges[gauge] = gauges[gauge].value.load(memory_order_relaxed);
+    return snapshot;
+}
+
+string Metrics::Prometheus(const Snapshot& snapshot)
+{
+    string text;
+    char line[256];
+
+    for (size_t counter = 0; counter < COUNTERS; ++counter)
+    {
+        const CounterInfo& info = counter_info[counter];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n", info.name, info.help, info.name);
+        text += line;
+
+        if (info.label == nullptr)
+        {
+            snprintf(line, sizeof(line), "%s %llu\n", info.name, static_cast<unsigned long long>(snapshot.Total(COUNTER(counter))));
+            text += line;
+            continue;
+        }
+        for (size_t label = 0; label < LABELS; ++label)
+        {
+            // labels that never counted stay out of the series list
+            if (snapshot.counters[counter][label] == 0)
+                continue;
+            snprintf(line, sizeof(line), "%s{%s=\"%zu\"} %llu\n", info.name, info.label, label,
+                     static_cast<unsigned long long>(snapshot.counters[counter][label]));
+            text += line;
+        }
+    }
+
+    for (size_t gauge = 0; gauge < GAUGES; ++gauge)
+    {
+        const CounterInfo& info = gauge_info[gauge];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", info.name, info.help, info.name,
+                 info.name, static_cast<long long>(snapshot.gauges[gauge]));
+        text += line;
+    }
+    return text;
+}
+
+
+// The shared-memory layout. seq is odd while the exporter writes; a reader
+// copies the snapshot and retries unless seq was the same even value
+// before and after.
+struct MetricsExporter::Shared
+{
+    char magic[8];
+    uint32_t counters;
+    uint32_t labels;
+    uint32_t gauges;
+    atomic<uint32_t> seq;
+    Metrics::Snapshot snapshot;
+};
+
+bool Metrics::ReadShared(const string& name, Snapshot& snapshot)
+{
+#ifdef __linux__
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return false;
+    void* region = mmap(nullptr, sizeof(MetricsExporter::Shared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        return false;
+
+    const MetricsExporter::Shared* shared = static_cast<const MetricsExporter::Shared*>(region);
+    bool ok = memcmp(shared->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC)) == 0 &&
+              shared->counters == COUNTERS && shared->labels == LABELS && shared->gauges == GAUGES;
+    if (ok)
+    {
+        while (true)
+        {
+            uint32_t before = shared->seq.load(memory_order_acquire);
+            if (before & 1)
+            {
+                this_thread::yield();
+                continue;
+            }
+            memcpy(&snapshot, &shared->snapshot, sizeof(snapshot));
+            atomic_thread_fence(memory_order_acquire);
+            if (shared->seq.load(memory_order_relaxed) == before)
+                break;
+        }
+    }
+    munmap(region, sizeof(MetricsExporter::Shared));
+    return ok;
+#else
+    (void)name;
+    (void)snapshot;
+    return false;
+#endif
+}
+
+
+MetricsExporter::Config MetricsExporter::Config::Default()
+{
+    Config config;
+    const char* env = getenv("SDR_METRICS");
+    if (env != nullptr)
+        config.prometheus_path = env;
+    env = getenv("SDR_METRICS_SHM");
+    if (env != nullptr)
+        config.shm_name = env;
+    return config;
+}
+
+MetricsExporter::MetricsExporter(const Config& config)
+: config(config)
+, shared(nullptr)
+{
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    Stop();
+#ifdef __linux__
+    if (shared != nullptr)
+    {
+        munmap(shared, sizeof(Shared));
+        shm_unlink(config.shm_name.c_str());
+    }
+#endif
+}
+
+bool MetricsExporter::Start()
+{
+    if (runner.joinable() || (config.prometheus_path.empty() && config.shm_name.empty()))
+        return true;
+
+#ifdef __linux__
+    if (!config.shm_name.empty() && shared == nullptr)
+    {
+        int fd = shm_open(config.shm_name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0)
+        {
+            printf("Metrics: cannot open shared memory %s: %s\r\n", config.shm_name.c_str(), strerror(errno));
+            return false;
+        }
+        void* region = MAP_FAILED;
+        if (ftruncate(fd, sizeof(Shared)) == 0)
+            region = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (region == MAP_FAILED)
+        {
+            printf("Metrics: cannot map shared memory %s: %s\r\n", config.shm_name.c_str(), strerror(errno));
+            shm_unlink(config.shm_name.c_str());
+            return false;
+        }
+
+        shared = new (region) Shared();
+        shared->counters = Metrics::COUNTERS;
+        shared->labels = Metrics::LABELS;
+        shared->gauges = Metrics::GAUGES;
+        // the magic last: readers take the segment for valid once it matches
+        atomic_thread_fence(memory_order_release);
+        memcpy(shared->magic, SHARED_MAGIC, sizeof(SHARED_MAGIC));
+    }
+#else
+    if (!config.shm_name.empty())
+        printf("Metrics: shared memory export is not supported on this platform\r\n");
+#endif
+
+    runner = thread([this]
+    {
+        ApplyThreadPolicy(config.policy);
+        auto next = chrono::steady_clock::now();
+        do
+        {
+            Publish();
+            next += config.period;
+        }
+        while (stop.SleepUntil(next));
+    });
+    return true;
+}
+
+void MetricsExporter::Stop()
+{
+    stop.Request();
+    if (runner.joinable())
+    {
+        runner.join();
+        // the final counts, so short runs are not lost between periods
+        Publish();
+    }
+}
+
+void MetricsExporter::Publish()
+{
+    Metrics::Snapshot snapshot = Metrics::Read();
+
+    if (shared != nullptr)
+    {
+        uint32_t seq = shared->seq.load(memory_order_relaxed);
+        shared->seq.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(&shared->snapshot, &snapshot, sizeof(snapshot));
+        shared->seq.store(seq + 2, memory_order_release);
+    }
+
+    if (!config.prometheus_path.empty())
+    {
+        string text = Metrics::Prometheus(snapshot);
+        string temp = config.prometheus_path + ".tmp";
+        FILE* file = fopen(temp.c_str(), "w");
+        if (file == nullptr)
+            return;
+        bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+        ok = (fclose(file) == 0) && ok;
+        if (!ok || rename(temp.c_str(), config.prometheus_path.c_str()) != 0)
+            remove(temp.c_str());
+    }
+}
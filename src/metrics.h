@@ -0,0 +1,145 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include "rtthread.h"
+#include "streamer.h"
+#include "waitstrategy.h"
+
+// Process-wide counters and gauges. Every thread counts into its own
+// cache-line aligned shard, so Add() is one relaxed load and store on
+// memory no other thread writes; Read() sums the shards without locking.
+// Shards are never freed: a thread's shard is taken over by a later
+// thread, so totals only grow. Counters carry one label each (the FIFO
+// channel or the message id); gauges are last-written values.
+//   Metrics::Add(Metrics::RX_BYTES, channel, count);
+//   Metrics::Snapshot now = Metrics::Read();
+class Metrics
+{
+public:
+    static constexpr size_t LABELS = 8;
+
+    enum COUNTER
+    {
+        RX_BYTES,           // per channel
+        TX_BYTES,           // per channel
+        RX_FRAMES,          // per channel
+        TX_FRAMES,          // per channel
+        RX_MESSAGES,        // per message id
+        TX_MESSAGES,        // per message id
+        DROPS,              // packets the recorder had no buffer for
+        BAD_HEADERS,        // received headers with reserved bits set
+        TIMEOUTS,           // per channel, reads that returned nothing
+        TRANSFER_ERRORS,    // per channel
+        COUNTERS
+    };
+
+    enum GAUGE
+    {
+        TX_QUEUE_WORDS,     // stream words waiting in the TxScheduler
+        TX_QUEUE_MESSAGES,
+        RECORDER_BACKLOG,   // recorder buffers waiting for the disk
+        GAUGES
+    };
+
+    struct Snapshot
+    {
+        int64_t time_ns;                            // system_clock
+        uint64_t counters[COUNTERS][LABELS];
+        int64_t gauges[GAUGES];
+
+        uint64_t Total(COUNTER counter) const;
+    };
+
+    static void Add(COUNTER counter, unsigned label, uint64_t count = 1)
+    {
+        atomic<uint64_t>& value = Local().values[counter][label % LABELS];
+        value.store(value.load(memory_order_relaxed) + count, memory_order_relaxed);
+    }
+
+    static void Set(GAUGE gauge, int64_t value)
+    {
+        gauges[gauge].value.store(value, memory_order_relaxed);
+    }
+
+    static Snapshot Read();
+    // From the shared-memory snapshot of a running exporter, e.g. another
+    // process; false if there is none
+    static bool ReadShared(const string& name, Snapshot& snapshot);
+
+    // Prometheus text exposition format
+    static string Prometheus(const Snapshot& snapshot);
+
+private:
+    struct alignas(64) Shard
+    {
+        atomic<uint64_t> values[COUNTERS][LABELS];
+        atomic<bool> owned;
+        Shard* next;
+    };
+
+    struct alignas(64) Gauge
+    {
+        atomic<int64_t> value;
+    };
+
+    // Holds the calling thread's shard, handing it back on thread exit
+    struct Owner
+    {
+        Shard* shard = nullptr;
+        ~Owner();
+    };
+
+    static atomic<Shard*> shards;
+    static Gauge gauges[GAUGES];
+    static thread_local Owner owner;
+
+    static Shard& Local()
+    {
+        Shard* shard = owner.shard;
+        return (shard != nullptr)? *shard: Acquire();
+    }
+    static Shard& Acquire();
+};
+
+// Publishes Metrics::Read() every period: as a Prometheus text file,
+// rewritten through a rename so scrapers never see half a file, and as a
+// seqlock-guarded snapshot in POSIX shared memory for Metrics::ReadShared().
+class MetricsExporter
+{
+public:
+    struct Config
+    {
+        string prometheus_path;                 // empty: no file
+        string shm_name;                        // e.g. "/sdr-metrics", empty: no snapshot
+        chrono::milliseconds period{1000};
+        ThreadPolicy policy = ThreadPolicy("sdr-metrics");
+
+        // From SDR_METRICS=<file> and SDR_METRICS_SHM=<name>
+        static Config Default();
+    };
+
+    explicit MetricsExporter(const Config& config);
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+    // false if the shared memory cannot be set up; nothing to do is fine
+    bool Start();
+    void Stop();
+    // Publishes once, now
+    void Publish();
+
+private:
+    friend class Metrics;
+    struct Shared;
+
+    const Config config;
+    Shared* shared;
+    StopFlag stop;
+    thread runner;
+};
+
+#endif // METRICS_H
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "mapfile.h"
+#include "pack24.h"
+
+using namespace std;
+
+static const char* SAMPLES_EXT = ".iq24";
+static const char* SIDE_EXT = ".side";
+
+
+void Pack24(const uint32_t* words, size_t count, uint8_t* out)
+{
+    size_t idx = 0;
+
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi32(0x00000fff);
+    const __m128i high = _mm_set1_epi32(0x00fff000);
+    const __m128i pair_low = _mm_set1_epi64x(0x0000000000ffffff);
+    const __m128i pair_high = _mm_set1_epi64x(0x0000ffffff000000);
+
+    // 4 words per round, written as two overlapping 8-byte stores; the
+    // second spills 2 bytes past the group, so keep one word in reserve
+    for (; idx + 4 < count; idx += 4)
+    {
+        __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + idx));
+        // I into bits 11:0, Q down into bits 23:12
+        __m128i s = _mm_or_si128(_mm_and_si128(w, low), _mm_and_si128(_mm_srli_epi32(w, 4), high));
+        // two 24-bit samples per 64-bit lane, adjacent
+        __m128i p = _mm_or_si128(_mm_and_si128(s, pair_low), _mm_and_si128(_mm_srli_epi64(s, 8), pair_high));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), p);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 6), _mm_unpackhi_epi64(p, p));
+        out += 12;
+    }
+#endif
+
+    for (; idx < count; ++idx)
+    {
+        uint32_t w = words[idx];
+        uint32_t s = (w & 0xfff) | ((w >> 4) & 0xfff000);
+        out[0] = static_cast<uint8_t>(s);
+        out[1] = static_cast<uint8_t>(s >> 8);
+        out[2] = static_cast<uint8_t>(s >> 16);
+        out += 3;
+    }
+}
+
+void Unpack24(const uint8_t* in, size_t count, uint32_t* words)
+{
+    size_t idx = 0;
+
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi32(0x00000fff);
+    const __m128i high = _mm_set1_epi32(0x0fff0000);
+    const __m128i pair_low = _mm_set1_epi64x(0x0000000000ffffff);
+    const __m128i pair_high = _mm_set1_epi64x(0x00ffffff00000000);
+
+    // 8-byte loads at 0 and 6 read 2 bytes past the group: same reserve
+    for (; idx + 4 < count; idx += 4)
+    {
+        __m128i p = _mm_unpacklo_epi64(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in)),
+                                       _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + 6)));
+        // one 24-bit sample per 32-bit lane
+        __m128i s = _mm_or_si128(_mm_and_si128(p, pair_low), _mm_and_si128(_mm_slli_epi64(p, 8), pair_high));
+        __m128i w = _mm_or_si128(_mm_and_si128(s, low), _mm_and_si128(_mm_slli_epi32(s, 4), high));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(words + idx), w);
+        in += 12;
+    }
+#endif
+
+    for (; idx < count; ++idx)
+    {
+        uint32_t s = in[0] | (in[1] << 8) | (in[2] << 16);
+        words[idx] = (s & 0xfff) | ((s & 0xfff000) << 4);
+        in += 3;
+    }
+}
+
+
+Compact24Recorder::Compact24Recorder(const Config& config)
+: packed(SampleConfig(config))
+, side(SideConfig(config))
+, samples(0)
+{
+    scratch.resize(3 * 0x10000);
+}
+
+Compact24Recorder::~Compact24Recorder()
+{
+    Stop();
+}
+
+Recorder::Config Compact24Recorder::SampleConfig(const Config& config)
+{
+    Recorder::Config data = config.samples;
+    data.path = config.path + SAMPLES_EXT;
+    data.file_bytes = 0;
+    data.index_interval = 0;
+    return data;
+}
+
+Recorder::Config Compact24Recorder::SideConfig(const Config& config)
+{
+    Recorder::Config data = config.side;
+    data.path = config.path + SIDE_EXT;
+    data.file_bytes = 0;
+    data.index_interval = 0;
+    data.writer.name = config.side.writer.name + "-side";
+    return data;
+}
+
+bool Compact24Recorder::Start()
+{
+    return packed.Start() && side.Start();
+}
+
+void Compact24Recorder::Stop()
+{
+    packed.Stop();
+    side.Stop();
+}
+
+IPacketStream::Callback_t Compact24Recorder::Callback(IPacketStream::Callback_t next)
+{
+    return [this, next](uint8_t msgId, const PacketRef& body)
+    {
+        Record(body);
+        if (next)
+            next(msgId, body);
+    };
+}
+
+void Compact24Recorder::Record(const PacketRef& body)
+{
+    if (body.IsMessage())
+    {
+        // header already in body[0]
+        side.Write(body.data(), body.size() * sizeof(uint32_t));
+        return;
+    }
+
+    // both files get the frame or neither does: a header without its
+    // samples, or samples without a header, would shift every later frame
+    size_t count = body.size();
+    uint32_t header = F2FIFO(static_cast<uint16_t>(count));
+    if (!packed.Room(3 * count) || !side.Room(sizeof(header)))
+        return;
+
+    Pack24(body.data(), count, scratch.data());
+    packed.Write(scratch.data(), 3 * count);
+    side.Write(&header, sizeof(header));
+    samples += count;
+}
+
+
+Compact24Reader::Compact24Reader()
+: pool(BufferPool::Default())
+, samples_data(nullptr)
+, samples_size(0)
+, side_data(nullptr)
+, side_words(0)
+{
+}
+
+Compact24Reader::~Compact24Reader()
+{
+    Close();
+}
+
+bool Compact24Reader::Open(const string& path)
+{
+#ifdef __linux__
+    Close();
+
+    size_t side_size = 0;
+    samples_data = static_cast<const uint8_t*>(MapFile(path + SAMPLES_EXT, samples_size));
+    side_data = static_cast<const uint32_t*>(MapFile(path + SIDE_EXT, side_size));
+    side_words = side_size / sizeof(uint32_t);
+    if (samples_data == nullptr || side_data == nullptr)
+    {
+        Close();
+        return false;
+    }
+    return true;
+#else
+    printf("Compact capture replay needs mmap, not available on this platform: %s\r\n", path.c_str());
+    return false;
+#endif
+}
+
+void Compact24Reader::Close()
+{
+#ifdef __linux__
+    UnmapFile(samples_data, samples_size);
+    UnmapFile(side_data, side_words * sizeof(uint32_t));
+#endif
+    samples_data = nullptr;
+    samples_size = 0;
+    side_data = nullptr;
+    side_words = 0;
+}
+
+bool Compact24Reader::Replay(IPacketStream::Callback_t callback)
+{
+    const uint8_t* in = samples_data;
+    const uint8_t* in_end = samples_data + samples_size;
+
+    for (size_t pos = 0; pos < side_words;)
+    {
+        uint32_t word = side_data[pos];
+
+        if (SDR_HEADER::IsCmd(word))
+        {
+            F2CPU header(word);
+            size_t words = 1 + header.num();
+            if (pos + words > side_words)
+                return false;
+            PacketRef packet = pool.Get(words);
+            memcpy(packet.data(), side_data + pos, words * sizeof(uint32_t));
+            packet.msgId(header.id());
+            packet.IsMessage(true);
+            callback(header.id(), packet);
+            pos += words;
+            continue;
+        }
+
+        size_t count = F2FIFO(word).num();
+        if (static_cast<size_t>(in_end - in) < 3 * count)
+            return false;
+        PacketRef packet = pool.Get(count);
+        Unpack24(in, count, packet.data());
+        packet.msgId(0);
+        packet.IsMessage(false);
+        callback(0, packet);
+        in += 3 * count;
+        ++pos;
+    }
+
+    return in == in_end;
+}
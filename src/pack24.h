@@ -0,0 +1,81 @@
+#ifndef PACK24_H
+#define PACK24_H
+
+#include <string>
+#include <vector>
+#include "recorder.h"
+#include "streamer.h"
+
+// Stream words carry two 12-bit samples in 32 bits. Packed, an IQ pair
+// takes 3 bytes: I in bits 11:0 and Q in bits 23:12, little-endian. Bits
+// 15:12 and 31:28 of a word hold no sample data (IQ_SAMPLE ignores them)
+// and come back as zero.
+void Pack24(const uint32_t* words, size_t count, uint8_t* out);
+void Unpack24(const uint8_t* in, size_t count, uint32_t* words);
+
+// Compact capture: path.iq24 holds the packed stream samples back to back,
+// path.side the wire stream with the stream payloads taken out, i.e. every
+// F2FIFO header (the frame boundaries) and every F2CPU message in arrival
+// order. Replaying both gives back the received packet sequence.
+class Compact24Recorder
+{
+public:
+    struct Config
+    {
+        string path = "capture";        // without the .iq24/.side extension
+        Recorder::Config samples;       // path and file_bytes are set here
+        Recorder::Config side;
+    };
+
+    explicit Compact24Recorder(const Config& config);
+    ~Compact24Recorder();
+
+    bool Start();
+    // Call after the producer has stopped
+    void Stop();
+
+    // RX thread; a frame whose samples or header cannot be buffered is dropped whole
+    void Record(const PacketRef& body);
+    IPacketStream::Callback_t Callback(IPacketStream::Callback_t next = nullptr);
+
+    uint64_t Samples() const {return samples;}
+    Recorder::Stats SampleStats() const {return packed.GetStats();}
+    Recorder::Stats SideStats() const {return side.GetStats();}
+
+private:
+    Recorder packed;
+    Recorder side;
+    vector<uint8_t> scratch;        // RX thread
+    uint64_t samples;
+
+    static Recorder::Config SampleConfig(const Config& config);
+    static Recorder::Config SideConfig(const Config& config);
+};
+
+// Memory-mapped reader for compact captures
+class Compact24Reader
+{
+public:
+    Compact24Reader();
+    ~Compact24Reader();
+
+    bool Open(const string& path);
+    void Close();
+
+    uint64_t Samples() const {return samples_size / 3;}
+
+    // Delivers the recorded packets in order on the calling thread; false
+    // if the two files disagree (truncated capture)
+    bool Replay(IPacketStream::Callback_t callback);
+
+private:
+    BufferPool& pool;
+    const uint8_t* samples_data;
+    size_t samples_size;
+    const uint32_t* side_data;
+    size_t side_words;
+
+    void Unmap();
+};
+
+#endif // PACK24_H
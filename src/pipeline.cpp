@@ -0,0 +1,211 @@
+#include "pipeline.h"
+
+using namespace std;
+
+
+Pipeline::Pipeline(size_t frames)
+: buffers(BufferPool::Default())
+, free_frames(frames)
+, running(false)
+, pushing(0)
+, source_drops(0)
+, seq(0)
+{
+    for (size_t idx = 0; idx < frames; ++idx)
+    {
+        pool.emplace_back(new Frame());
+        free_frames.TryPush(pool.back().get());
+    }
+}
+
+Pipeline::~Pipeline()
+{
+    Stop();
+}
+
+Stage& Pipeline::Add(unique_ptr<Stage> stage, const ThreadPolicy& policy)
+{
+    assert(!running);
+
+    unique_ptr<Node> node(new Node());
+    node->stage = move(stage);
+    node->policy = policy;
+    // every link can hold the whole pool, so forwarding never blocks
+    node->input.reset(new SpscQueue<Frame*>(pool.size()));
+    nodes.push_back(move(node));
+
+    return *nodes.back()->stage;
+}
+
+Stage& Pipeline::Add(unique_ptr<Stage> stage, int core)
+{
+    ThreadPolicy policy(stage->Name(), core);
+    return Add(move(stage), policy);
+}
+
+void Pipeline::Start()
+{
+    assert(!nodes.empty());
+    if (running.exchange(true))
+        return;
+
+    for (size_t idx = 0; idx < nodes.size(); ++idx)
+    {
+        nodes[idx]->closing = false;
+        nodes[idx]->worker = thread(&Pipeline::Worker, this, idx);
+    }
+}
+
+void Pipeline::Stop()
+{
+    if (!running.exchange(false))
+        return;
+
+    // a Push() that saw running still set must land before node 0 closes
+    while (pushing.load(memory_order_seq_cst) != 0)
+        this_thread::yield();
+
+    // drain front to back: a stage closes once its producer has exited
+    for (auto& node: nodes)
+    {
+        node->closing = true;
+        node->ready.Notify();
+        if (node->worker.joinable())
+            node->worker.join();
+    }
+}
+
+Frame* Pipeline::Acquire(uint8_t msgId)
+{
+    Frame* frame;
+    if (!free_frames.TryPop(frame))
+    {
+        source_drops.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+
+    frame->msgId = msgId;
+    frame->seq = seq++;
+    frame->dropped = false;
+    return frame;
+}
+
+bool Pipeline::Push(uint8_t msgId, const PacketRef& body)
+{
+    // seq_cst on both sides: either Stop() sees this call or it sees Stop()
+    pushing.fetch_add(1, memory_order_seq_cst);
+    Frame* frame = nullptr;
+    if (running.load(memory_order_seq_cst))
+        frame = Acquire(msgId);
+    else
+        source_drops.fetch_add(1, memory_order_relaxed);
+
+    if (frame != nullptr)
+    {
+        frame->words = body;
+        nodes.front()->input->TryPush(frame);
+        nodes.front()->ready.Notify();
+    }
+    pushing.fetch_sub(1, memory_order_release);
+    return frame != nullptr;
+}
+
+bool Pipeline::Push(uint8_t msgId, const uint32_t* words, size_t count)
+{
+    PacketRef body = buffers.Get(count);
+    copy(words, words + count, body.begin());
+    return Push(msgId, body);
+}
+
+IPacketStream::Callback_t Pipeline::Callback()
+{
+    return [this](uint8_t msgId, const PacketRef& body)
+    {
+        Push(msgId, body);
+    };
+}
+
+void Pipeline::Forward(size_t index, Frame* frame)
+{
+    if (index + 1 < nodes.size())
+    {
+        nodes[index + 1]->input->TryPush(frame);
+        nodes[index + 1]->ready.Notify();
+    }
+    else
+    {
+        frame->words.reset();
+        free_frames.TryPush(frame);
+    }
+}
+
+void Pipeline::Worker(size_t index)
+{
+    Node& node = *nodes[index];
+
+    ApplyThreadPolicy(node.policy);
+    printf("%s\r\n", DescribeThread().c_str());
+
+    while (true)
+    {
+        Frame* frame;
+        if (!node.input->TryPop(frame))
+        {
+            if (node.closing.load(memory_order_acquire) && node.input->Empty())
+                break;
+
+            node.ready.Wait([&node]
+            {
+                return !node.input->Empty() || node.closing.load(memory_order_acquire);
+            });
+            continue;
+        }
+
+        size_t depth = node.input->Size() + 1;
+        if (depth > node.queue_max.load(memory_order_relaxed))
+            node.queue_max.store(depth, memory_order_relaxed);
+
+        if (!frame->dropped)
+        {
+            auto begin = chrono::steady_clock::now();
+            bool keep = node.stage->Process(*frame);
+            auto spent = chrono::steady_clock::now() - begin;
+
+            node.busy_ns.fetch_add(chrono::duration_cast<chrono::nanoseconds>(spent).count(),
+                                   memory_order_relaxed);
+            node.frames.fetch_add(1, memory_order_relaxed);
+            node.bytes.fetch_add(frame->words.size() * sizeof(uint32_t), memory_order_relaxed);
+            if (!keep)
+            {
+                frame->dropped = true;
+                node.dropped.fetch_add(1, memory_order_relaxed);
+            }
+        }
+
+        Forward(index, frame);
+    }
+
+    node.stage->Finish();
+}
+
+vector<Stage::Stats> Pipeline::Stats() const
+{
+    vector<Stage::Stats> stats;
+
+    for (auto& node: nodes)
+    {
+        Stage::Stats s;
+        s.name = node->stage->Name();
+        s.core = node->policy.core;
+        s.frames = node->frames.load(memory_order_relaxed);
+        s.bytes = node->bytes.load(memory_order_relaxed);
+        s.dropped = node->dropped.load(memory_order_relaxed);
+        s.busy_ns = node->busy_ns.load(memory_order_relaxed);
+        s.queue_depth = node->input->Size();
+        s.queue_max = node->queue_max.load(memory_order_relaxed);
+        s.queue_capacity = node->input->Capacity();
+        stats.push_back(s);
+    }
+
+    return stats;
+}
@@ -0,0 +1,110 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <vector>
+#include "rtthread.h"
+#include "spsc.h"
+#include "streamer.h"
+#include "waitstrategy.h"
+
+// Unit of work travelling between pipeline stages
+struct Frame
+{
+    uint8_t msgId;
+    uint64_t seq;
+    bool dropped;           // a stage rejected it, later stages skip it
+    PacketRef words;        // shared with the source, released when the frame is recycled
+};
+
+class Stage
+{
+public:
+    struct Stats
+    {
+        string name;
+        int core;
+        uint64_t frames;
+        uint64_t bytes;
+        uint64_t dropped;
+        uint64_t busy_ns;       // time spent inside Process()
+        size_t queue_depth;     // frames waiting at the stage input
+        size_t queue_max;
+        size_t queue_capacity;
+    };
+
+    explicit Stage(const string& name): name(name) {}
+    virtual ~Stage() {}
+
+    // Runs on the stage's own thread. Return false to drop the frame.
+    virtual bool Process(Frame& frame) = 0;
+    // Called on the stage thread once the input is drained at Stop()
+    virtual void Finish() {}
+
+    const string& Name() const {return name;}
+
+private:
+    friend class Pipeline;
+    const string name;
+};
+
+// Chain of stages, each on its own (optionally pinned) thread, linked by
+// SPSC queues. Frames come from a fixed pool and are recycled by the last
+// stage back to the source, so the steady state does not allocate. Frames
+// hold the received pool buffer itself: a pipeline keeps up to frames
+// BufferPool buffers in flight.
+class Pipeline
+{
+public:
+    explicit Pipeline(size_t frames = 64);
+    ~Pipeline();
+
+    Stage& Add(unique_ptr<Stage> stage, const ThreadPolicy& policy);
+    Stage& Add(unique_ptr<Stage> stage, int core = -1);
+
+    void Start();
+    void Stop();
+
+    // Source side, single producer (normally the USB reader thread).
+    // Returns false and counts a drop when no free frame is available or
+    // the pipeline is stopped.
+    bool Push(uint8_t msgId, const PacketRef& body);
+    // Copies the words into a pooled buffer first
+    bool Push(uint8_t msgId, const uint32_t* words, size_t count);
+    IPacketStream::Callback_t Callback();
+
+    vector<Stage::Stats> Stats() const;
+    uint64_t SourceDrops() const {return source_drops.load(memory_order_relaxed);}
+
+private:
+    struct Node
+    {
+        unique_ptr<Stage> stage;
+        ThreadPolicy policy;
+        unique_ptr<SpscQueue<Frame*>> input;
+        thread worker;
+        atomic<bool> closing{false};
+        WaitPoint ready;            // signalled on every push into input
+
+        alignas(CACHE_LINE) atomic<uint64_t> frames{0};
+        atomic<uint64_t> bytes{0};
+        atomic<uint64_t> dropped{0};
+        atomic<uint64_t> busy_ns{0};
+        atomic<size_t> queue_max{0};
+    };
+
+    BufferPool& buffers;
+    vector<unique_ptr<Frame>> pool;
+    SpscQueue<Frame*> free_frames;
+    vector<unique_ptr<Node>> nodes;
+    atomic<bool> running;
+    atomic<int> pushing;            // Push() calls in progress, Stop() waits them out
+    atomic<uint64_t> source_drops;
+    uint64_t seq;
+
+    Frame* Acquire(uint8_t msgId);
+    void Worker(size_t index);
+    void Forward(size_t index, Frame* frame);
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "mapfile.h"
+#include "playback.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+
+WaveformPlayer::WaveformPlayer(OPacketStream& out)
+: WaveformPlayer(out, Config())
+{
+}
+
+WaveformPlayer::WaveformPlayer(OPacketStream& out, const Config& config)
+: out(out)
+, config(config)
+, pool(BufferPool::Default())
+, region(nullptr)
+, region_size(0)
+, data(nullptr)
+, data_size(0)
+, samples(0)
+, advised(0)
+, frames(0)
+, words(0)
+, loops(0)
+{
+}
+
+WaveformPlayer::~WaveformPlayer()
+{
+    Close();
+}
+
+bool WaveformPlayer::ParseFormat(const char* text, FORMAT& format)
+{
+    if (strcmp(text, "words") == 0)
+        format = FORMAT::WORDS;
+    else if (strcmp(text, "ci16") == 0)
+        format = FORMAT::CI16;
+    else if (strcmp(text, "cf32") == 0)
+        format = FORMAT::CF32;
+    else
+        return false;
+    return true;
+}
+
+bool WaveformPlayer::Open(const string& path)
+{
+#ifdef __linux__
+    Close();
+
+    size_t file_size = 0;
+    if (!FileSize(path, file_size))
+        return false;
+    if (file_size == 0)
+    {
+        printf("%s is empty\r\n", path.c_str());
+        return false;
+    }
+
+    size_t sample_bytes = (config.format == FORMAT::CF32)? 2 * sizeof(float):
+                          (config.format == FORMAT::CI16)? 2 * sizeof(int16_t): sizeof(uint32_t);
+    samples = file_size / sample_bytes;
+    data_size = samples * sample_bytes;
+
+    // one spare page in front holds the first frame's header slot
+    size_t page = sysconf(_SC_PAGESIZE);
+    region_size = page + data_size;
+    void* base = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        printf("Failed to reserve %zu bytes for %s\r\n", region_size, path.c_str());
+        region_size = 0;
+        return false;
+    }
+    region = static_cast<uint8_t*>(base);
+
+    // private and writable so headers can be stored in place; untouched
+    // pages stay shared with the page cache
+    if (!MapFileAt(path, region + page, data_size, true))
+    {
+        Close();
+        return false;
+    }
+    data = region + page;
+
+    advised = 0;
+    Advise(0);
+
+    printf("%s: %zu samples, %zu MiB mapped\r\n", path.c_str(), samples, data_size >> 20);
+    return true;
+#else
+    printf("Waveform playback needs mmap, not available on this platform: %s\r\n", path.c_str());
+    return false;
+#endif
+}
+
+void WaveformPlayer::Close()
+{
+#ifdef __linux__
+    if (region != nullptr)
+        munmap(region, region_size);
+#endif
+    region = nullptr;
+    region_size = 0;
+    data = nullptr;
+    data_size = 0;
+    samples = 0;
+}
+
+bool WaveformPlayer::Play()
+{
+    if (data == nullptr)
+        return false;
+
+    const size_t frame = min<size_t>(max<size_t>(config.frame_words, 1), 0xffff);
+
+    while (!stop && (config.loops == 0 || loops < config.loops))
+    {
+        for (size_t first = 0; first < samples && !stop; first += frame)
+        {
+            size_t count = min(frame, samples - first);
+            Advise(first * (data_size / samples));
+            if (!SendFrame(first, count))
+                return false;
+            ++frames;
+            words += count;
+        }
+        ++loops;
+        advised = 0;
+        Advise(0);
+    }
+
+    return true;
+}
+
+bool WaveformPlayer::SendFrame(size_t first, size_t count)
+{
+    uint32_t header = F2FIFO(static_cast<uint16_t>(count));
+
+    if (config.format == FORMAT::WORDS)
+    {
+        // the slot is the last word of the previous frame (already on the
+        // wire) or of the spare page
+        uint32_t* slot = reinterpret_cast<uint32_t*>(const_cast<uint8_t*>(data)) + first - 1;
+        uint32_t saved = *slot;
+        bool ok = out.SendReserved(header, slot, count);
+        *slot = saved;
+        return ok;
+    }
+
+    PacketRef packet = pool.Get(count + 1);
+    Convert(first, count, packet.data() + 1);
+    return out.SendReserved(header, packet.data(), count);
+}
+
+void WaveformPlayer::Convert(size_t first, size_t count, uint32_t* words) const
+{
+    if (config.format == FORMAT::CI16)
+    {
+        auto iq = reinterpret_cast<const int16_t*>(data) + 2 * first;
+        for (size_t idx = 0; idx < count; ++idx)
+            words[idx] = IQ_SAMPLE::Pack(iq[2 * idx] >> 4, iq[2 * idx + 1] >> 4);
+        return;
+    }
+
+    auto iq = reinterpret_cast<const float*>(data) + 2 * first;
+    auto scale = [](float value) -> int16_t
+    {
+        return static_cast<int16_t>(lrintf(min(max(value, -1.0f), 1.0f) * 2047.0f));
+    };
+    for (size_t idx = 0; idx < count; ++idx)
+        words[idx] = IQ_SAMPLE::Pack(scale(iq[2 * idx]), scale(iq[2 * idx + 1]));
+}
+
+// Keeps readahead bytes advised ahead of position and releases what is
+// more than one readahead behind it, so private copies and cached pages of
+// a multi-GB file do not pile up
+void WaveformPlayer::Advise(size_t position)
+{
+#ifdef __linux__
+    if (position + config.readahead / 2 < advised)
+        return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = advised;
+    size_t end = min(data_size, position + config.readahead);
+    if (end > start)
+        madvise(const_cast<uint8_t*>(data) + start / page * page, end - start / page * page, MADV_WILLNEED);
+    advised = max(advised, end);
+
+    if (position > config.readahead)
+    {
+        size_t behind = (position - config.readahead) / page * page;
+        madvise(const_cast<uint8_t*>(data), behind, MADV_DONTNEED);
+    }
+#else
+    (void)position;
+#endif
+}
@@ -0,0 +1,81 @@
+#ifndef PLAYBACK_H
+#define PLAYBACK_H
+
+#include <string>
+#include "streamer.h"
+#include "waitstrategy.h"
+
+// Replays a waveform file on the TX stream from a memory mapping.
+// Raw word files go out without copying the payload: the file is mapped
+// privately with one spare word in front, and each frame's header is stored
+// in the last word of the frame just sent (restored right after), so every
+// frame is a single in-place SendReserved(). Only one page per frame is ever
+// copied-on-write, and pages behind the read position are handed back with
+// MADV_DONTNEED. IQ formats are converted frame by frame into pool buffers.
+class WaveformPlayer
+{
+public:
+    enum class FORMAT
+    {
+        WORDS,      // packed IQ_SAMPLE words as the FPGA takes them
+        CI16,       // interleaved int16 I/Q, top 12 bits used
+        CF32        // interleaved float I/Q, full scale +-1.0
+    };
+
+    struct Config
+    {
+        FORMAT format = FORMAT::WORDS;
+        size_t frame_words = 0xffff;        // larger frames mean fewer copied-on-write pages
+        uint64_t loops = 1;                 // 0: until Stop()
+        size_t readahead = 64 << 20;        // bytes advised WILLNEED ahead of the read position
+    };
+
+    struct Stats
+    {
+        uint64_t frames;
+        uint64_t words;
+        uint64_t loops;
+    };
+
+    explicit WaveformPlayer(OPacketStream& out);
+    WaveformPlayer(OPacketStream& out, const Config& config);
+    ~WaveformPlayer();
+
+    // Accepts wav-style names: "words", "ci16", "cf32"
+    static bool ParseFormat(const char* text, FORMAT& format);
+
+    bool Open(const string& path);
+    void Close();
+
+    // Streams on the calling thread until the loops are done, Stop() or a
+    // failed write (returns false)
+    bool Play();
+    // Any thread
+    void Stop() {stop.Request();}
+
+    size_t Samples() const {return samples;}
+    Stats GetStats() const {return Stats{frames, words, loops};}
+
+private:
+    OPacketStream& out;
+    const Config config;
+    BufferPool& pool;
+
+    uint8_t* region;                // mapping start, including the spare page
+    size_t region_size;
+    const uint8_t* data;            // file contents
+    size_t data_size;
+    size_t samples;
+    size_t advised;                 // bytes of data advised WILLNEED so far
+
+    StopFlag stop;
+    uint64_t frames;
+    uint64_t words;
+    uint64_t loops;
+
+    bool SendFrame(size_t first, size_t count);
+    void Convert(size_t first, size_t count, uint32_t* out) const;
+    void Advise(size_t position);
+};
+
+#endif // PLAYBACK_H
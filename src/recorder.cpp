@@ -0,0 +1,678 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "blockcodec.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "workpool.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+static const size_t ALIGN = 4096;          // O_DIRECT offset, length and address alignment
+
+static size_t RoundUp(size_t val, size_t align)
+{
+    return (val + align - 1) / align * align;
+}
+
+
+#ifdef __linux__
+// Minimal io_uring over the raw syscalls (no liburing): writes only, one
+// submitter and one reaper, both the recorder's writer thread.
+class Uring
+{
+public:
+    Uring(): fd(-1), sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr) {}
+    ~Uring()
+    {
+        if (sqes != nullptr)
+            munmap(sqes, sqes_size);
+        if (cq_ring != nullptr)
+            munmap(cq_ring, cq_size);
+        if (sq_ring != nullptr)
+            munmap(sq_ring, sq_size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool Init(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0)
+            return false;
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+        void* sq = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void* cq = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* sqe = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        sq_ring = (sq == MAP_FAILED)? nullptr: static_cast<uint8_t*>(sq);
+        cq_ring = (cq == MAP_FAILED)? nullptr: static_cast<uint8_t*>(cq);
+        sqes = (sqe == MAP_FAILED)? nullptr: static_cast<io_uring_sqe*>(sqe);
+        if (!sq_ring || !cq_ring || !sqes)
+            return false;
+
+        sq_head = reinterpret_cast<uint32_t*>(sq_ring + params.sq_off.head);
+        sq_tail = reinterpret_cast<uint32_t*>(sq_ring + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<uint32_t*>(sq_ring + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<uint32_t*>(sq_ring + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        cq_head = reinterpret_cast<uint32_t*>(cq_ring + params.cq_off.head);
+        cq_tail = reinterpret_cast<uint32_t*>(cq_ring + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<uint32_t*>(cq_ring + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq_ring + params.cq_off.cqes);
+        return true;
+    }
+
+    // Queues and submits one write
+    bool Write(int file, const void* data, size_t len, uint64_t offset, uint64_t tag)
+    {
+        uint32_t tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+            return false;
+
+        uint32_t index = tail & sq_mask;
+        io_uring_sqe& sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = file;
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = len;
+        sqe.off = offset;
+        sqe.user_data = tag;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        return syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) == 1;
+    }
+
+    bool Ready() const
+    {
+        return *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    // false when nothing completed (and wait was not set)
+    bool Reap(uint64_t& tag, long& result, bool wait)
+    {
+        while (!Ready())
+        {
+            if (!wait)
+                return false;
+            if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+                return false;
+        }
+
+        uint32_t head = *cq_head;
+        const io_uring_cqe& cqe = cqes[head & cq_mask];
+        tag = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    int fd;
+    uint8_t* sq_ring;
+    uint8_t* cq_ring;
+    io_uring_sqe* sqes;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    uint32_t sq_entries;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    io_uring_cqe* cqes;
+};
+#else
+class Uring
+{
+public:
+    bool Init(unsigned) {return false;}
+    bool Write(int, const void*, size_t, uint64_t, uint64_t) {return false;}
+    bool Ready() const {return false;}
+    bool Reap(uint64_t&, long&, bool) {return false;}
+};
+#endif
+
+
+Recorder::Recorder(const Config& config)
+: config(config)
+, buffer_bytes(RoundUp(max<size_t>(config.buffer_bytes, 512 << 10), ALIGN))
+, file_bytes(config.file_bytes? max<uint64_t>(config.file_bytes / buffer_bytes, 1) * buffer_bytes: 0)
+, memory(max<size_t>(config.buffers, 2) * buffer_bytes)
+, full(max<size_t>(config.buffers, 2))
+, empty(max<size_t>(config.buffers, 2))
+, fill(-1)
+, spare(-1)
+, stream_offset(0)
+, stream_samples(0)
+, next_index(0)
+, index(4096)
+, index_file(nullptr)
+, done_count(0)
+, in_flight(0)
+, stopping(false)
+, running(false)
+, backend("none")
+, frames(0)
+, wire_bytes(0)
+, bytes(0)
+, dropped(0)
+, writes(0)
+, errors(0)
+, backlog(0)
+, backlog_max(0)
+, latency_min(INT64_MAX)
+, latency_max(0)
+, latency_sum(0)
+, file_count(0)
+, index_lost(0)
+{
+    for (size_t idx = 0; idx < max<size_t>(config.buffers, 2); ++idx)
+    {
+        slots.push_back(Slot{memory.get() + idx * buffer_bytes, 0, 0, clock::time_point()});
+        empty.TryPush(idx);
+    }
+    if (config.compress)
+        encoded.resize(BlockCodec::MaxEncodedSize(0x10000) + 4);
+}
+
+Recorder::~Recorder()
+{
+    Stop();
+}
+
+bool Recorder::Start()
+{
+#ifdef __linux__
+    if (running)
+        return true;
+
+    if (config.uring)
+    {
+        uring.reset(new Uring());
+        if (!uring->Init(max(config.queue_depth, 1u)))
+        {
+            printf("io_uring not available (%s), recording with pwrite()\r\n", strerror(errno));
+            uring.reset();
+        }
+    }
+    backend = uring? "io_uring": "pwrite";
+    if (!uring)
+        pool.reset(new WorkPool(max(config.io_threads, 1u), config.writer.Offset(1, "-io")));
+
+    if (!OpenFile())
+        return false;
+
+    if (config.index_interval != 0)
+    {
+        string path = config.path + ".idx";
+        index_file = fopen(path.c_str(), "wb");
+        if (index_file == nullptr)
+        {
+            printf("Failed to create %s (%s)\r\n", path.c_str(), strerror(errno));
+            return false;
+        }
+        CaptureIndexHeader header = {"SDRIDX1", file_bytes, config.compress? uint32_t(INDEX_COMPRESSED): 0u,
+                                     config.index_interval, 0};
+        fwrite(&header, sizeof(header), 1, index_file);
+    }
+
+    stopping = false;
+    running = true;
+    writer = thread([this] {Run();});
+    return true;
+#else
+    printf("Recording needs Linux\r\n");
+    return false;
+#endif
+}
+
+void Recorder::Stop()
+{
+    if (!running)
+        return;
+
+    // the producer is done: hand over what it left behind
+    if (fill >= 0 && slots[fill].used > 0)
+        Queue(fill);
+
+    stopping.store(true, memory_order_release);
+    wake.Notify();
+    writer.join();
+    running = false;
+
+    pool.reset();
+    uring.reset();
+    for (auto& file: files)
+        CloseFile(file);
+    files.clear();
+
+    if (index_file != nullptr)
+    {
+        WriteIndex();
+        fclose(index_file);
+        index_file = nullptr;
+    }
+}
+
+IPacketStream::Callback_t Recorder::Callback(IPacketStream::Callback_t next)
+{
+    return [this, next](uint8_t msgId, const PacketRef& body)
+    {
+        Record(body);
+        if (next)
+            next(msgId, body);
+    };
+}
+
+// Makes sure slot refers to a buffer to fill
+bool Recorder::Reserve(int64_t& slot)
+{
+    if (slot >= 0)
+        return true;
+
+    uint32_t index;
+    if (!empty.TryPop(index))
+        return false;
+    slots[index].used = 0;
+    slot = index;
+    return true;
+}
+
+void Recorder::Queue(int64_t& slot)
+{
+    size_t depth = backlog.fetch_add(1, memory_order_relaxed) + 1;
+    Metrics::Set(Metrics::RECORDER_BACKLOG, depth);
+    size_t seen = backlog_max.load(memory_order_relaxed);
+    while (depth > seen && !backlog_max.compare_exchange_weak(seen, depth, memory_order_relaxed))
+        ;
+
+    full.TryPush(slot);     // never full: it holds at most every slot
+    slot = -1;
+    wake.Notify();
+}
+
+void Recorder::Record(const PacketRef& body)
+{
+    size_t size = body.size() * sizeof(uint32_t);
+    uint64_t offset = stream_offset;
+    bool ok;
+
+    if (body.IsMessage())
+    {
+        // F2CPU header already in body[0]
+        ok = Append(nullptr, 0, body.data(), size);
+    }
+    else if (config.compress)
+    {
+        // header, encoded size, block padded to whole words
+        size_t bytes = BlockCodec::EncodeBlock(body.data(), body.size(), encoded.data());
+        size_t padded = (bytes + 3) & ~size_t(3);
+        memset(encoded.data() + bytes, 0, padded - bytes);
+        uint32_t head[2] = {F2FIFO(static_cast<uint16_t>(body.size())), static_cast<uint32_t>(bytes)};
+        ok = Append(head, sizeof(head), encoded.data(), padded);
+        size += sizeof(uint32_t);
+    }
+    else
+    {
+        uint32_t header = F2FIFO(static_cast<uint16_t>(body.size()));
+        ok = Append(&header, sizeof(header), body.data(), size);
+        size += sizeof(header);
+    }
+
+    if (!ok)
+        return;
+
+    frames.fetch_add(1, memory_order_relaxed);
+    wire_bytes.fetch_add(size, memory_order_relaxed);
+
+    if (config.index_interval == 0)
+        return;
+    if (body.IsMessage())
+    {
+        Index(body[0], offset);
+    }
+    else
+    {
+        if (stream_samples >= next_index)
+        {
+            Index(F2FIFO(static_cast<uint16_t>(body.size())), offset);
+            next_index = stream_samples + config.index_interval;
+        }
+        stream_samples += body.size();
+    }
+}
+
+void Recorder::Index(uint32_t header, uint64_t offset)
+{
+    int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    if (!index.TryPush(CaptureIndexEntry{stream_samples, offset, now, header, 0}))
+        index_lost.fetch_add(1, memory_order_relaxed);
+}
+
+// Writer thread
+void Recorder::WriteIndex()
+{
+    CaptureIndexEntry entry;
+    while (index.TryPop(entry))
+        fwrite(&entry, sizeof(entry), 1, index_file);
+}
+
+bool Recorder::Write(const void* data, size_t bytes)
+{
+    return Append(nullptr, 0, data, bytes);
+}
+
+bool Recorder::Room(size_t bytes)
+{
+    // a packet (at most 256 KiB) spans two buffers at most
+    if (Reserve(fill) && (bytes <= buffer_bytes - slots[fill].used || Reserve(spare)))
+        return true;
+
+    dropped.fetch_add(1, memory_order_relaxed);
+    Metrics::Add(Metrics::DROPS, 0);
+    return false;
+}
+
+bool Recorder::Append(const void* head, size_t head_bytes, const void* data, size_t data_bytes)
+{
+    size_t total = head_bytes + data_bytes;
+
+    if (!Room(total))
+        return false;
+
+    stream_offset += total;
+
+    const uint8_t* parts[2] = {static_cast<const uint8_t*>(head), static_cast<const uint8_t*>(data)};
+    size_t lengths[2] = {head_bytes, data_bytes};
+
+    for (size_t part = 0; part < 2; ++part)
+    {
+        const uint8_t* src = parts[part];
+        size_t len = lengths[part];
+        while (len > 0)
+        {
+            Slot& slot = slots[fill];
+            size_t chunk = min(len, buffer_bytes - slot.used);
+            memcpy(slot.data + slot.used, src, chunk);
+            slot.used += chunk;
+            src += chunk;
+            len -= chunk;
+
+            if (slot.used == buffer_bytes)
+            {
+                Queue(fill);
+                swap(fill, spare);
+            }
+        }
+    }
+    return true;
+}
+
+bool Recorder::OpenFile()
+{
+#ifdef __linux__
+    string path = config.path;
+    if (file_bytes != 0)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), ".%04zu", files.size());
+        path += name;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open(path.c_str(), flags | (config.direct? O_DIRECT: 0), 0644);
+    if (fd < 0 && config.direct && errno == EINVAL)
+    {
+        printf("%s does not support O_DIRECT, writing through the page cache\r\n", path.c_str());
+        fd = open(path.c_str(), flags, 0644);
+    }
+    if (fd < 0)
+    {
+        printf("Failed to create %s (%s)\r\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // reserve the extents now so the file system does not allocate mid-stream
+    if (file_bytes != 0 && fallocate(fd, 0, 0, file_bytes) != 0)
+        printf("Failed to preallocate %s (%s)\r\n", path.c_str(), strerror(errno));
+
+    files.push_back(File{fd, 0, 0, false});
+    file_count.store(files.size(), memory_order_relaxed);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Recorder::CloseFile(File& file)
+{
+#ifdef __linux__
+    if (file.fd < 0)
+        return;
+    // drop the preallocated tail and the padding of the last write
+    if (ftruncate(file.fd, file.size) != 0)
+        printf("Failed to trim a capture file (%s)\r\n", strerror(errno));
+    close(file.fd);
+    file.fd = -1;
+#else
+    (void)file;
+#endif
+}
+
+void Recorder::Run()
+{
+    ApplyThreadPolicy(config.writer);
+
+    uint32_t index;
+    while (true)
+    {
+        bool busy = false;
+
+        while (in_flight < max(config.queue_depth, 1u) && full.TryPop(index))
+        {
+            Submit(index);
+            busy = true;
+        }
+        if (Reap(false) > 0)
+            busy = true;
+        if (index_file != nullptr)
+            WriteIndex();
+        if (busy)
+            continue;
+
+        bool can_submit = in_flight < max(config.queue_depth, 1u);
+        if (stopping.load(memory_order_acquire))
+        {
+            if (in_flight == 0 && full.Empty())
+                break;
+            Reap(true);
+            continue;
+        }
+        if (uring && in_flight > 0)
+        {
+            // a write takes far less than filling the next buffer
+            Reap(true);
+            continue;
+        }
+
+        // idle: make the index readable up to here
+        if (index_file != nullptr)
+            fflush(index_file);
+        wake.Wait([this, can_submit]
+        {
+            return (can_submit && !full.Empty()) || done_count.load(memory_order_acquire) > 0 ||
+                   stopping.load(memory_order_acquire);
+        });
+    }
+}
+
+void Recorder::Submit(uint32_t index)
+{
+    Slot& slot = slots[index];
+
+    if (files.back().full && !OpenFile())
+    {
+        // no file to write to: the data is lost, the buffer is not
+        Complete(index, -1);
+        return;
+    }
+
+    size_t current = files.size() - 1;
+    File& file = files[current];
+    uint64_t offset = file.size;
+    file.size += slot.used;
+    file.pending++;
+    if (file_bytes != 0 && file.size + buffer_bytes > file_bytes)
+        file.full = true;
+
+    // O_DIRECT needs whole blocks; the last buffer is padded, CloseFile() trims it
+    size_t len = RoundUp(slot.used, ALIGN);
+    memset(slot.data + slot.used, 0, len - slot.used);
+
+    slot.file = current;
+    slot.submitted = clock::now();
+    in_flight++;
+
+    if (uring)
+    {
+        if (!uring->Write(file.fd, slot.data, len, offset, index))
+        {
+            in_flight--;
+            Complete(index, -1);
+        }
+        return;
+    }
+
+    int fd = file.fd;
+    pool->Submit([this, index, fd, len, offset]
+    {
+#ifdef __linux__
+        long result = pwrite(fd, slots[index].data, len, offset);
+#else
+        long result = -1;
+#endif
+        {
+            lock_guard<mutex> guard(done_lock);
+            done.push_back(Done{index, result});
+        }
+        done_count.fetch_add(1, memory_order_release);
+        wake.Notify();
+    });
+}
+
+size_t Recorder::Reap(bool wait)
+{
+    size_t reaped = 0;
+
+    if (uring)
+    {
+        uint64_t tag;
+        long result;
+        while (uring->Reap(tag, result, wait && reaped == 0))
+        {
+            in_flight--;
+            Complete(tag, result);
+            ++reaped;
+        }
+        return reaped;
+    }
+
+    if (done_count.load(memory_order_acquire) == 0)
+    {
+        if (!wait)
+            return 0;
+        wake.Wait([this] {return done_count.load(memory_order_acquire) > 0;});
+    }
+
+    vector<Done> batch;
+    {
+        lock_guard<mutex> guard(done_lock);
+        batch.swap(done);
+        done_count.fetch_sub(batch.size(), memory_order_relaxed);
+    }
+    for (auto& item: batch)
+    {
+        in_flight--;
+        Complete(item.slot, item.result);
+    }
+    return batch.size();
+}
+
+// Writer thread: accounts for a finished write and recycles its buffer
+void Recorder::Complete(uint32_t index, long result)
+{
+    Slot& slot = slots[index];
+
+    if (result < static_cast<long>(slot.used))
+    {
+        if (errors.fetch_add(1, memory_order_relaxed) == 0)
+            printf("Capture write failed (%s)\r\n", result < 0? strerror(-result): "short write");
+    }
+    else
+    {
+        bytes.fetch_add(slot.used, memory_order_relaxed);
+    }
+
+    if (slot.submitted != clock::time_point())
+    {
+        int64_t us = chrono::duration_cast<chrono::microseconds>(clock::now() - slot.submitted).count();
+        latency_sum.fetch_add(us, memory_order_relaxed);
+        if (us < latency_min.load(memory_order_relaxed))
+            latency_min.store(us, memory_order_relaxed);
+        if (us > latency_max.load(memory_order_relaxed))
+            latency_max.store(us, memory_order_relaxed);
+        writes.fetch_add(1, memory_order_relaxed);
+
+        File& file = files[slot.file];
+        if (--file.pending == 0 && file.full)
+            CloseFile(file);
+    }
+
+    slot.used = 0;
+    slot.submitted = clock::time_point();
+    size_t depth = backlog.fetch_sub(1, memory_order_relaxed) - 1;
+    Metrics::Set(Metrics::RECORDER_BACKLOG, depth);
+    empty.TryPush(index);
+}
+
+Recorder::Stats Recorder::GetStats() const
+{
+    Stats stats;
+    stats.frames = frames.load(memory_order_relaxed);
+    stats.wire_bytes = wire_bytes.load(memory_order_relaxed);
+    stats.bytes = bytes.load(memory_order_relaxed);
+    stats.dropped = dropped.load(memory_order_relaxed);
+    stats.writes = writes.load(memory_order_relaxed);
+    stats.errors = errors.load(memory_order_relaxed);
+    stats.files = file_count.load(memory_order_relaxed);
+    stats.backlog = backlog.load(memory_order_relaxed);
+    stats.backlog_max = backlog_max.load(memory_order_relaxed);
+
+    int64_t min_us = latency_min.load(memory_order_relaxed);
+    stats.latency_min = chrono::microseconds(stats.writes? min_us: 0);
+    stats.latency_mean = chrono::microseconds(stats.writes? latency_sum.load(memory_order_relaxed) / static_cast<int64_t>(stats.writes): 0);
+    stats.latency_max = chrono::microseconds(latency_max.load(memory_order_relaxed));
+    stats.index_lost = index_lost.load(memory_order_relaxed);
+    stats.backend = backend;
+    return stats;
+}
@@ -0,0 +1,195 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include "hugemem.h"
+#include "rtthread.h"
+#include "spsc.h"
+#include "streamer.h"
+#include "waitstrategy.h"
+
+class WorkPool;
+class Uring;
+
+// path.idx: this header, then one entry per seek point and per message in
+// stream order, so both sample and offset are sorted
+struct CaptureIndexHeader
+{
+    char magic[8];                  // "SDRIDX1"
+    uint64_t file_bytes;            // rotation size, 0 for a single file
+    uint32_t flags;                 // INDEX_COMPRESSED
+    uint32_t interval;              // samples between seek points
+    uint64_t reserved;
+};
+
+struct CaptureIndexEntry
+{
+    uint64_t sample;                // stream samples recorded before this packet
+    uint64_t offset;                // packet start in bytes, counted across rotated files
+    int64_t time_ns;                // arrival, system clock since the epoch
+    uint32_t header;                // F2FIFO at a seek point, F2CPU at a message
+    uint32_t reserved;
+};
+
+enum {INDEX_COMPRESSED = 1};
+
+// Capture-to-disk stage for received packets. The RX thread copies packets
+// (header included, so a capture parses like the wire) into large aligned
+// buffers; a writer thread writes full buffers with io_uring, or with
+// O_DIRECT pwrite() on a small thread pool when io_uring is not available.
+// Files are preallocated and rotated at a fixed size; concatenated in order
+// they form one continuous stream.
+//   Recorder rec(config);
+//   rec.Start();
+//   IPacketStream in(handle, rec.Callback(next));
+class Recorder
+{
+public:
+    struct Config
+    {
+        string path = "capture";            // files are path.0000, path.0001, ...
+        size_t buffer_bytes = 4 << 20;      // write size, rounded to 4 KiB, at least 512 KiB
+        size_t buffers = 32;                // RX runs this far ahead of the disk before dropping
+        uint64_t file_bytes = 4ull << 30;   // rotation size, rounded to whole buffers;
+                                            // 0: one file named path, not preallocated
+        unsigned queue_depth = 8;           // writes in flight
+        unsigned io_threads = 4;            // pwrite() fallback threads
+        bool direct = true;                 // O_DIRECT, bypasses the page cache
+        bool uring = true;                  // false forces the pwrite() fallback
+        bool compress = false;              // stream payloads as BlockCodec blocks, see CompressedReader
+        uint32_t index_interval = 1 << 20;  // samples between seek points in path.idx, 0: no index
+        ThreadPolicy writer = ThreadPolicy("sdr-rec");
+    };
+
+    struct Stats
+    {
+        uint64_t frames;
+        uint64_t wire_bytes;                // recorded packets as received
+        uint64_t bytes;                     // written to disk
+        uint64_t dropped;                   // frames lost because all buffers were busy
+        uint64_t writes;
+        uint64_t errors;
+        unsigned files;
+        size_t backlog;                     // buffers queued or being written
+        size_t backlog_max;
+        chrono::microseconds latency_min;   // per buffer write
+        chrono::microseconds latency_mean;
+        chrono::microseconds latency_max;
+        uint64_t index_lost;                // index entries the writer could not keep up with
+        const char* backend;
+    };
+
+    explicit Recorder(const Config& config);
+    // Stops if still running
+    ~Recorder();
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    // Opens the first file and starts the writer
+    bool Start();
+    // Writes out the partial buffer, waits for the disk and trims the last
+    // file. Call after the producer has stopped.
+    void Stop();
+
+    // RX thread; never blocks, drops the frame when no buffer is free
+    void Record(const PacketRef& body);
+    // Records, then passes the packet on to next (if any)
+    IPacketStream::Callback_t Callback(IPacketStream::Callback_t next = nullptr);
+    // RX thread, for formats other than the wire: appends the bytes as they
+    // are, all or nothing, at most 256 KiB per call
+    bool Write(const void* data, size_t bytes);
+    // RX thread: takes the buffers a Write() of bytes needs, so that write
+    // cannot fail; false, counted as a drop, when none are free. Lets a
+    // caller writing to two recorders drop a record in both or neither.
+    bool Room(size_t bytes);
+
+    Stats GetStats() const;
+
+private:
+    typedef chrono::steady_clock clock;
+
+    struct Slot
+    {
+        uint8_t* data;
+        size_t used;
+        size_t file;                        // index into files
+        clock::time_point submitted;
+    };
+
+    struct File
+    {
+        int fd;
+        uint64_t size;                      // bytes of stream data
+        size_t pending;                     // writes in flight
+        bool full;
+    };
+
+    struct Done
+    {
+        uint32_t slot;
+        long result;
+    };
+
+    const Config config;
+    const size_t buffer_bytes;
+    const uint64_t file_bytes;
+    HugeBuffer<uint8_t> memory;
+    vector<Slot> slots;
+    SpscQueue<uint32_t> full;               // RX thread -> writer
+    SpscQueue<uint32_t> empty;              // writer -> RX thread
+
+    // RX thread
+    vector<uint8_t> encoded;
+    int64_t fill;                           // slot being filled, -1 if none
+    int64_t spare;
+    uint64_t stream_offset;                 // bytes appended
+    uint64_t stream_samples;
+    uint64_t next_index;
+    SpscQueue<CaptureIndexEntry> index;     // RX thread -> writer
+
+    // writer thread
+    vector<File> files;
+    FILE* index_file;
+    unique_ptr<Uring> uring;
+    unique_ptr<WorkPool> pool;
+    mutex done_lock;                        // pwrite() completions
+    vector<Done> done;
+    atomic<size_t> done_count;
+    size_t in_flight;
+    thread writer;
+    WaitPoint wake;
+    atomic<bool> stopping;
+    bool running;
+    const char* backend;
+
+    atomic<uint64_t> frames;
+    atomic<uint64_t> wire_bytes;
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> dropped;
+    atomic<uint64_t> writes;
+    atomic<uint64_t> errors;
+    atomic<size_t> backlog;
+    atomic<size_t> backlog_max;
+    atomic<int64_t> latency_min;
+    atomic<int64_t> latency_max;
+    atomic<int64_t> latency_sum;
+    atomic<unsigned> file_count;
+    atomic<uint64_t> index_lost;
+
+    bool Reserve(int64_t& slot);
+    bool Append(const void* head, size_t head_bytes, const void* data, size_t data_bytes);
+    void Queue(int64_t& slot);
+    bool OpenFile();
+    void CloseFile(File& file);
+    void Run();
+    void Index(uint32_t header, uint64_t offset);
+    void WriteIndex();
+    void Submit(uint32_t index);
+    size_t Reap(bool wait);
+    void Complete(uint32_t index, long result);
+};
+
+#endif // RECORDER_H
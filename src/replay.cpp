@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+#include "mapfile.h"
+#include "replay.h"
+
+using namespace std;
+
+
+ReplaySource::ReplaySource(const Config& config)
+: config(config)
+, data(nullptr)
+, mapped(0)
+, size(0)
+, done(false)
+, packet(0)
+, payload_begin(0)
+, payload_end(0)
+, bytes(0)
+, samples(0)
+, loops(0)
+, lag_max(0)
+{
+}
+
+ReplaySource::~ReplaySource()
+{
+    Stop();
+    Close();
+}
+
+bool ReplaySource::Open()
+{
+#ifdef __linux__
+    Close();
+
+    data = static_cast<const uint8_t*>(MapFile(config.path, mapped));
+    if (data == nullptr)
+        return false;
+    size = mapped;
+    if (size == 0)
+    {
+        printf("%s is empty\r\n", config.path.c_str());
+        Close();
+        return false;
+    }
+
+    // a packet cut off at the end would swallow the start of the next loop
+    if (config.loops != 1)
+    {
+        size_t whole = WholePackets();
+        if (whole != size)
+            printf("%s: %zu trailing bytes skipped when looping\r\n", config.path.c_str(), size - whole);
+        size = whole;
+    }
+    return size > 0;
+#else
+    printf("Replay needs mmap, not available on this platform: %s\r\n", config.path.c_str());
+    return false;
+#endif
+}
+
+void ReplaySource::Close()
+{
+#ifdef __linux__
+    UnmapFile(data, mapped);
+#endif
+    data = nullptr;
+    mapped = 0;
+    size = 0;
+}
+
+size_t ReplaySource::WholePackets() const
+{
+    size_t pos = 0;
+    while (pos + sizeof(uint32_t) <= size)
+    {
+        uint32_t word;
+        memcpy(&word, data + pos, sizeof(word));
+        size_t words = SDR_HEADER::IsCmd(word)? F2CPU(word).num(): F2FIFO(word).num();
+        if (pos + (1 + words) * sizeof(uint32_t) > size)
+            break;
+        pos += (1 + words) * sizeof(uint32_t);
+    }
+    return pos;
+}
+
+// Stream payload words in [begin, end); chunks must come in order
+uint64_t ReplaySource::CountSamples(size_t begin, size_t end)
+{
+    uint64_t count = 0;
+    size_t pos = begin;
+
+    while (pos < end)
+    {
+        if (pos >= payload_end && pos >= packet)
+        {
+            // at a header
+            if (packet + sizeof(uint32_t) > size)
+                break;
+            uint32_t word;
+            memcpy(&word, data + packet, sizeof(word));
+            bool message = SDR_HEADER::IsCmd(word);
+            size_t words = message? F2CPU(word).num(): F2FIFO(word).num();
+            payload_begin = packet + sizeof(uint32_t);
+            payload_end = message? payload_begin: payload_begin + words * sizeof(uint32_t);
+            packet = payload_begin + words * sizeof(uint32_t);
+        }
+
+        size_t stop = min(end, packet);
+        if (stop > payload_begin && pos < payload_end)
+            count += (min(stop, payload_end) - max(pos, payload_begin)) / sizeof(uint32_t);
+        pos = stop;
+    }
+    return count;
+}
+
+bool ReplaySource::Run(IPacketStream& parser)
+{
+    if (data == nullptr)
+        return false;
+
+    const bool by_bytes = config.bytes_per_second > 0;
+    const double rate = by_bytes? config.bytes_per_second: config.sample_rate * config.speed;
+    const bool paced = rate > 0;
+    const size_t chunk = max<size_t>(config.chunk_bytes, sizeof(uint32_t));
+    // GCRA form of the token bucket: a chunk is due one cost after the
+    // previous one, and a late sender may run ahead by at most the burst
+    const auto burst = chrono::duration_cast<clock::duration>(
+        chrono::duration<double>(config.burst * chunk / (by_bytes? 1.0: sizeof(uint32_t)) / max(rate, 1.0)));
+
+    started = clock::now();
+    clock::time_point due = started;
+    done = false;
+    bytes = 0;
+    samples = 0;
+    loops = 0;
+    lag_max = 0;
+
+    while (!stop && (config.loops == 0 || loops < config.loops))
+    {
+        packet = 0;
+        payload_begin = 0;
+        payload_end = 0;
+
+        for (size_t pos = 0; pos < size && !stop; pos += chunk)
+        {
+            size_t len = min(chunk, size - pos);
+            uint64_t count = CountSamples(pos, pos + len);
+
+            if (paced)
+            {
+                clock::time_point now = clock::now();
+                if (due < now - burst)
+                {
+                    int64_t lag = chrono::duration_cast<chrono::microseconds>(now - burst - due).count();
+                    if (lag > lag_max.load(memory_order_relaxed))
+                        lag_max.store(lag, memory_order_relaxed);
+                    due = now - burst;
+                }
+                if (due > now && !stop.SleepUntil(due))
+                    break;
+                double cost = by_bytes? len: count;
+                due += chrono::duration_cast<clock::duration>(chrono::duration<double>(cost / rate));
+            }
+
+            parser.Feed(data + pos, len);
+            bytes.fetch_add(len, memory_order_relaxed);
+            samples.fetch_add(count, memory_order_relaxed);
+        }
+        if (!stop)
+            loops.fetch_add(1, memory_order_relaxed);
+    }
+
+    done.store(true, memory_order_release);
+    finished.Notify();
+    return true;
+}
+
+bool ReplaySource::Start(IPacketStream& parser)
+{
+    if (data == nullptr || runner.joinable())
+        return false;
+
+    // re-armed for a restart; Wait() must not see the last run's end
+    stop.Reset();
+    done = false;
+    runner = thread([this, &parser]
+    {
+        ApplyThreadPolicy(config.policy);
+        Run(parser);
+    });
+    return true;
+}
+
+void ReplaySource::Stop()
+{
+    stop.Request();
+    if (runner.joinable())
+        runner.join();
+}
+
+void ReplaySource::Wait()
+{
+    finished.Wait([this] {return Done();});
+    if (runner.joinable())
+        runner.join();
+}
+
+ReplaySource::Stats ReplaySource::GetStats() const
+{
+    Stats stats;
+    stats.bytes = bytes.load(memory_order_relaxed);
+    stats.samples = samples.load(memory_order_relaxed);
+    stats.loops = loops.load(memory_order_relaxed);
+    double seconds = chrono::duration<double>(clock::now() - started).count();
+    stats.rate = (seconds > 0)? stats.bytes / seconds: 0;
+    stats.lag_max = chrono::microseconds(lag_max.load(memory_order_relaxed));
+    return stats;
+}
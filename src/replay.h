@@ -0,0 +1,89 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <string>
+#include "rtthread.h"
+#include "streamer.h"
+#include "waitstrategy.h"
+
+// Plays a raw wire capture (Recorder output without compress, or any file
+// DataReaderThreadFile accepts) into an IPacketStream as if it came from the
+// board: the mapped file is pushed through Feed() in USB-sized chunks, paced
+// by a token bucket in bytes or in stream samples per second.
+//   IPacketStream parser(nullptr, callback, IPacketStream::SOURCE::EXTERNAL);
+//   ReplaySource source(config);
+//   source.Open() && source.Start(parser);
+class ReplaySource
+{
+public:
+    struct Config
+    {
+        string path;
+        double bytes_per_second = 0;        // pace on bytes when set
+        double sample_rate = 0;             // else pace on stream samples at sample_rate * speed
+        double speed = 1.0;
+        size_t chunk_bytes = 32 * 1024;     // per Feed(), the USB reader's transfer size
+        double burst = 4;                   // bucket depth in chunks: how far a late sender may catch up
+        uint64_t loops = 1;                 // 0: until Stop()
+        ThreadPolicy policy = ThreadPolicy("sdr-replay");
+    };
+
+    struct Stats
+    {
+        uint64_t bytes;
+        uint64_t samples;
+        uint64_t loops;
+        double rate;                        // bytes/s since Start()
+        chrono::microseconds lag_max;       // worst delay behind the schedule
+    };
+
+    explicit ReplaySource(const Config& config);
+    ~ReplaySource();
+
+    ReplaySource(const ReplaySource&) = delete;
+    ReplaySource& operator=(const ReplaySource&) = delete;
+
+    bool Open();
+    void Close();
+
+    // Replays on the calling thread; false if the file is not open
+    bool Run(IPacketStream& parser);
+    // Replays on a thread with config.policy; may be called again after
+    // Stop() or Wait(), the statistics start over
+    bool Start(IPacketStream& parser);
+    void Stop();
+    // Waits for the last loop to finish
+    void Wait();
+    bool Done() const {return done.load(memory_order_acquire);}
+
+    Stats GetStats() const;
+
+private:
+    typedef chrono::steady_clock clock;
+
+    const Config config;
+    const uint8_t* data;
+    size_t mapped;                  // length of the mapping
+    size_t size;                    // whole packets only when looping
+
+    StopFlag stop;
+    thread runner;
+    atomic<bool> done;
+    WaitPoint finished;
+
+    // sample counting over chunk boundaries
+    size_t packet;                  // offset of the next header
+    size_t payload_begin;
+    size_t payload_end;
+
+    clock::time_point started;
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> samples;
+    atomic<uint64_t> loops;
+    atomic<int64_t> lag_max;
+
+    size_t WholePackets() const;
+    uint64_t CountSamples(size_t begin, size_t end);
+};
+
+#endif // REPLAY_H
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include "rpc.h"
+
+using namespace std;
+
+
+RpcClient::RpcClient(OPacketStream& tx)
+: RpcClient(tx, Config())
+{
+}
+
+RpcClient::RpcClient(OPacketStream& tx, const Config& config)
+: tx(tx)
+, config(config)
+, in_flight(0)
+, calls(0)
+, replies(0)
+, timeouts(0)
+, late(0)
+, failed(0)
+, latency_min(clock::duration::max())
+, latency_max(0)
+, latency_sum(0)
+{
+    expiry_thread = thread([this]
+    {
+        ApplyThreadPolicy(ThreadPolicy("sdr-rpc"));
+        // timeouts are checked at a tenth of their length
+        auto tick = max<clock::duration>(this->config.timeout / 10, chrono::microseconds(100));
+        while (stop.SleepFor(tick))
+            Expire();
+    });
+}
+
+RpcClient::~RpcClient()
+{
+    stop.Request();
+    if (expiry_thread.joinable())
+        expiry_thread.join();
+
+    lock_guard<mutex> guard(lock);
+    for (auto& queue: pending)
+    {
+        for (auto& call: queue)
+        {
+            if (!call.expired)
+                call.result.set_value(Reply());
+        }
+        queue.clear();
+    }
+}
+
+future<RpcClient::Reply> RpcClient::Call(uint8_t msgId, const uint32_t* data, size_t count)
+{
+    lock_guard<mutex> send_guard(tx_lock);
+
+    slot_free.Wait([this] {return in_flight.load(memory_order_acquire) < config.max_in_flight;});
+    in_flight.fetch_add(1, memory_order_relaxed);
+
+    future<Reply> result;
+    uint64_t seq;
+    {
+        lock_guard<mutex> guard(lock);
+        auto& queue = pending[msgId & 7];
+        auto now = clock::now();
+        seq = ++calls;
+        queue.push_back(Pending{promise<Reply>(), seq, now, now + config.timeout, false});
+        result = queue.back().result.get_future();
+    }
+
+    // queued first: the reply can arrive before SendMessage returns
+    if (!tx.SendMessage(msgId, data, count))
+    {
+        lock_guard<mutex> guard(lock);
+        auto& queue = pending[msgId & 7];
+        // the send lock keeps others from queueing behind it
+        if (!queue.empty() && queue.back().seq == seq && !queue.back().expired)
+        {
+            queue.back().result.set_value(Reply());
+            queue.pop_back();
+            in_flight.fetch_sub(1, memory_order_release);
+            slot_free.Notify();
+        }
+        ++failed;
+    }
+
+    return result;
+}
+
+future<RpcClient::Reply> RpcClient::Call(uint8_t msgId, const list<uint32_t>& data)
+{
+    vector<uint32_t> words(data.begin(), data.end());
+    return Call(msgId, words.data(), words.size());
+}
+
+bool RpcClient::Claim(uint8_t msgId, const PacketRef& body)
+{
+    lock_guard<mutex> guard(lock);
+    auto& queue = pending[msgId & 7];
+    if (queue.empty())
+        return false;
+
+    Pending& call = queue.front();
+    if (call.expired)
+    {
+        // the answer to a call that already timed out
+        ++late;
+        queue.pop_front();
+        return true;
+    }
+
+    auto latency = clock::now() - call.sent;
+    latency_min = min(latency_min, latency);
+    latency_max = max(latency_max, latency);
+    latency_sum += latency;
+    ++replies;
+
+    call.result.set_value(Reply{body, chrono::duration_cast<chrono::microseconds>(latency)});
+    queue.pop_front();
+    in_flight.fetch_sub(1, memory_order_release);
+    slot_free.Notify();
+    return true;
+}
+
+IPacketStream::Callback_t RpcClient::Callback(IPacketStream::Callback_t next)
+{
+    return [this, next](uint8_t msgId, const PacketRef& body)
+    {
+        if (body.IsMessage() && Claim(msgId, body))
+            return;
+        if (next)
+            next(msgId, body);
+    };
+}
+
+// Timed-out calls stay queued as tombstones for one more timeout, so a
+// late reply is swallowed instead of answering the next call with that id
+void RpcClient::Expire()
+{
+    lock_guard<mutex> guard(lock);
+    auto now = clock::now();
+    size_t expired = 0;
+
+    for (auto& queue: pending)
+    {
+        for (auto& call: queue)
+        {
+            if (call.deadline > now)
+                break;
+            if (call.expired)
+                continue;
+            call.expired = true;
+            call.result.set_value(Reply());
+            ++expired;
+        }
+        while (!queue.empty() && queue.front().expired &&
+               queue.front().deadline + config.timeout <= now)
+            queue.pop_front();
+    }
+
+    if (expired > 0)
+    {
+        timeouts += expired;
+        in_flight.fetch_sub(expired, memory_order_release);
+        slot_free.Notify();
+    }
+}
+
+RpcClient::Stats RpcClient::GetStats() const
+{
+    lock_guard<mutex> guard(lock);
+    Stats stats;
+
+    stats.calls = calls;
+    stats.replies = replies;
+    stats.timeouts = timeouts;
+    stats.late = late;
+    stats.failed = failed;
+    stats.in_flight = in_flight.load(memory_order_relaxed);
+    stats.min_latency = chrono::duration_cast<chrono::microseconds>(replies? latency_min: clock::duration(0));
+    stats.mean_latency = chrono::duration_cast<chrono::microseconds>(replies? latency_sum / static_cast<int64_t>(replies): clock::duration(0));
+    stats.max_latency = chrono::duration_cast<chrono::microseconds>(latency_max);
+    return stats;
+}
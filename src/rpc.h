@@ -0,0 +1,97 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include <deque>
+#include <future>
+#include <mutex>
+#include "streamer.h"
+#include "waitstrategy.h"
+
+// Request/response calls over F2CPU messages. Replies carry no tag, so they
+// are matched to requests by message id in the order the requests went out;
+// an id used for calls must only ever be sent by the FPGA as a reply.
+// Any number of calls may be in flight, so register sequences are pipelined
+// instead of paying one round trip each.
+class RpcClient
+{
+public:
+    struct Config
+    {
+        std::chrono::milliseconds timeout{100};
+        size_t max_in_flight = 64;      // Call() blocks beyond this
+    };
+
+    struct Reply
+    {
+        PacketRef body;                 // whole message, header in body[0]; empty on timeout
+        std::chrono::microseconds latency{0};
+
+        bool ok() const {return static_cast<bool>(body);}
+    };
+
+    struct Stats
+    {
+        uint64_t calls;
+        uint64_t replies;
+        uint64_t timeouts;
+        uint64_t late;                  // replies that arrived after their call timed out
+        uint64_t failed;                // requests the TX stream refused
+        size_t in_flight;
+        std::chrono::microseconds min_latency;
+        std::chrono::microseconds mean_latency;
+        std::chrono::microseconds max_latency;
+    };
+
+    explicit RpcClient(OPacketStream& tx);
+    RpcClient(OPacketStream& tx, const Config& config);
+    // Outstanding calls complete with an empty reply
+    ~RpcClient();
+
+    // Thread-safe; requests go out in call order
+    std::future<Reply> Call(uint8_t msgId, const uint32_t* data, size_t count);
+    std::future<Reply> Call(uint8_t msgId, const list<uint32_t>& data);
+
+    // Adapter for IPacketStream: claims replies, hands everything else to next
+    IPacketStream::Callback_t Callback(IPacketStream::Callback_t next = nullptr);
+    // true if the message answered a call
+    bool Claim(uint8_t msgId, const PacketRef& body);
+
+    Stats GetStats() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Pending
+    {
+        std::promise<Reply> result;
+        uint64_t seq;
+        clock::time_point sent;
+        clock::time_point deadline;
+        bool expired;
+    };
+
+    OPacketStream& tx;
+    const Config config;
+
+    mutable std::mutex lock;            // pending and stats
+    std::mutex tx_lock;                 // keeps queue order equal to wire order
+    std::deque<Pending> pending[8];
+    std::atomic<size_t> in_flight;      // counts until the reply or the timeout
+    WaitPoint slot_free;
+
+    uint64_t calls;
+    uint64_t replies;
+    uint64_t timeouts;
+    uint64_t late;
+    uint64_t failed;
+    clock::duration latency_min;
+    clock::duration latency_max;
+    clock::duration latency_sum;
+
+    StopFlag stop;
+    thread expiry_thread;
+
+    void Expire();
+};
+
+#endif // RPC_H
@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include "rtthread.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+
+ThreadPolicy ThreadPolicy::Offset(int index, const string& suffix) const
+{
+    ThreadPolicy policy(*this);
+    policy.name = name + suffix;
+    if (core >= 0)
+        policy.core = core + index;
+    return policy;
+}
+
+// Parses kernel cpu lists such as "2-5,8"
+static bool InCpuList(const string& list, int core)
+{
+    stringstream ss(list);
+    string range;
+
+    while (getline(ss, range, ','))
+    {
+        int first, last;
+        int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (fields == 1)
+            last = first;
+        if (fields >= 1 && core >= first && core <= last)
+            return true;
+    }
+    return false;
+}
+
+bool CpuIsolated(int core)
+{
+    for (auto path: {"/sys/devices/system/cpu/isolated", "/sys/devices/system/cpu/nohz_full"})
+    {
+        ifstream file(path);
+        string list;
+        if (getline(file, list) && InCpuList(list, core))
+            return true;
+    }
+    return false;
+}
+
+#ifdef __linux__
+static bool Apply(pthread_t handle, const ThreadPolicy& policy)
+{
+    bool ok = true;
+
+    if (!policy.name.empty())
+        pthread_setname_np(handle, policy.name.substr(0, 15).c_str());
+
+    if (policy.core >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(policy.core, &set);
+        if (pthread_setaffinity_np(handle, sizeof(set), &set) != 0)
+        {
+            printf("%s: failed to pin to core %d\r\n", policy.name.c_str(), policy.core);
+            ok = false;
+        }
+        if (policy.expect_isolated && !CpuIsolated(policy.core))
+            printf("%s: core %d is not isolated, expect scheduler jitter\r\n",
+                   policy.name.c_str(), policy.core);
+    }
+
+    if (policy.priority > 0)
+    {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = policy.priority;
+        int err = pthread_setschedparam(handle, SCHED_FIFO, &param);
+        if (err != 0)
+        {
+            printf("%s: SCHED_FIFO %d refused (%s), needs CAP_SYS_NICE or rtprio limit\r\n",
+                   policy.name.c_str(), policy.priority, strerror(err));
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+#endif
+
+bool ApplyThreadPolicy(const ThreadPolicy& policy)
+{
+#ifdef __linux__
+    return Apply(pthread_self(), policy);
+#else
+    (void)policy;
+    return false;
+#endif
+}
+
+bool ApplyThreadPolicy(thread& thread, const ThreadPolicy& policy)
+{
+#ifdef __linux__
+    return Apply(thread.native_handle(), policy);
+#else
+    (void)thread;
+    (void)policy;
+    return false;
+#endif
+}
+
+string DescribeThread()
+{
+#ifdef __linux__
+    pthread_t self = pthread_self();
+
+    char name[16] = "";
+    pthread_getname_np(self, name, sizeof(name));
+
+    cpu_set_t set;
+    string cpus;
+    if (pthread_getaffinity_np(self, sizeof(set), &set) == 0)
+    {
+        int count = CPU_COUNT(&set);
+        for (int cpu = 0; cpu < CPU_SETSIZE && count > 0; ++cpu)
+        {
+            if (!CPU_ISSET(cpu, &set))
+                continue;
+            cpus += (cpus.empty()? "": ",") + to_string(cpu);
+            --count;
+        }
+    }
+
+    int policy;
+    sched_param param;
+    pthread_getschedparam(self, &policy, &param);
+
+    char text[256];
+    snprintf(text, sizeof(text), "%s: cpu %s (now %d), %s prio %d",
+             name, cpus.c_str(), sched_getcpu(),
+             policy == SCHED_FIFO? "SCHED_FIFO": policy == SCHED_RR? "SCHED_RR": "SCHED_OTHER",
+             param.sched_priority);
+    return text;
+#else
+    return "thread policy not supported";
+#endif
+}
+
+bool LockAllMemory()
+{
+#ifdef __linux__
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+        return true;
+    printf("mlockall failed (%s), check RLIMIT_MEMLOCK\r\n", strerror(errno));
+#endif
+    return false;
+}
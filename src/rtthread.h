@@ -0,0 +1,35 @@
+#ifndef RTTHREAD_H
+#define RTTHREAD_H
+
+#include <string>
+#include <thread>
+
+// Scheduling for the library's I/O and processing threads
+struct ThreadPolicy
+{
+    std::string name;           // thread name, truncated to 15 characters
+    int core = -1;              // pin to this CPU, -1 keeps the inherited mask
+    int priority = 0;           // > 0 selects SCHED_FIFO at this priority
+    bool expect_isolated = false;   // warn when core is not in isolcpus/nohz_full
+
+    ThreadPolicy() {}
+    ThreadPolicy(const std::string& name, int core = -1, int priority = 0)
+    : name(name), core(core), priority(priority) {}
+
+    // Same settings on the core offset places further (for worker groups)
+    ThreadPolicy Offset(int index, const std::string& suffix) const;
+};
+
+// Applies to the calling thread; prints what could not be honoured
+bool ApplyThreadPolicy(const ThreadPolicy& policy);
+bool ApplyThreadPolicy(std::thread& thread, const ThreadPolicy& policy);
+
+// One-line report of the calling thread's actual name, CPU mask and scheduler
+std::string DescribeThread();
+
+bool CpuIsolated(int core);
+
+// mlockall(MCL_CURRENT | MCL_FUTURE) so no page of the process faults later
+bool LockAllMemory();
+
+#endif // RTTHREAD_H
@@ -0,0 +1,739 @@
+#include <algorithm>
+#include <errno.h>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mapfile.h"
+#include "sigmf.h"
+
+using namespace std;
+
+static const char* DATA_EXT = ".sigmf-data";
+static const char* META_EXT = ".sigmf-meta";
+static const char* JOURNAL_EXT = ".sigmf-journal";     // annotations of a recording in progress
+
+static string Now()
+{
+    auto now = chrono::system_clock::now();
+    time_t secs = chrono::system_clock::to_time_t(now);
+    long us = chrono::duration_cast<chrono::microseconds>(now.time_since_epoch()).count() % 1000000;
+    struct tm utc;
+    gmtime_r(&secs, &utc);
+
+    char text[40];
+    size_t len = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(text + len, sizeof(text) - len, ".%06ldZ", us);
+    return text;
+}
+
+static void Quote(ostream& out, const string& text)
+{
+    out << '"';
+    for (unsigned char c: text)
+    {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20)
+        {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out << esc;
+        }
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+static string Number(double value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.17g", value);
+    return text;
+}
+
+
+// Just enough JSON to read SigMF metadata back
+namespace
+{
+struct Json
+{
+    enum class TYPE {NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT};
+
+    TYPE type = TYPE::NUL;
+    double number = 0;
+    string text;
+    vector<Json> items;
+    vector<pair<string, Json>> members;
+
+    const Json* Find(const char* key) const
+    {
+        for (auto& member: members)
+        {
+            if (member.first == key)
+                return &member.second;
+        }
+        return nullptr;
+    }
+    double Number(const char* key, double fallback) const
+    {
+        const Json* value = Find(key);
+        return (value && value->type == TYPE::NUMBER)? value->number: fallback;
+    }
+    string Text(const char* key) const
+    {
+        const Json* value = Find(key);
+        return (value && value->type == TYPE::STRING)? value->text: string();
+    }
+};
+
+class JsonParser
+{
+public:
+    explicit JsonParser(const string& text): pos(text.c_str()), end(text.c_str() + text.size()) {}
+
+    bool Parse(Json& value)
+    {
+        return Value(value) && (Skip(), pos == end);
+    }
+
+private:
+    const char* pos;
+    const char* end;
+
+    void Skip()
+    {
+        while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n'))
+            ++pos;
+    }
+
+    bool Literal(const char* word)
+    {
+        size_t len = strlen(word);
+        if (static_cast<size_t>(end - pos) < len || strncmp(pos, word, len) != 0)
+            return false;
+        pos += len;
+        return true;
+    }
+
+    bool String(string& out)
+    {
+        if (pos == end || *pos != '"')
+            return false;
+        ++pos;
+        while (pos < end && *pos != '"')
+        {
+            char c = *pos++;
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (pos == end)
+                return false;
+            c = *pos++;
+            switch (c)
+            {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u':
+                {
+                    if (end - pos < 4)
+                        return false;
+                    unsigned code = strtoul(string(pos, 4).c_str(), nullptr, 16);
+                    pos += 4;
+                    // metadata text is ASCII in practice; keep BMP code points as UTF-8
+                    if (code < 0x80)
+                        out += static_cast<char>(code);
+                    else if (code < 0x800)
+                    {
+                        out += static_cast<char>(0xc0 | (code >> 6));
+                        out += static_cast<char>(0x80 | (code & 0x3f));
+                    }
+                    else
+                    {
+                        out += static_cast<char>(0xe0 | (code >> 12));
+                        out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                        out += static_cast<char>(0x80 | (code & 0x3f));
+                    }
+                    break;
+                }
+                default: out += c; break;
+            }
+        }
+        if (pos == end)
+            return false;
+        ++pos;
+        return true;
+    }
+
+    bool Value(Json& value)
+    {
+        Skip();
+        if (pos == end)
+            return false;
+
+        switch (*pos)
+        {
+            case '{':
+            {
+                value.type = Json::TYPE::OBJECT;
+                ++pos;
+                Skip();
+                if (pos < end && *pos == '}')
+                {
+                    ++pos;
+                    return true;
+                }
+                while (true)
+                {
+                    string key;
+                    Skip();
+                    if (!String(key))
+                        return false;
+                    Skip();
+                    if (pos == end || *pos++ != ':')
+                        return false;
+                    value.members.emplace_back(key, Json());
+                    if (!Value(value.members.back().second))
+                        return false;
+                    Skip();
+                    if (pos == end)
+                        return false;
+                    if (*pos == '}')
+                    {
+                        ++pos;
+                        return true;
+                    }
+                    if (*pos++ != ',')
+                        return false;
+                }
+            }
+            case '[':
+            {
+                value.type = Json::TYPE::ARRAY;
+                ++pos;
+                Skip();
+                if (pos < end && *pos == ']')
+                {
+                    ++pos;
+                    return true;
+                }
+                while (true)
+                {
+                    value.items.emplace_back();
+                    if (!Value(value.items.back()))
+                        return false;
+                    Skip();
+                    if (pos == end)
+                        return false;
+                    if (*pos == ']')
+                    {
+                        ++pos;
+                        return true;
+                    }
+                    if (*pos++ != ',')
+                        return false;
+                }
+            }
+            case '"':
+                value.type = Json::TYPE::STRING;
+                return String(value.text);
+            case 't':
+                value.type = Json::TYPE::BOOL;
+                value.number = 1;
+                return Literal("true");
+            case 'f':
+                value.type = Json::TYPE::BOOL;
+                return Literal("false");
+            case 'n':
+                return Literal("null");
+            default:
+            {
+                char* stop = nullptr;
+                value.type = Json::TYPE::NUMBER;
+                value.number = strtod(pos, &stop);
+                if (stop == pos || stop > end)
+                    return false;
+                pos = stop;
+                return true;
+            }
+        }
+    }
+};
+}
+
+
+SigmfRecorder::SigmfRecorder(const Config& config)
+: config(config)
+, data(DataConfig(config))
+, samples(0)
+, dirty(false)
+, running(false)
+{
+    scratch.resize(0x10000);
+}
+
+SigmfRecorder::~SigmfRecorder()
+{
+    Stop();
+}
+
+Recorder::Config SigmfRecorder::DataConfig(const Config& config)
+{
+    Recorder::Config data = config.recorder;
+    data.path = config.path + DATA_EXT;
+    data.file_bytes = 0;
+    data.index_interval = 0;
+    return data;
+}
+
+bool SigmfRecorder::Start()
+{
+    if (running)
+        return true;
+
+    {
+        lock_guard<mutex> guard(lock);
+        captures.clear();
+        pending.clear();
+        captures.push_back(SigmfCapture{0, config.frequency, Now()});
+    }
+    annotations.clear();
+    samples = 0;
+
+    string name = config.path + JOURNAL_EXT;
+    journal.open(name, ofstream::binary | ofstream::trunc);
+    if (!journal)
+    {
+        printf("Failed to create %s\r\n", name.c_str());
+        return false;
+    }
+    if (!WriteMeta(false) || !data.Start())
+        return false;
+
+    running = true;
+    meta_thread = thread([this]
+    {
+        ApplyThreadPolicy(ThreadPolicy("sdr-sigmf"));
+        while (stop.SleepFor(config.meta_period))
+        {
+            FlushAnnotations();
+            bool changed;
+            {
+                lock_guard<mutex> guard(lock);
+                changed = dirty;
+            }
+            if (changed)
+                WriteMeta(false);
+        }
+    });
+    return true;
+}
+
+void SigmfRecorder::Stop()
+{
+    if (!running)
+        return;
+
+    stop.Request();
+    meta_thread.join();
+    data.Stop();
+    FlushAnnotations();
+    journal.close();
+    // the journal is only needed until the annotations are in the document
+    if (WriteMeta(true))
+        remove((config.path + JOURNAL_EXT).c_str());
+    running = false;
+}
+
+IPacketStream::Callback_t SigmfRecorder::Callback(IPacketStream::Callback_t next)
+{
+    return [this, next](uint8_t msgId, const PacketRef& body)
+    {
+        Record(body);
+        if (next)
+            next(msgId, body);
+    };
+}
+
+void SigmfRecorder::Record(const PacketRef& body)
+{
+    uint64_t position = samples.load(memory_order_relaxed);
+
+    if (body.IsMessage())
+    {
+        F2CPU header(static_cast<uint32_t>(body[0]));
+        SigmfAnnotation note{position, 0, "F2CPU " + to_string(header.id()), header.id(),
+                             vector<uint32_t>(body.begin() + 1, body.end())};
+        lock_guard<mutex> guard(lock);
+        pending.push_back(std::move(note));
+        return;
+    }
+
+    // sign-extend both 12-bit halves: the word becomes one ci16_le sample
+    size_t count = body.size();
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        IQ_SAMPLE sample(body[idx]);
+        scratch[idx] = static_cast<uint16_t>(sample.i()) | (static_cast<uint32_t>(static_cast<uint16_t>(sample.q())) << 16);
+    }
+
+    if (!data.Write(scratch.data(), count * sizeof(uint32_t)))
+    {
+        // the data file goes on without these samples; leave a mark there
+        lock_guard<mutex> guard(lock);
+        pending.push_back(SigmfAnnotation{position, 0, "dropped " + to_string(count) + " samples", -1, {}});
+        return;
+    }
+    samples.store(position + count, memory_order_relaxed);
+}
+
+void SigmfRecorder::Retune(double frequency)
+{
+    lock_guard<mutex> guard(lock);
+    uint64_t position = samples.load(memory_order_relaxed);
+    if (captures.back().sample == position)
+        captures.pop_back();
+    captures.push_back(SigmfCapture{position, frequency, Now()});
+    dirty = true;
+}
+
+void SigmfRecorder::Annotate(uint64_t sample, uint64_t count, const string& label)
+{
+    lock_guard<mutex> guard(lock);
+    pending.push_back(SigmfAnnotation{sample, count, label, -1, {}});
+}
+
+// One annotation object, as in the annotations array and the journal
+static void WriteAnnotation(ostream& out, const SigmfAnnotation& note)
+{
+    out << "{\"core:sample_start\": " << note.sample;
+    if (note.count > 0)
+        out << ", \"core:sample_count\": " << note.count;
+    out << ", \"core:label\": ";
+    Quote(out, note.label);
+    if (note.msg_id >= 0)
+    {
+        out << ", \"sdr:msg_id\": " << note.msg_id << ", \"sdr:words\": [";
+        for (size_t word = 0; word < note.words.size(); ++word)
+            out << (word? ", ": "") << note.words[word];
+        out << "]";
+    }
+    out << "}";
+}
+
+// Moves the annotations recorded since the last call to the journal. Only
+// the swap happens under the lock the RX thread takes per message.
+bool SigmfRecorder::FlushAnnotations()
+{
+    vector<SigmfAnnotation> batch;
+    {
+        lock_guard<mutex> guard(lock);
+        batch.swap(pending);
+    }
+    if (batch.empty())
+        return true;
+
+    for (auto& note: batch)
+    {
+        WriteAnnotation(journal, note);
+        journal << '\n';
+    }
+    journal.flush();
+    annotations.insert(annotations.end(), make_move_iterator(batch.begin()), make_move_iterator(batch.end()));
+    if (!journal.good())
+    {
+        printf("Failed to write %s%s\r\n", config.path.c_str(), JOURNAL_EXT);
+        return false;
+    }
+    return true;
+}
+
+// While recording the document has the captures only, the annotations
+// are in the journal; the final one at Stop() carries them all
+bool SigmfRecorder::WriteMeta(bool final)
+{
+    vector<SigmfCapture> segments;
+    {
+        lock_guard<mutex> guard(lock);
+        dirty = false;
+        segments = captures;
+    }
+
+    ostringstream out;
+    out << "{\n  \"global\": {\n";
+    out << "    \"core:datatype\": \"ci16_le\",\n";
+    out << "    \"core:sample_rate\": " << Number(config.sample_rate) << ",\n";
+    out << "    \"core:version\": \"1.0.0\",\n";
+    out << "    \"core:num_channels\": 1,\n";
+    if (!config.description.empty())
+    {
+        out << "    \"core:description\": ";
+        Quote(out, config.description);
+        out << ",\n";
+    }
+    if (!config.hw.empty())
+    {
+        out << "    \"core:hw\": ";
+        Quote(out, config.hw);
+        out << ",\n";
+    }
+    out << "    \"core:recorder\": \"sdr-lib\",\n";
+    out << "    \"core:extensions\": [{\"name\": \"sdr\", \"version\": \"1.0.0\", \"optional\": true}],\n";
+    out << "    \"sdr:sample_bits\": 12\n  },\n";
+
+    out << "  \"captures\": [";
+    for (size_t idx = 0; idx < segments.size(); ++idx)
+    {
+        const SigmfCapture& capture = segments[idx];
+        out << (idx? ",\n": "\n") << "    {\"core:sample_start\": " << capture.sample
+            << ", \"core:frequency\": " << Number(capture.frequency)
+            << ", \"core:datetime\": \"" << capture.datetime << "\"}";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"annotations\": [";
+    if (final)
+    {
+        // SigMF wants annotations ordered by sample_start
+        stable_sort(annotations.begin(), annotations.end(),
+                    [](const SigmfAnnotation& a, const SigmfAnnotation& b) {return a.sample < b.sample;});
+        for (size_t idx = 0; idx < annotations.size(); ++idx)
+        {
+            out << (idx? ",\n    ": "\n    ");
+            WriteAnnotation(out, annotations[idx]);
+        }
+    }
+    out << "\n  ]\n}\n";
+
+    string path = config.path + META_EXT;
+    string temp = path + ".tmp";
+    {
+        ofstream file(temp, ofstream::binary | ofstream::trunc);
+        file << out.str();
+        if (!file.good())
+        {
+            printf("Failed to write %s\r\n", temp.c_str());
+            return false;
+        }
+    }
+    if (rename(temp.c_str(), path.c_str()) != 0)
+    {
+        printf("Failed to replace %s (%s)\r\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+SigmfReader::SigmfReader()
+: pool(BufferPool::Default())
+, data(nullptr)
+, data_size(0)
+, samples(0)
+, shift(0)
+, sample_rate(0)
+{
+}
+
+SigmfReader::~SigmfReader()
+{
+    Close();
+}
+
+bool SigmfReader::Open(const string& path)
+{
+#ifdef __linux__
+    Close();
+
+    string base = path;
+    for (const char* ext: {DATA_EXT, META_EXT})
+    {
+        size_t len = strlen(ext);
+        if (base.size() > len && base.compare(base.size() - len, len, ext) == 0)
+            base.resize(base.size() - len);
+    }
+
+    ifstream meta(base + META_EXT, ifstream::binary);
+    if (!meta)
+    {
+        printf("Failed to open %s%s\r\n", base.c_str(), META_EXT);
+        return false;
+    }
+    stringstream text;
+    text << meta.rdbuf();
+    if (!ParseMeta(text.str()))
+    {
+        printf("%s%s is not SigMF metadata this reader understands\r\n", base.c_str(), META_EXT);
+        return false;
+    }
+    LoadJournal(base + JOURNAL_EXT);
+
+    data = static_cast<const uint32_t*>(MapFile(base + DATA_EXT, data_size));
+    if (data == nullptr)
+        return false;
+    samples = data_size / sizeof(uint32_t);
+    return true;
+#else
+    printf("SigMF replay needs mmap, not available on this platform: %s\r\n", path.c_str());
+    return false;
+#endif
+}
+
+void SigmfReader::Close()
+{
+#ifdef __linux__
+    UnmapFile(data, data_size);
+#endif
+    data = nullptr;
+    data_size = 0;
+    samples = 0;
+    captures.clear();
+    annotations.clear();
+}
+
+static SigmfAnnotation ParseAnnotation(const Json& item)
+{
+    SigmfAnnotation note{static_cast<uint64_t>(item.Number("core:sample_start", 0)),
+                         static_cast<uint64_t>(item.Number("core:sample_count", 0)),
+                         item.Text("core:label"), static_cast<int>(item.Number("sdr:msg_id", -1)), {}};
+    const Json* words = item.Find("sdr:words");
+    if (words && words->type == Json::TYPE::ARRAY)
+    {
+        for (auto& word: words->items)
+            note.words.push_back(static_cast<uint32_t>(word.number));
+    }
+    return note;
+}
+
+bool SigmfReader::ParseMeta(const string& text)
+{
+    Json root;
+    if (!JsonParser(text).Parse(root) || root.type != Json::TYPE::OBJECT)
+        return false;
+
+    const Json* global = root.Find("global");
+    if (!global || global->Text("core:datatype") != "ci16_le")
+        return false;
+    sample_rate = global->Number("core:sample_rate", 0);
+    description = global->Text("core:description");
+    // captures from other tools use the full int16 range
+    shift = (global->Number("sdr:sample_bits", 16) == 12)? 0: 4;
+
+    const Json* list = root.Find("captures");
+    if (list && list->type == Json::TYPE::ARRAY)
+    {
+        for (auto& item: list->items)
+            captures.push_back(SigmfCapture{static_cast<uint64_t>(item.Number("core:sample_start", 0)),
+                                            item.Number("core:frequency", 0), item.Text("core:datetime")});
+    }
+
+    list = root.Find("annotations");
+    if (list && list->type == Json::TYPE::ARRAY)
+    {
+        for (auto& item: list->items)
+            annotations.push_back(ParseAnnotation(item));
+    }
+    stable_sort(annotations.begin(), annotations.end(),
+                [](const SigmfAnnotation& a, const SigmfAnnotation& b) {return a.sample < b.sample;});
+    return true;
+}
+
+// A recording that never reached Stop() left its annotations in the journal,
+// one object per line; a torn last line is skipped
+void SigmfReader::LoadJournal(const string& path)
+{
+    ifstream file(path, ifstream::binary);
+    if (!file)
+        return;
+
+    string line;
+    while (getline(file, line))
+    {
+        Json item;
+        if (JsonParser(line).Parse(item) && item.type == Json::TYPE::OBJECT)
+            annotations.push_back(ParseAnnotation(item));
+    }
+    stable_sort(annotations.begin(), annotations.end(),
+                [](const SigmfAnnotation& a, const SigmfAnnotation& b) {return a.sample < b.sample;});
+}
+
+const SigmfCapture* SigmfReader::CaptureAt(uint64_t sample) const
+{
+    const SigmfCapture* found = nullptr;
+    for (auto& capture: captures)
+    {
+        if (capture.sample > sample)
+            break;
+        found = &capture;
+    }
+    return found;
+}
+
+uint64_t SigmfReader::Replay(IPacketStream::Callback_t callback, uint64_t first, uint64_t count, size_t frame)
+{
+    if (first >= samples)
+        return 0;
+    uint64_t end = (count > samples - first)? samples: first + count;
+    frame = min<size_t>(max<size_t>(frame, 1), 0xffff);
+
+    auto note = lower_bound(annotations.begin(), annotations.end(), first,
+                            [](const SigmfAnnotation& a, uint64_t sample) {return a.sample < sample;});
+
+    uint64_t position = first;
+    while (position < end)
+    {
+        // a message recorded at sample n arrived right before sample n
+        for (; note != annotations.end() && note->sample <= position; ++note)
+        {
+            if (note->msg_id >= 0)
+                DeliverMessage(callback, *note);
+        }
+
+        uint64_t stop = min<uint64_t>(end, position + frame);
+        if (note != annotations.end() && note->sample < stop)
+            stop = note->sample;
+        Deliver(callback, position, stop - position);
+        position = stop;
+    }
+
+    // messages after the last sample of the recording
+    if (end == samples)
+    {
+        for (; note != annotations.end(); ++note)
+        {
+            if (note->msg_id >= 0)
+                DeliverMessage(callback, *note);
+        }
+    }
+    return end - first;
+}
+
+void SigmfReader::Deliver(IPacketStream::Callback_t& callback, uint64_t first, size_t count)
+{
+    PacketRef packet = pool.Get(count);
+    const int16_t* iq = reinterpret_cast<const int16_t*>(data + first);
+    for (size_t idx = 0; idx < count; ++idx)
+        packet[idx] = IQ_SAMPLE::Pack(iq[2 * idx] >> shift, iq[2 * idx + 1] >> shift);
+    packet.msgId(0);
+    packet.IsMessage(false);
+    callback(0, packet);
+}
+
+void SigmfReader::DeliverMessage(IPacketStream::Callback_t& callback, const SigmfAnnotation& note)
+{
+    uint8_t num = static_cast<uint8_t>(min<size_t>(note.words.size(), 0xff));
+    PacketRef packet = pool.Get(num + 1);
+    packet[0] = F2CPU(static_cast<uint8_t>(note.msg_id), num);
+    copy(note.words.begin(), note.words.begin() + num, packet.begin() + 1);
+    packet.msgId(static_cast<uint8_t>(note.msg_id));
+    packet.IsMessage(true);
+    callback(static_cast<uint8_t>(note.msg_id), packet);
+}
@@ -0,0 +1,136 @@
+#ifndef SIGMF_H
+#define SIGMF_H
+
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "recorder.h"
+#include "streamer.h"
+#include "waitstrategy.h"
+
+// SigMF captures (https://sigmf.org): path.sigmf-data holds the stream
+// samples as ci16_le, path.sigmf-meta the JSON metadata. Received F2CPU
+// messages become annotations at the sample where they arrived, so a
+// replay puts them back in the same place in the stream.
+
+struct SigmfCapture
+{
+    uint64_t sample;                // first sample of the segment
+    double frequency;               // center frequency in Hz
+    string datetime;                // ISO 8601 UTC, empty if unknown
+};
+
+struct SigmfAnnotation
+{
+    uint64_t sample;
+    uint64_t count;                 // 0 for point events
+    string label;
+    int msg_id;                     // F2CPU id, -1 for other annotations
+    vector<uint32_t> words;         // message payload
+};
+
+// Streams received packets into a SigMF pair. Samples go to disk through a
+// Recorder. Every meta_period while recording, new annotations are appended
+// to path.sigmf-journal and the metadata is rewritten (write and rename, so
+// readers always see a complete document) if the captures changed. Stop()
+// writes the annotations into the metadata and removes the journal.
+class SigmfRecorder
+{
+public:
+    struct Config
+    {
+        string path = "capture";                    // without the .sigmf-* extension
+        double sample_rate = 0;
+        double frequency = 0;                       // of the first capture segment
+        string description;
+        string hw;
+        chrono::milliseconds meta_period{1000};
+        Recorder::Config recorder;                  // path and file_bytes are set here
+    };
+
+    explicit SigmfRecorder(const Config& config);
+    ~SigmfRecorder();
+
+    bool Start();
+    // Call after the producer has stopped
+    void Stop();
+
+    // RX thread
+    void Record(const PacketRef& body);
+    IPacketStream::Callback_t Callback(IPacketStream::Callback_t next = nullptr);
+
+    // Any thread: new capture segment starting at the next recorded sample
+    void Retune(double frequency);
+    void Annotate(uint64_t sample, uint64_t count, const string& label);
+
+    uint64_t Samples() const {return samples.load(memory_order_relaxed);}
+    Recorder::Stats GetStats() const {return data.GetStats();}
+
+private:
+    const Config config;
+    Recorder data;
+    vector<uint32_t> scratch;       // RX thread
+    atomic<uint64_t> samples;
+
+    mutex lock;                     // the RX thread takes it per message: hold it briefly
+    vector<SigmfCapture> captures;
+    vector<SigmfAnnotation> pending;        // not yet journaled
+    bool dirty;                             // captures changed
+
+    ofstream journal;                       // meta thread, then Stop()
+    vector<SigmfAnnotation> annotations;    // journaled, for the final document
+
+    StopFlag stop;
+    thread meta_thread;
+    bool running;
+
+    static Recorder::Config DataConfig(const Config& config);
+    bool FlushAnnotations();
+    bool WriteMeta(bool final);
+};
+
+// Memory-mapped SigMF reader. Replay() turns the samples back into stream
+// packets with the message annotations in between and hands them to an
+// IPacketStream callback, as if they had just been received.
+class SigmfReader
+{
+public:
+    SigmfReader();
+    ~SigmfReader();
+
+    // path with or without the .sigmf-meta/.sigmf-data extension
+    bool Open(const string& path);
+    void Close();
+
+    uint64_t Samples() const {return samples;}
+    double SampleRate() const {return sample_rate;}
+    const string& Description() const {return description;}
+    const vector<SigmfCapture>& Captures() const {return captures;}
+    const vector<SigmfAnnotation>& Annotations() const {return annotations;}
+    // Capture segment that sample belongs to
+    const SigmfCapture* CaptureAt(uint64_t sample) const;
+
+    // Delivers samples [first, first + count) in frames of up to frame
+    // samples on the calling thread; returns the samples delivered
+    uint64_t Replay(IPacketStream::Callback_t callback, uint64_t first = 0,
+                    uint64_t count = UINT64_MAX, size_t frame = 0xffff);
+
+private:
+    BufferPool& pool;
+    const uint32_t* data;           // one ci16_le sample per word
+    size_t data_size;               // file length, as mapped
+    uint64_t samples;
+    int shift;                      // 12-bit recordings: 0, full-scale ci16: 4
+    double sample_rate;
+    string description;
+    vector<SigmfCapture> captures;
+    vector<SigmfAnnotation> annotations;
+
+    bool ParseMeta(const string& text);
+    void LoadJournal(const string& path);
+    void Deliver(IPacketStream::Callback_t& callback, uint64_t first, size_t count);
+    void DeliverMessage(IPacketStream::Callback_t& callback, const SigmfAnnotation& note);
+};
+
+#endif // SIGMF_H
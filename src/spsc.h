@@ -0,0 +1,78 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <atomic>
+#include <vector>
+#include <assert.h>
+#include <stddef.h>
+
+#define CACHE_LINE 64
+
+// Bounded lock-free single-producer/single-consumer ring.
+// Capacity is rounded up to a power of two.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity)
+    : mask(RoundUp(capacity) - 1)
+    , ring(mask + 1)
+    , head(0)
+    , tail(0)
+    {}
+
+    bool TryPush(const T& item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head_cache == ring.size())
+        {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t - head_cache == ring.size())
+                return false;
+        }
+        ring[t & mask] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail_cache)
+        {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h == tail_cache)
+                return false;
+        }
+        item = ring[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate when called from a third thread
+    size_t Size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+    size_t Capacity() const {return ring.size();}
+    bool Empty() const {return Size() == 0;}
+
+private:
+    static size_t RoundUp(size_t val)
+    {
+        size_t size = 1;
+        while (size < val)
+            size <<= 1;
+        return size;
+    }
+
+    const size_t mask;
+    std::vector<T> ring;
+
+    alignas(CACHE_LINE) std::atomic<size_t> head;   // consumer side
+    size_t tail_cache = 0;
+    alignas(CACHE_LINE) std::atomic<size_t> tail;   // producer side
+    size_t head_cache = 0;
+};
+
+#endif // SPSC_H
@@ -5,13 +5,19 @@
 #include <math.h>
 #include <fstream>
 #include "streamer.h"
+#include "bench.h"
+#include "hugemem.h"
+#include "latency.h"
+#include "metrics.h"
+#include "playback.h"
+#include "txsched.h"
+#include "waitstrategy.h"
 
 using namespace std;
 
-static bool do_exit;
+static StopFlag do_exit;
 static bool fifo_600mode;
-static atomic_int tx_count;
-static atomic_int rx_count;
+static bool rt_mode;
 static uint8_t in_ch_cnt;
 static uint8_t out_ch_cnt;
 static thread measure_thread;
@@ -29,6 +35,17 @@ SDR_HEADER* SDR_HEADER::FromRaw(uint32_t val)
 
 int OPacketStream::overflow(int c)
 {
+    if (combining)
+    {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            char ch = traits_type::to_char_type(c);
+            lock_guard<mutex> guard(combine_lock);
+            Append(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
     if (!traits_type::eq_int_type(c, traits_type::eof()))
     {
         *this->pptr() = c;
@@ -37,17 +54,28 @@ int OPacketStream::overflow(int c)
     
     this->DataReady();
 
-    this->setp(this->pbase(), this->epptr());
-    
     return traits_type::not_eof(c);
 }
 
+streamsize OPacketStream::xsputn(const char* data, streamsize count)
+{
+    if (!combining)
+        return streambuf::xsputn(data, count);
+
+    lock_guard<mutex> guard(combine_lock);
+    Append(data, count);
+    return count;
+}
+
 int OPacketStream::sync()
 {
+    // combined data is aligned in FlushCombined, a partial word waits for the rest
+    if (combining)
+        return 0;
+
     if ((this->pptr() - this->pbase()) % sizeof(uint32_t))
     {
         this->DataReady();
-        this->setp(this->pbase(), this->epptr());
         cout << "Unalligned data." << endl;
         return -1; 
     }            
@@ -56,25 +84,57 @@ int OPacketStream::sync()
 }
 
 
-OPacketStream::OPacketStream(FT_HANDLE handle)
+OPacketStream::OPacketStream(FT_HANDLE handle, TxScheduler* scheduler)
 : streambuf(), ostream(static_cast<streambuf*>(this))
+, handle(handle)
+, scheduler(scheduler)
+, probe(nullptr)
+, pool(BufferPool::Default())
+, transfers(0)
+, transfer_bytes(0)
+, combining(false)
+, used_bytes(0)
+, frame_pos(NO_FRAME)
+, oldest(0)
+, combine_stop(false)
+, flush_timer(WaitConfig{WaitMode::BLOCK, 0})
+, flusher(nullptr)
 {
     this->flags(ios_base::unitbuf);
+    this->ResetBuffer();
+}
 
-    auto s = sizeof(this->d_buffer);
-    auto start = reinterpret_cast<char*>(this->d_buffer.data());
+OPacketStream::~OPacketStream()
+{
+    if (flusher != nullptr)
+    {
+        combine_stop = true;
+        flush_timer.Notify();
+        flusher->join();
+        delete flusher;
+    }
+    flush();
+}
 
-    this->setp(start, start + s - 1);
+void OPacketStream::ResetBuffer()
+{
+    auto start = reinterpret_cast<char*>(&this->d_buffer[1]);
+    auto end = reinterpret_cast<char*>(this->d_buffer.data() + this->d_buffer.size());
 
-    this->handle = handle;
-    this->tx_count = 0;
+    this->setp(start, end - 1);
 }
 
 ostream& OPacketStream::flush()
 {
     ostream::flush();        
 
-    DataReady();
+    if (combining)
+    {
+        lock_guard<mutex> guard(combine_lock);
+        FlushCombined();
+    }
+    else
+        DataReady();
 
     return *this;
 }
@@ -85,91 +145,421 @@ void OPacketStream::DataReady()
     if (elems == 0)
         return;
     
-    list<uint32_t> packet(this->d_buffer.begin(), this->d_buffer.end());
-    packet.push_front(F2FIFO(elems));
-    SendPacket(packet);
+    // header goes into the reserved slot, the frame is sent without copying
+    d_buffer[0] = F2FIFO(static_cast<uint16_t>(elems));
+    Metrics::Add(Metrics::TX_FRAMES, 1);
+    if (scheduler != nullptr)
+    {
+        // the scheduler writes later, so it gets its own copy
+        PacketRef frame = pool.Get(elems + 1);
+        copy(d_buffer.begin(), d_buffer.begin() + elems + 1, frame.begin());
+        transfers++;
+        transfer_bytes += (elems + 1) * sizeof(uint32_t);
+        scheduler->QueueFrames(std::move(frame));
+    }
+    else
+        SendPacket(d_buffer.data(), elems + 1);
+    ResetBuffer();
+}
+
+bool OPacketStream::SendMessage(uint8_t msgId, const list<uint32_t> &data)
+{
+    if (!F2CPU::Fits(msgId, data.size()))
+        return false;
+    PacketRef packet = pool.Get(data.size() + 1);
+
+    packet[0] = F2CPU(msgId, data.size());
+    copy(data.begin(), data.end(), packet.begin() + 1);
+    return Dispatch(std::move(packet));
+}
+
+bool OPacketStream::SendMessage(uint8_t msgId, const uint32_t* data, size_t count)
+{
+    if (!F2CPU::Fits(msgId, count))
+        return false;
+    WordSpan payload{data, count};
+    return SendGather(F2CPU(msgId, count), &payload, 1);
+}
+
+// Payload words a header announces
+static size_t PayloadWords(uint32_t header)
+{
+    return SDR_HEADER::IsCmd(header)? F2CPU(header).num(): F2FIFO(header).num();
+}
+static_assert(F2FIFO::MAX_NUM + 1 <= BufferPool::MAX_WORDS, "a whole F2FIFO frame must fit a pool buffer");
+
+bool OPacketStream::SendGather(uint32_t header, const WordSpan* spans, size_t count)
+{
+    size_t words = 1;
+    for (size_t idx = 0; idx < count; ++idx)
+        words += spans[idx].words;
+    if (words - 1 != PayloadWords(header))
+        return false;
+
+    PacketRef packet = pool.Get(words);
+    auto out = packet.begin();
+    *out++ = header;
+    for (size_t idx = 0; idx < count; ++idx)
+        out = copy(spans[idx].data, spans[idx].data + spans[idx].words, out);
+    return Emit(std::move(packet));
+}
+
+bool OPacketStream::SendReserved(uint32_t header, uint32_t* packet, size_t payload_words)
+{
+    if (payload_words != PayloadWords(header))
+        return false;
+    if (scheduler != nullptr)
+    {
+        WordSpan payload{packet + 1, payload_words};
+        return SendGather(header, &payload, 1);
+    }
+
+    packet[0] = header;
+    CountPacket(header);
+    WordSpan whole{packet, payload_words + 1};
+    return WriteSpans(&whole, 1);
+}
+
+// Routes a complete packet: messages through Dispatch, stream frames to the
+// scheduler or the pipe
+bool OPacketStream::Emit(PacketRef packet)
+{
+    if (SDR_HEADER::IsCmd(packet[0]))
+        return Dispatch(std::move(packet));
+    CountPacket(packet[0]);
+    if (scheduler != nullptr)
+    {
+        transfers++;
+        transfer_bytes += packet.size() * sizeof(uint32_t);
+        return scheduler->QueueFrames(std::move(packet));
+    }
+
+    WordSpan whole{packet.data(), packet.size()};
+    return WriteSpans(&whole, 1);
+}
+
+// One packet handed on to the pipe or the scheduler
+void OPacketStream::CountPacket(uint32_t header)
+{
+    if (SDR_HEADER::IsCmd(header))
+        Metrics::Add(Metrics::TX_MESSAGES, F2CPU(header).id());
+    else
+        Metrics::Add(Metrics::TX_FRAMES, 1);
+}
+
+// Writes straight from the spans, after anything combined ahead of them
+bool OPacketStream::WriteSpans(const WordSpan* spans, size_t count)
+{
+    unique_lock<mutex> guard(combine_lock, defer_lock);
+    if (combining)
+    {
+        guard.lock();
+        FlushCombined();
+    }
+
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        if (spans[idx].words > 0 && !SendPacket(spans[idx].data, spans[idx].words))
+            return false;
+    }
+    return true;
+}
+
+bool OPacketStream::Dispatch(PacketRef message)
+{
+    CountPacket(message[0]);
+    if (scheduler != nullptr)
+        return scheduler->QueueMessage(std::move(message));
+    if (!combining)
+        return SendPacket(message.data(), message.size());
+
+    lock_guard<mutex> guard(combine_lock);
+    if (combine.messages && message.size() + 1 <= combine.transfer_words)
+    {
+        AppendMessage(message);
+        return true;
+    }
+
+    // stream data written before the message goes first, as without combining
+    FlushCombined();
+    return SendPacket(message.data(), message.size());
+}
+
+void OPacketStream::Combine(const WriteCombine& config)
+{
+    assert(!combining);
+    DataReady();
+
+    combine = config;
+    combine.frame_words = min<size_t>(max<size_t>(combine.frame_words, 1), 0xffff);
+    combine.transfer_words = max(combine.transfer_words, combine.frame_words + 1);
+    transfer = pool.Get(combine.transfer_words);
+    used_bytes = 0;
+    frame_pos = NO_FRAME;
+
+    // no put area: sputc and sputn always reach overflow and xsputn
+    this->setp(nullptr, nullptr);
+    this->unsetf(ios_base::unitbuf);
+    combining = true;
+
+    flusher = new thread(&OPacketStream::Flusher, this);
+}
+
+OPacketStream::TransferStats OPacketStream::Transfers() const
+{
+    return TransferStats{transfers.load(memory_order_relaxed), transfer_bytes.load(memory_order_relaxed)};
+}
+
+// Caller holds combine_lock
+void OPacketStream::Append(const char* data, size_t bytes)
+{
+    const size_t capacity = combine.transfer_words * sizeof(uint32_t);
+    const size_t frame_bytes = combine.frame_words * sizeof(uint32_t);
+    char* base = reinterpret_cast<char*>(transfer.data());
+
+    if (bytes > 0 && oldest.load(memory_order_relaxed) == 0)
+    {
+        oldest.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+        flush_timer.Notify();
+    }
+
+    while (bytes > 0)
+    {
+        if (frame_pos == NO_FRAME)
+        {
+            // room for a header and at least one word
+            if (used_bytes + 2 * sizeof(uint32_t) > capacity)
+                FlushCombined();
+            frame_pos = used_bytes / sizeof(uint32_t);
+            used_bytes += sizeof(uint32_t);
+        }
+
+        size_t filled = used_bytes - (frame_pos + 1) * sizeof(uint32_t);
+        size_t room = min(frame_bytes - filled, capacity - used_bytes);
+        size_t chunk = min(room, bytes);
+
+        memcpy(base + used_bytes, data, chunk);
+        used_bytes += chunk;
+        data += chunk;
+        bytes -= chunk;
+
+        if (chunk == room)
+            CloseFrame();
+    }
+
+    if (used_bytes + 2 * sizeof(uint32_t) > capacity)
+        FlushCombined();
+}
+
+// Writes the header of the open frame; used_bytes is word aligned here
+void OPacketStream::CloseFrame()
+{
+    size_t words = used_bytes / sizeof(uint32_t) - frame_pos - 1;
+    transfer[frame_pos] = F2FIFO(static_cast<uint16_t>(words));
+    frame_pos = NO_FRAME;
+    Metrics::Add(Metrics::TX_FRAMES, 1);
 }
 
-void OPacketStream::SendMessage(uint8_t msgId, const list<uint32_t> &data)
+// Closes the open frame on its last complete word, or drops it if it is
+// still empty. The bytes of a trailing partial word are moved to tail.
+size_t OPacketStream::SealFrame(char* tail)
 {
-    list<uint32_t> packet(data);
+    size_t tail_bytes = used_bytes % sizeof(uint32_t);
+
+    used_bytes -= tail_bytes;
+    memcpy(tail, reinterpret_cast<char*>(transfer.data()) + used_bytes, tail_bytes);
 
-    packet.push_front(F2CPU(msgId, data.size()));
-    SendPacket(packet);
+    if (frame_pos != NO_FRAME)
+    {
+        if (used_bytes / sizeof(uint32_t) == frame_pos + 1)
+        {
+            // nothing but the header
+            used_bytes -= sizeof(uint32_t);
+            frame_pos = NO_FRAME;
+        }
+        else
+            CloseFrame();
+    }
+    return tail_bytes;
 }
 
-bool OPacketStream::SendPacket(const list<uint32_t> &data)
+// Caller holds combine_lock. The message goes between the stream frames
+// written before and after it, so ordering is kept within the transfer.
+void OPacketStream::AppendMessage(const PacketRef& message)
 {
-    auto size = data.size() * sizeof(uint32_t);
-    unique_ptr<uint8_t[]> buf(new uint8_t[size]);
+    char tail[sizeof(uint32_t)];
+    size_t tail_bytes = SealFrame(tail);
+    size_t bytes = message.size() * sizeof(uint32_t);
 
-    cout << "SendPacket (" << data.size() << ") words" << endl ;
-    auto idx = 0;
-    for (auto elem: data)        
+    if (used_bytes + bytes > combine.transfer_words * sizeof(uint32_t))
+        FlushCombined();
+    if (oldest.load(memory_order_relaxed) == 0)
     {
-        const uint8_t *ptr = reinterpret_cast<const uint8_t *>(&data);
+        oldest.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+        flush_timer.Notify();
+    }
+
+    memcpy(reinterpret_cast<char*>(transfer.data()) + used_bytes, message.data(), bytes);
+    used_bytes += bytes;
 
-        for (size_t i = 0; i < sizeof(uint32_t); i++)
-            buf[idx + i] = *ptr++;
+    if (tail_bytes > 0)
+        Append(tail, tail_bytes);
+}
 
-        idx += 4;
+// Caller holds combine_lock. Sends every complete word; a trailing partial
+// word is carried over into the next frame.
+void OPacketStream::FlushCombined()
+{
+    char tail[sizeof(uint32_t)];
+    size_t tail_bytes = SealFrame(tail);
 
-        cout << std::hex << elem << " ";
+    size_t words = used_bytes / sizeof(uint32_t);
+    if (words > 0)
+    {
+        if (scheduler != nullptr)
+        {
+            transfer.resize(words);
+            transfers++;
+            transfer_bytes += used_bytes;
+            scheduler->QueueFrames(std::move(transfer));
+            transfer = pool.Get(combine.transfer_words);
+        }
+        else
+            SendPacket(transfer.data(), words);
     }
-    cout << endl;
+    used_bytes = 0;
+    oldest.store(0, memory_order_relaxed);
 
-    ULONG count = 0;
-    if (FT_OK != FT_WritePipeEx(handle, 1,
-                (PUCHAR)buf.get(), size , &count, 1000)) {
-                    return false;
+    if (tail_bytes > 0)
+    {
+        Append(tail, tail_bytes);
+        // a lone partial word cannot go out, it waits for the next write
+        oldest.store(0, memory_order_relaxed);
+    }
+}
 
+// Sends whatever has waited for longer than the deadline
+void OPacketStream::Flusher()
+{
+    while (!combine_stop)
+    {
+        flush_timer.Wait([this] {return oldest.load(memory_order_relaxed) != 0 || combine_stop;});
+
+        int64_t since = oldest.load(memory_order_relaxed);
+        if (since == 0)
+            continue;
+
+        auto deadline = chrono::steady_clock::time_point(chrono::steady_clock::duration(since)) + combine.deadline;
+        // returns early if the data went out in the meantime
+        flush_timer.WaitUntil([this, since] {return oldest.load(memory_order_relaxed) != since || combine_stop;},
+                              deadline);
+
+        lock_guard<mutex> guard(combine_lock);
+        if (oldest.load(memory_order_relaxed) == since)
+            FlushCombined();
     }
-    tx_count += count;
+}
+
+bool OPacketStream::SendPacket(const uint32_t* words, size_t count)
+{
+    ULONG size = count * sizeof(uint32_t);
+    ULONG sent = 0;
+
+    if (probe != nullptr)
+        probe->Transmitted(words, count);
+
+    while (sent < size)
+    {
+        ULONG count = 0;
+        if (FT_OK != FT_WritePipeEx(handle, 1,
+                    (PUCHAR)words + sent, size - sent, &count, 1000)) {
+                        Metrics::Add(Metrics::TRANSFER_ERRORS, 1);
+                        return false;
+
+        }
+        sent += count;
+        Metrics::Add(Metrics::TX_BYTES, 1, count);
+    }
+    transfers++;
+    transfer_bytes += size;
 
     return true;
 }
 
 
-IPacketStream::IPacketStream(FT_HANDLE handle, Callback_t callback = nullptr)
+IPacketStream::IPacketStream(FT_HANDLE handle, Callback_t callback, SOURCE source,
+                             const ThreadPolicy& policy, uint8_t fifo)
 :streambuf()
 , istream(static_cast<streambuf*>(this))
 , callback(callback)
 , handle(handle)
-, rx_count(0)
+, fifo(fifo)
+, pool((source == SOURCE::EXTERNAL)? &BufferPool::Local(): nullptr)
 , packet_type(PCKTYPE::NONE)
+, policy(policy)
+, status(FT_OK)
 , read_thread(nullptr)
 , start(reinterpret_cast<char*>(this->d_buffer.data()))
 {
     this->flags(ios_base::unitbuf);
 
-    auto size = 1 * sizeof(uint32_t);
-
-    this->setp(start, start + size - 1);
     this->d_buffer.fill(0); 
+    this->ExpectHeader();
 
-    //read_thread = new thread(&IPacketStream::DataReaderThread, this);
-    read_thread = new thread(&IPacketStream::DataReaderThreadArray, this); 
+    if (source == SOURCE::EXTERNAL)
+        return;
+
+    read_thread = new thread([this, source]
+    {
+        // applied before the reader allocates, so its buffers follow the core
+        ApplyThreadPolicy(this->policy);
+        // every packet is assembled in a pool buffer: take them from this node
+        pool = &BufferPool::Local();
+        printf("%s\r\n", DescribeThread().c_str());
+
+        switch (source)
+        {
+            case SOURCE::USB: DataReaderThread(); break;
+            case SOURCE::FILE: DataReaderThreadFile(); break;
+            case SOURCE::ARRAY: DataReaderThreadArray(); break;
+            case SOURCE::EXTERNAL: break;
+        }
+    });
       
 };
 
+void IPacketStream::ExpectHeader()
+{
+    packet_type = PCKTYPE::NONE;
+    this->setp(start, start + sizeof(uint32_t) - 1);
+}
+
 
 void IPacketStream::DataReaderThread()
 {
-    auto size = d_buffer.size() * sizeof(uint32_t);
-    unique_ptr<uint8_t[]> buf(new uint8_t[size]);
+    auto size = BUFFER_LEN;
+    // allocated here so the ring is local to the reader thread's node
+    HugeBuffer<uint8_t> buf(size);
 
-    while (!do_exit)
+    while (!stop)
     {        
         ULONG count = 0;
-        FT_STATUS status = FT_ReadPipeEx(handle, 1, buf.get(), size, &count, timeout.count());        
-        if (status != FT_OK || status != FT_TIMEOUT)
+        FT_STATUS result = FT_ReadPipeEx(handle, fifo, buf.get(), size, &count, timeout.count());        
+        if (result != FT_OK && result != FT_TIMEOUT)
         {
-            do_exit = true;
+            // the abort from Stop() is the normal way out
+            if (stop)
+                break;
+            Metrics::Add(Metrics::TRANSFER_ERRORS, fifo);
+            status.store(result, memory_order_release);
+            printf("Read on FIFO %u failed with status %u\r\n", fifo, static_cast<unsigned>(result));
             break;
         }
+        if (count == 0)
+            Metrics::Add(Metrics::TIMEOUTS, fifo);
 
         this->sputn(reinterpret_cast<const char*>(buf.get()), count);
-        rx_count += count;
+        Metrics::Add(Metrics::RX_BYTES, fifo, count);
         
     }
     printf("Read stopped\r\n");
@@ -195,29 +585,26 @@ void IPacketStream::DataReaderThreadArray()
 
     this->sputn(reinterpret_cast<const char*>(buf), sizeof(buf));
 
-    while(true) this_thread::yield();
+    stop.Wait();
 }    
 
 void IPacketStream::DataReaderThreadFile()
 {
-    auto size = d_buffer.size() * sizeof(uint32_t);
-    unique_ptr<uint8_t[]> buf(new uint8_t[size]);
+    auto size = BUFFER_LEN;
+    HugeBuffer<uint8_t> buf(size);
 
     ifstream tmpfile("/mnt/backup/P8H77-I-ASUS-1102.CAP", istream::binary);
 
 
-    while (!do_exit)
+    while (!stop)
     {        
         ULONG count = 0;
         count = tmpfile.readsome(reinterpret_cast<char*>(buf.get()), size);
         if (count == 0)
-        {
-            do_exit = true;
             break;
-        }
 
         this->sputn(reinterpret_cast<const char*>(buf.get()), count);
-        rx_count += count;
+        Metrics::Add(Metrics::RX_BYTES, fifo, count);
         
     }
 
@@ -226,6 +613,12 @@ void IPacketStream::DataReaderThreadFile()
 }
 
 
+void IPacketStream::Feed(const void* data, size_t bytes)
+{
+    this->sputn(static_cast<const char*>(data), bytes);
+    Metrics::Add(Metrics::RX_BYTES, fifo, bytes);
+}
+
 int IPacketStream::overflow(int c)
 {
     if (traits_type::eq_int_type(c, traits_type::eof()))
@@ -241,81 +634,116 @@ int IPacketStream::overflow(int c)
         {
             uint32_t first_word = d_buffer.front();
             packet_type = SDR_HEADER::IsCmd(first_word)?PCKTYPE::MESSAGE: PCKTYPE::STREAM;
+            // the parser cannot resync, but a header with reserved bits set
+            // is the sign that it has lost the packet boundaries
+            if (first_word & ((packet_type == PCKTYPE::MESSAGE)? 0x000fffff: 0x7fff0000))
+                Metrics::Add(Metrics::BAD_HEADERS, 0);
             if (packet_type == PCKTYPE::MESSAGE)
             {
                 F2CPU header(static_cast<uint32_t>(first_word));
+                packet = pool->Get(header.num() + 1);
+                packet.msgId(header.id());
+                packet.IsMessage(true);
+                packet[0] = first_word;
                 if (header.num() > 0)
                 {
                     // keep header in the buffer
-                    this->setp(start, start + (header.num() + 1) * sizeof(uint32_t) - 1);
+                    auto body = reinterpret_cast<char*>(packet.data());
+                    this->setp(body, body + packet.size() * sizeof(uint32_t) - 1);
                     this->pbump(sizeof(uint32_t));
                 }
                 else
                 {
-                    callback(header.id(), list<uint32_t>({static_cast<uint32_t>(header)}));
-                    packet_type = PCKTYPE::NONE;
-                    this->setp(start, start + sizeof(uint32_t) - 1);
+                    DataReady();
                 }
             }
             else //PCKTYPE::STREAM
             {
                 F2FIFO header(static_cast<uint32_t>(first_word));
-
-                this->setp(start, start + header.num() * sizeof(uint32_t) - 1);
+                packet = pool->Get(header.num());
+                if (header.num() > 0)
+                {
+                    auto body = reinterpret_cast<char*>(packet.data());
+                    this->setp(body, body + packet.size() * sizeof(uint32_t) - 1);
+                }
+                else
+                {
+                    DataReady();
+                }
             }
             break;
         }
 
         case PCKTYPE::STREAM:
         case PCKTYPE::MESSAGE:
-            auto bytes = this->epptr() - this->pbase() + 1;
-            assert(bytes % sizeof(uint32_t) == 0 && bytes < 0xffff);
-            
-            auto itend = d_buffer.begin() + bytes / sizeof(uint32_t);
-            uint8_t msgId = (packet_type == STREAM)? 0: F2CPU(d_buffer.front()).id();
-            callback(msgId, list<uint32_t>(d_buffer.begin(), itend));
-            packet_type = PCKTYPE::NONE;
-            this->setp(start, start + sizeof(uint32_t) - 1);
+            assert(this->pptr() == this->epptr() + 1);
+            DataReady();
             break;
     }
     
     return traits_type::not_eof(c);
 }
 
+// Hands the assembled packet over; the pool buffer lives on as long as
+// the callback keeps a handle to it
+void IPacketStream::DataReady()
+{
+    if (packet.IsMessage())
+        Metrics::Add(Metrics::RX_MESSAGES, packet.msgId());
+    else
+        Metrics::Add(Metrics::RX_FRAMES, fifo);
+    if (callback)
+        callback(packet.msgId(), packet);
+    packet.reset();
+    ExpectHeader();
+}
+
 int IPacketStream::sync()
 {        
 
     return 0;
 }
 
+void IPacketStream::Stop()
+{
+    if (read_thread == nullptr)
+        return;
+
+    stop.Request();
+    // IN endpoints start at 0x82 for FIFO 0
+    FT_AbortPipe(handle, 0x82 + fifo);
+    if (read_thread->joinable())
+        read_thread->join();
+}
+
 IPacketStream::~IPacketStream()
 {
+    Stop();
     if (read_thread != nullptr)
         delete read_thread;
 }
 
 
-void Processor(uint8_t msgId, const list<uint32_t>& data)
+void Processor(uint8_t msgId, const PacketRef& data)
 {    
     cout << "Packet received - id=" << (int)msgId << " with " << data.size() << " words." << endl;
 }
 
 void tmp2(FT_HANDLE handle)
 {
-    IPacketStream in(handle, Processor);
-    in.GetThread().join();
-    while(true);
+    IPacketStream in(handle, Processor, IPacketStream::SOURCE::ARRAY);
+    do_exit.Wait();
 }
 
 void tmp(FT_HANDLE handle)
 {
     OPacketStream out(handle);
 
-    ifstream f("/mnt/backup/P8H77-I-ASUS-1102.CAP", ifstream::binary);
-
-    out << f.rdbuf();
-
-    f.close();
+    {
+        WaveformPlayer player(out);
+        if (player.Open("/mnt/backup/P8H77-I-ASUS-1102.CAP"))
+            player.Play();
+    }
 
     uint32_t buffer[] = {0xffaafeed,0xabcdefaa,0xffaafeed,0xabcdefaa, 0xffaafeed,0xabcdefaa, 0x55000011};
     char* buf_ptr = reinterpret_cast<char*>(buffer);
@@ -342,33 +770,37 @@ static void show_throughput(FT_HANDLE handle)
 {
     auto next = chrono::steady_clock::now() + chrono::seconds(1);;
     (void)handle;
+    Metrics::Snapshot last = Metrics::Read();
 
-    while (!do_exit) {
-        this_thread::sleep_until(next);
+    while (do_exit.SleepUntil(next)) {
         next += chrono::seconds(1);
 
-        int tx = tx_count.exchange(0);
-        int rx = rx_count.exchange(0);
+        Metrics::Snapshot now = Metrics::Read();
+        uint64_t tx = now.Total(Metrics::TX_BYTES) - last.Total(Metrics::TX_BYTES);
+        uint64_t rx = now.Total(Metrics::RX_BYTES) - last.Total(Metrics::RX_BYTES);
+        last = now;
 
-        printf("TX:%.2fMiB/s RX:%.2fMiB/s, total:%.2fMiB\r\n",
-            (float)tx/1000/1000, (float)rx/1000/1000,
-            (float)(tx+ rx)/1000/1000);
+        printf("TX:%.2fMiB/s RX:%.2fMiB/s, total:%.2fMiB/s\r\n",
+            (float)tx/1024/1024, (float)rx/1024/1024,
+            (float)(tx+ rx)/1024/1024);
     }
 }
 
 static void write_test(FT_HANDLE handle)
 {    
-    unique_ptr<uint8_t[]> buf(new uint8_t[BUFFER_LEN]);
+    HugeBuffer<uint8_t> buf(BUFFER_LEN);
+    printf("TX buffer: %s\r\n", buf.Placement().Describe().c_str());
 
     while (!do_exit) {
         for (uint8_t channel = 0; channel < out_ch_cnt; channel++) {
             ULONG count = 0;
             if (FT_OK != FT_WritePipeEx(handle, channel,
                         (PUCHAR)buf.get(), BUFFER_LEN, &count, 1000)) {
-                do_exit = true;
+                Metrics::Add(Metrics::TRANSFER_ERRORS, channel);
+                do_exit.Request();
                 break;
             }
-            tx_count += count;
+            Metrics::Add(Metrics::TX_BYTES, channel, count);
         }
     }
     printf("Write stopped\r\n");
@@ -376,27 +808,49 @@ static void write_test(FT_HANDLE handle)
 
 static void read_test(FT_HANDLE handle)
 {
-    unique_ptr<uint8_t[]> buf(new uint8_t[BUFFER_LEN]);
+    HugeBuffer<uint8_t> buf(BUFFER_LEN);
+    printf("RX buffer: %s\r\n", buf.Placement().Describe().c_str());
 
     while (!do_exit) {
         for (uint8_t channel = 0; channel < in_ch_cnt; channel++) {
             ULONG count = 0;
             if (FT_OK != FT_ReadPipeEx(handle, channel,
                         buf.get(), BUFFER_LEN, &count, 1000)) {
-                do_exit = true;
+                Metrics::Add(Metrics::TRANSFER_ERRORS, channel);
+                do_exit.Request();
                 break;
             }
-            rx_count += count;
+            Metrics::Add(Metrics::RX_BYTES, channel, count);
         }
     }
     printf("Read stopped\r\n");
 }
 
+static thread start_thread(const ThreadPolicy& policy,
+        void (*fn)(FT_HANDLE), FT_HANDLE handle)
+{
+    return thread([=]
+    {
+        ApplyThreadPolicy(policy);
+        printf("%s\r\n", DescribeThread().c_str());
+        fn(handle);
+    });
+}
+
+/* Transfers blocked in the driver only notice do_exit on timeout */
+static void abort_pipes(FT_HANDLE handle)
+{
+    for (uint8_t channel = 0; channel < out_ch_cnt; channel++)
+        FT_AbortPipe(handle, 0x02 + channel);
+    for (uint8_t channel = 0; channel < in_ch_cnt; channel++)
+        FT_AbortPipe(handle, 0x82 + channel);
+}
+
 static void sig_hdlr(int signum)
 {
     switch (signum) {
     case SIGINT:
-        do_exit = true;
+        do_exit.Request();
         break;
     }
 }
@@ -471,8 +925,9 @@ static void turn_off_all_pipes(void)
 
 static bool get_device_lists(int timeout_ms)
 {
-    DWORD count;
+    DWORD count = 0;
     FT_DEVICE_LIST_INFO_NODE nodes[16];
+    auto delay = chrono::microseconds(10);
 
     chrono::steady_clock::time_point const timeout =
         chrono::steady_clock::now() +
@@ -481,7 +936,10 @@ static bool get_device_lists(int timeout_ms)
     do {
         if (FT_OK == FT_CreateDeviceInfoList(&count))
             break;
-        this_thread::sleep_for(chrono::microseconds(10));
+        /* Re-enumeration takes seconds: back off instead of polling at 10us */
+        if (!do_exit.SleepFor(delay))
+            break;
+        delay = min(delay * 2, chrono::microseconds(10000));
     } while (chrono::steady_clock::now() < timeout);
     printf("Total %u device(s)\r\n", count);
     if (!count)
@@ -619,9 +1077,15 @@ static bool set_channel_config(bool is_600_mode, CONFIGURATION_FIFO_CLK clock)
 
 static void show_help(const char *bin)
 {
-    printf("Usage: %s <out channel count> <in channel count> [mode]\r\n", bin);
+    printf("Usage: %s <out channel count> <in channel count> [mode] [rt]\r\n", bin);
+    printf("       %s bench [out.json] [name filter]\r\n", bin);
+    printf("       %s latency [seconds] [interval us]   (loopback image or emulator)\r\n", bin);
     printf("  channel count: [0, 1] for 245 mode, [0-4] for 600 mode\r\n");
     printf("  mode: 0 = FT245 mode (default), 1 = FT600 mode\r\n");
+    printf("  rt: 1 = lock memory, pin TX/RX threads to cores 1/2 at SCHED_FIFO\r\n");
+    printf("  SDR_WAIT=spin|hybrid|block selects how idle threads wait\r\n");
+    printf("  SDR_METRICS=<file> writes Prometheus metrics every second\r\n");
+    printf("  SDR_METRICS_SHM=<name> publishes them in shared memory too\r\n");
 }
 
 static void turn_off_thread_safe(void)
@@ -669,16 +1133,19 @@ static void get_queue_status(HANDLE handle)
 
 static bool validate_arguments(int argc, char *argv[])
 {
-    if (argc != 3 && argc != 4)
+    if (argc < 3 || argc > 5)
         return false;
 
-    if (argc == 4) {
+    if (argc >= 4) {
         int val = atoi(argv[3]);
         if (val != 0 && val != 1)
             return false;
         fifo_600mode = (bool)val;
     }
 
+    if (argc == 5)
+        rt_mode = atoi(argv[4]) != 0;
+
     out_ch_cnt = atoi(argv[1]);
     in_ch_cnt = atoi(argv[2]);
 
@@ -827,6 +1294,15 @@ int main(int argc, char *argv[])
 {    
     FT_HANDLE handle;
     bool rev_a_chip;
+
+    MetricsExporter exporter(MetricsExporter::Config::Default());
+    if (!exporter.Start())
+        return 1;
+
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+        return RunBench(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "latency") == 0)
+        return RunLatency(argc - 2, argv + 2);
        
     get_version();
 
@@ -865,12 +1341,24 @@ int main(int argc, char *argv[])
 #endif    
 
 
+    ThreadPolicy tx_policy("sdr-tx"), rx_policy("sdr-rx");
+    if (rt_mode) {
+        LockAllMemory();
+        tx_policy = ThreadPolicy("sdr-tx", 1, 80);
+        rx_policy = ThreadPolicy("sdr-rx", 2, 80);
+        tx_policy.expect_isolated = rx_policy.expect_isolated = true;
+    }
+
     if (out_ch_cnt)
-        write_thread = thread(write_test, handle);
+        write_thread = start_thread(tx_policy, write_test, handle);
     if (in_ch_cnt)
-        read_thread = thread(read_test, handle);
-    measure_thread = thread(show_throughput, handle);
+        read_thread = start_thread(rx_policy, read_test, handle);
+    measure_thread = start_thread(ThreadPolicy("sdr-stats"), show_throughput, handle);
     register_signals();
+    printf("Wait strategy: %s\r\n", WaitConfig::Default().Name());
+
+    do_exit.Wait();
+    abort_pipes(handle);
 
     if (write_thread.joinable())
         write_thread.join();
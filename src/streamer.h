@@ -1,3 +1,6 @@
+#ifndef STREAMER_H
+#define STREAMER_H
+
 #include <stdint.h>
 #include <iostream>
 #include <cstring>
@@ -6,11 +9,18 @@
 #include <functional>
 #include <chrono>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include "ftd3xx.h"
+#include "bufpool.h"
+#include "rtthread.h"
+#include "waitstrategy.h"
 
 using namespace std;
 
+class LatencyProbe;
+class TxScheduler;
+
 class SDR_HEADER
 {
 protected:
@@ -36,6 +46,12 @@ class F2CPU : protected SDR_HEADER
     };
     BITS val;
 public:
+    static constexpr uint8_t MAX_ID = 7;
+    static constexpr size_t MAX_NUM = 0xff;
+
+    // false if id or num would be cut short by their header fields
+    static constexpr bool Fits(uint8_t id, size_t num) {return id <= MAX_ID && num <= MAX_NUM;}
+
     explicit constexpr F2CPU(uint8_t id, uint8_t num = 0)
     :val(BITS{{.num = num, .id = id, .cmd = static_cast<uint32_t>(CMD::TOCPU) }}){}
     explicit constexpr F2CPU(uint32_t val)
@@ -60,6 +76,8 @@ class F2FIFO : protected SDR_HEADER
     };
     BITS val;
 public:
+    static constexpr size_t MAX_NUM = 0xffff;
+
     explicit constexpr F2FIFO(uint16_t num)
     :val(BITS{{.num = num, .cmd = static_cast<uint32_t>(CMD::TOFIFO)}}){}
     explicit constexpr F2FIFO(uint32_t val)
@@ -69,33 +87,134 @@ public:
     constexpr uint16_t num() const {return val.num;}
 };    
 
+// Stream payload word: two signed 12-bit samples, I in bits 11:0, Q in bits 27:16
+class IQ_SAMPLE
+{
+    uint32_t val;
+public:
+    explicit constexpr IQ_SAMPLE(uint32_t val)
+    :val(val) {}
+
+    operator uint32_t() const {return val;}
+    constexpr int16_t i() const {return static_cast<int16_t>(static_cast<int32_t>(val << 20) >> 20);}
+    constexpr int16_t q() const {return static_cast<int16_t>(static_cast<int32_t>(val << 4) >> 20);}
+    constexpr uint32_t power() const {return i() * i() + q() * q();}
+
+    // i and q are 12-bit signed values
+    static constexpr IQ_SAMPLE Pack(int16_t i, int16_t q)
+    {
+        return IQ_SAMPLE((static_cast<uint32_t>(i) & 0xfff) | ((static_cast<uint32_t>(q) & 0xfff) << 16));
+    }
+};
+
+
+// Caller-owned run of words, for the scatter-gather writes
+struct WordSpan
+{
+    const uint32_t* data;
+    size_t words;
+};
 
 
 class OPacketStream
 : private streambuf
 , public ostream {
 public:    
-    OPacketStream(FT_HANDLE handle);
-    ~OPacketStream() { flush();}
+    struct WriteCombine
+    {
+        size_t frame_words = 1023;          // stream words per F2FIFO frame
+        size_t transfer_words = 16 * 1024;  // frames are collected up to this per USB write
+        chrono::microseconds deadline{200}; // oldest unsent byte waits at most this long
+        bool messages = true;               // SendMessage() joins the transfer in order
+    };
+
+    struct TransferStats
+    {
+        uint64_t transfers;
+        uint64_t bytes;
+
+        double AverageBytes() const {return transfers? static_cast<double>(bytes) / transfers: 0;}
+    };
+
+    // With a scheduler frames and messages go through its lanes instead of
+    // being written directly
+    OPacketStream(FT_HANDLE handle, TxScheduler* scheduler = nullptr);
+    ~OPacketStream();
 
     virtual ostream& flush();
 
-    void SendMessage(uint8_t msgId, const list<uint32_t> &data);
+    // false if the transfer failed, or if msgId or the payload does not fit
+    // an F2CPU header (id up to 7, up to 255 words)
+    bool SendMessage(uint8_t msgId, const list<uint32_t> &data);
+    bool SendMessage(uint8_t msgId, const uint32_t* data, size_t count);
+
+    // Packet made of header (F2FIFO or F2CPU) and the spans, gathered into a
+    // pool buffer with one copy and written once. false if the spans do not
+    // add up to the header's num().
+    bool SendGather(uint32_t header, const WordSpan* spans, size_t count);
+    bool SendGather(uint32_t header, initializer_list<WordSpan> spans)
+    {
+        return SendGather(header, spans.begin(), spans.size());
+    }
+    // packet[0] is a reserved slot: the header is stored there and the packet
+    // is written in place without copying (copied once for a scheduler).
+    // false if payload_words is not the header's num().
+    bool SendReserved(uint32_t header, uint32_t* packet, size_t payload_words);
+
+    // Switches off unitbuf: writes are combined into large transfers that go
+    // out when full, on the deadline or on flush(). Call once, before writing.
+    void Combine(const WriteCombine& config);
+    TransferStats Transfers() const;
+    // Every packet written to the pipe is stamped on the probe; with a
+    // scheduler, instrument the scheduler instead
+    void Instrument(LatencyProbe* probe) {this->probe = probe;}
 
 private:
-    typedef array<uint32_t, 1023> array_type;
+    // word 0 is reserved for the F2FIFO header so a frame goes out in place
+    typedef array<uint32_t, 1024> array_type;
     typedef streambuf::traits_type traits_type;        
     array_type d_buffer;
     const chrono::milliseconds timeout{100};
     FT_HANDLE handle;
-    int tx_count;
+    TxScheduler* scheduler;
+    LatencyProbe* probe;
+    BufferPool& pool;
+    atomic<uint64_t> transfers;
+    atomic<uint64_t> transfer_bytes;
+
+    // write combining: no put area, every write lands in xsputn/overflow
+    WriteCombine combine;
+    bool combining;
+    mutex combine_lock;             // producer against the deadline flusher
+    PacketRef transfer;
+    size_t used_bytes;              // filled part of transfer, headers included
+    size_t frame_pos;               // word index of the open frame's header, NO_FRAME if none
+    atomic<int64_t> oldest;         // steady_clock ns of the oldest unsent byte, 0 if none
+    atomic<bool> combine_stop;
+    WaitPoint flush_timer;
+    thread* flusher;
+
+    static constexpr size_t NO_FRAME = ~size_t(0);
 
     void DataReady();
     unsigned int elements() {return (this->pptr() - this->pbase()) / sizeof(uint32_t);}    
+    void ResetBuffer();
+
+    bool SendPacket(const uint32_t* words, size_t count);
+    bool Dispatch(PacketRef message);
+    bool Emit(PacketRef packet);
+    bool WriteSpans(const WordSpan* spans, size_t count);
+    static void CountPacket(uint32_t header);
 
-    bool SendPacket(const list<uint32_t> &data);
+    void Append(const char* data, size_t bytes);
+    void CloseFrame();
+    size_t SealFrame(char* tail);
+    void AppendMessage(const PacketRef& message);
+    void FlushCombined();
+    void Flusher();
 
     int overflow(int c);
+    streamsize xsputn(const char* data, streamsize count);
     int sync();
 };
 
@@ -104,22 +223,43 @@ class IPacketStream
 : private streambuf
 , public istream {
 public:
-    typedef std::function<void(uint8_t msgId, const list<uint32_t>& body)> Callback_t;
+    // body is a pooled buffer: keep a copy of the handle to hold on to it
+    typedef std::function<void(uint8_t msgId, const PacketRef& body)> Callback_t;
+
+    // Where the reader thread takes its bytes from. EXTERNAL starts no thread:
+    // the owner pushes received bytes through Feed().
+    enum class SOURCE {USB, FILE, ARRAY, EXTERNAL};
 
-    IPacketStream(FT_HANDLE handle, Callback_t callback);
+    // fifo: the FIFO the USB reader takes its packets from
+    IPacketStream(FT_HANDLE handle, Callback_t callback, SOURCE source = SOURCE::USB,
+                  const ThreadPolicy& policy = ThreadPolicy("sdr-rx"), uint8_t fifo = 1);
     ~IPacketStream();
 
     Callback_t callback;
     thread& GetThread() const {return *read_thread;}
 
+    // Stops and joins the reader, aborting a transfer blocked in the driver
+    void Stop();
+    // FT_OK, or the transfer error that ended the reader. A failing stream
+    // stops on its own; other streams and the process carry on.
+    FT_STATUS Status() const {return status.load(memory_order_acquire);}
+
+    // Parses bytes read elsewhere, callbacks run on the calling thread
+    void Feed(const void* data, size_t bytes);
+
 private:
-    typedef array<uint32_t, 1024> array_type;
-    array_type d_buffer;
+    typedef array<uint32_t, 1> array_type;
+    array_type d_buffer;            // header being assembled
+    PacketRef packet;               // body being assembled
     FT_HANDLE handle;
+    const uint8_t fifo;
+    BufferPool* pool;               // on the reader's node, set by the reader thread
     typedef streambuf::traits_type traits_type;    
     const chrono::milliseconds timeout{1000};
-    int rx_count;    
     enum PCKTYPE {NONE, STREAM, MESSAGE} packet_type;
+    const ThreadPolicy policy;
+    StopFlag stop;
+    atomic<FT_STATUS> status;
     thread* read_thread;
     char* start;
 
@@ -128,9 +268,12 @@ private:
     void DataReaderThreadArray();
 
     void DataReady();
+    void ExpectHeader();
 
     int overflow(int c);
     int sync();
 
     
-};
\ No newline at end of file
+};
+
+#endif // STREAMER_H
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "trigger.h"
+
+using namespace std;
+
+
+BurstTrigger::BurstTrigger(const Config& config, BurstCallback_t callback)
+: config(config)
+, callback(callback)
+, history(config.pre_samples)
+, history_pos(0)
+, history_len(0)
+, burst_offset(0)
+, quiet(0)
+, active(false)
+, offset(0)
+, bursts(0)
+, emitted(0)
+{
+    assert(config.window > 0 && config.close_level <= config.open_level);
+    assert(config.max_burst >= config.window);
+    // the history opens a burst, so it must leave room below the chunk size
+    assert(config.pre_samples < config.max_burst);
+
+    partial.reserve(config.window);
+    burst.reserve(config.max_burst);
+}
+
+// Sum of I^2+Q^2 over count words
+uint64_t BurstTrigger::PowerSum(const uint32_t* words, size_t count)
+{
+    uint64_t sum = 0;
+    size_t idx = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi32(0xffff);
+    __m128i acc = zero;
+
+    for (; idx + 4 <= count; idx += 4)
+    {
+        __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + idx));
+        // sign-extend both 12-bit fields and repack as 16-bit I/Q pairs
+        __m128i i = _mm_srai_epi32(_mm_slli_epi32(w, 20), 20);
+        __m128i q = _mm_srai_epi32(_mm_slli_epi32(w, 4), 20);
+        __m128i iq = _mm_or_si128(_mm_and_si128(i, low), _mm_slli_epi32(q, 16));
+        // I*I + Q*Q per lane, at most 2^23 so it stays positive in 32 bits
+        __m128i p = _mm_madd_epi16(iq, iq);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(p, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(p, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    sum = lanes[0] + lanes[1];
+#endif
+
+    for (; idx < count; ++idx)
+        sum += IQ_SAMPLE(words[idx]).power();
+
+    return sum;
+}
+
+void BurstTrigger::Feed(const uint32_t* words, size_t count)
+{
+    const size_t window = config.window;
+
+    if (!partial.empty())
+    {
+        size_t n = min(window - partial.size(), count);
+        partial.insert(partial.end(), words, words + n);
+        words += n;
+        count -= n;
+
+        if (partial.size() < window)
+            return;
+
+        Window(partial.data());
+        partial.clear();
+    }
+
+    for (; count >= window; words += window, count -= window)
+        Window(words);
+
+    partial.assign(words, words + count);
+}
+
+void BurstTrigger::Window(const uint32_t* words)
+{
+    const uint32_t window = config.window;
+    uint64_t mean = PowerSum(words, window) / window;
+
+    if (!active)
+    {
+        if (mean < config.open_level)
+        {
+            Remember(words, window);
+            offset += window;
+            return;
+        }
+
+        // triggered: start the burst with the retained history
+        active = true;
+        quiet = 0;
+        ++bursts;
+        burst_offset = offset - history_len;
+
+        size_t first = (history_pos + history.size() - history_len) % max<size_t>(history.size(), 1);
+        for (size_t idx = 0; idx < history_len; ++idx)
+            burst.push_back(history[(first + idx) % history.size()]);
+        history_len = 0;
+    }
+    else
+    {
+        quiet = (mean < config.close_level)? quiet + window: 0;
+    }
+
+    for (uint32_t idx = 0; idx < window; ++idx)
+    {
+        burst.push_back(words[idx]);
+        if (burst.size() >= config.max_burst)
+            Emit(false);
+    }
+    offset += window;
+
+    if (quiet >= config.post_samples)
+        Emit(true);
+}
+
+void BurstTrigger::Remember(const uint32_t* words, size_t count)
+{
+    const size_t size = history.size();
+    if (size == 0)
+        return;
+
+    if (count >= size)
+    {
+        words += count - size;
+        count = size;
+    }
+
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        history[history_pos] = words[idx];
+        history_pos = (history_pos + 1) % size;
+    }
+    history_len = min(history_len + count, size);
+}
+
+void BurstTrigger::Emit(bool last)
+{
+    if (!burst.empty() || last)
+    {
+        if (callback)
+            callback(burst_offset, burst, last);
+        emitted += burst.size();
+    }
+
+    burst_offset += burst.size();
+    burst.clear();
+
+    if (last)
+    {
+        active = false;
+        quiet = 0;
+    }
+}
+
+void BurstTrigger::Flush()
+{
+    if (!partial.empty())
+    {
+        if (active)
+        {
+            for (uint32_t word: partial)
+            {
+                burst.push_back(word);
+                if (burst.size() >= config.max_burst)
+                    Emit(false);
+            }
+        }
+        else
+            Remember(partial.data(), partial.size());
+        offset += partial.size();
+        partial.clear();
+    }
+
+    if (active)
+        Emit(true);
+}
+
+IPacketStream::Callback_t BurstTrigger::Callback()
+{
+    return [this](uint8_t, const PacketRef& body)
+    {
+        if (!body.IsMessage())
+            Feed(body.data(), body.size());
+    };
+}
@@ -0,0 +1,61 @@
+#ifndef TRIGGER_H
+#define TRIGGER_H
+
+#include <vector>
+#include "streamer.h"
+
+// Energy trigger on the RX stream: passes through only the bursts whose
+// windowed mean power crosses open_level, with pre/post-trigger samples kept.
+class BurstTrigger
+{
+public:
+    struct Config
+    {
+        uint32_t window = 64;           // samples per power estimate
+        uint32_t open_level = 10000;    // mean I^2+Q^2 that opens a burst
+        uint32_t close_level = 5000;    // mean I^2+Q^2 below which a burst may close
+        uint32_t pre_samples = 256;     // history emitted ahead of the trigger point
+        uint32_t post_samples = 1024;   // quiet samples required before closing
+        uint32_t max_burst = 0xffff;    // longer bursts are emitted in chunks; > pre_samples, >= window
+    };
+
+    // offset: stream sample index of words[0]; last: burst closed with this chunk
+    typedef std::function<void(uint64_t offset, const vector<uint32_t>& words, bool last)> BurstCallback_t;
+
+    BurstTrigger(const Config& config, BurstCallback_t callback);
+
+    void Feed(const uint32_t* words, size_t count);
+    void Flush();
+
+    // Adapter for IPacketStream: stream packets are fed, messages are ignored
+    IPacketStream::Callback_t Callback();
+
+    uint64_t Samples() const {return offset;}
+    uint64_t Bursts() const {return bursts;}
+    uint64_t Emitted() const {return emitted;}
+
+    static uint64_t PowerSum(const uint32_t* words, size_t count);
+
+private:
+    const Config config;
+    BurstCallback_t callback;
+
+    vector<uint32_t> history;       // pre-trigger ring
+    size_t history_pos;
+    size_t history_len;
+    vector<uint32_t> partial;       // incomplete window carried between Feed() calls
+    vector<uint32_t> burst;
+    uint64_t burst_offset;
+    uint32_t quiet;
+    bool active;
+
+    uint64_t offset;
+    uint64_t bursts;
+    uint64_t emitted;
+
+    void Window(const uint32_t* words);
+    void Remember(const uint32_t* words, size_t count);
+    void Emit(bool last);
+};
+
+#endif // TRIGGER_H
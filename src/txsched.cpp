@@ -0,0 +1,357 @@
+#include <algorithm>
+#include "latency.h"
+#include "metrics.h"
+#include "txsched.h"
+
+using namespace std;
+
+
+static const size_t FRAME_WORDS = 1023;     // same frames as OPacketStream
+static const size_t BATCH_FRAMES = 64;      // frames per pooled buffer in SendStream()
+
+TxScheduler::TxScheduler(FT_HANDLE handle)
+: TxScheduler(handle, Config())
+{
+}
+
+TxScheduler::TxScheduler(FT_HANDLE handle, const Config& config, const ThreadPolicy& policy)
+: handle(handle)
+, config(config)
+, pool(BufferPool::Default())
+, probe(nullptr)
+, stream_offset(0)
+, queued_messages(0)
+, queued_words(0)
+, stopping(false)
+, message_count(0)
+, message_writes(0)
+, preempted(0)
+, stream_words(0)
+, stream_writes(0)
+, failed(0)
+, queued_max(0)
+, delay_min(clock::duration::max())
+, delay_max(0)
+, delay_sum(0)
+{
+    writer = thread(&TxScheduler::Run, this, policy);
+}
+
+TxScheduler::~TxScheduler()
+{
+    stopping = true;
+    work_ready.Notify();
+    space.Notify();
+    writer.join();
+}
+
+bool TxScheduler::SendStream(const uint32_t* words, size_t count)
+{
+    size_t done = 0;
+
+    while (done < count)
+    {
+        size_t chunk = min(count - done, BATCH_FRAMES * FRAME_WORDS);
+        PacketRef frames = pool.Get(chunk + (chunk + FRAME_WORDS - 1) / FRAME_WORDS);
+        uint32_t* out = frames.data();
+
+        for (size_t pos = 0; pos < chunk; pos += FRAME_WORDS)
+        {
+            size_t elems = min(FRAME_WORDS, chunk - pos);
+            *out++ = F2FIFO(static_cast<uint16_t>(elems));
+            out = copy(words + done + pos, words + done + pos + elems, out);
+        }
+        Metrics::Add(Metrics::TX_FRAMES, config.stream_channel, (chunk + FRAME_WORDS - 1) / FRAME_WORDS);
+
+        if (!QueueFrames(move(frames)))
+            return false;
+        done += chunk;
+    }
+
+    return true;
+}
+
+bool TxScheduler::SendMessage(uint8_t msgId, const uint32_t* data, size_t count)
+{
+    if (!F2CPU::Fits(msgId, count))
+        return false;
+    PacketRef packet = pool.Get(count + 1);
+
+    packet[0] = F2CPU(msgId, count);
+    copy(data, data + count, packet.begin() + 1);
+    Metrics::Add(Metrics::TX_MESSAGES, msgId);
+    return QueueMessage(move(packet));
+}
+
+bool TxScheduler::QueueFrames(PacketRef frames)
+{
+    size_t count = frames.size();
+
+    // an oversized buffer still goes through once the lane is empty
+    space.Wait([this, count]
+    {
+        size_t queued = queued_words.load(memory_order_acquire);
+        return queued == 0 || queued + count <= config.max_queued_words || stopping;
+    });
+    if (stopping)
+        return false;
+
+    {
+        lock_guard<mutex> guard(lock);
+        stream.push_back(move(frames));
+        size_t queued = queued_words.fetch_add(count, memory_order_release) + count;
+        queued_max = max(queued_max, queued);
+        Metrics::Set(Metrics::TX_QUEUE_WORDS, queued);
+    }
+    work_ready.Notify();
+    return true;
+}
+
+bool TxScheduler::QueueMessage(PacketRef message)
+{
+    if (stopping)
+        return false;
+
+    {
+        lock_guard<mutex> guard(lock);
+        messages.push_back(Message{move(message), clock::now()});
+        size_t queued = queued_messages.fetch_add(1, memory_order_release) + 1;
+        Metrics::Set(Metrics::TX_QUEUE_MESSAGES, queued);
+    }
+    work_ready.Notify();
+    return true;
+}
+
+void TxScheduler::Drain()
+{
+    idle.Wait([this]
+    {
+        return queued_messages.load(memory_order_acquire) == 0 &&
+               queued_words.load(memory_order_acquire) == 0;
+    });
+}
+
+// End of the whole frames from offset that fit in limit words
+size_t TxScheduler::ChunkEnd(const PacketRef& frames, size_t offset, size_t limit) const
+{
+    size_t pos = offset;
+    while (pos < frames.size())
+    {
+        size_t next = pos + 1 + F2FIFO(frames[pos]).num();
+        if (next - offset > limit)
+            break;
+        pos = next;
+    }
+    return min(pos, frames.size());
+}
+
+// Caller holds lock. Copies queued messages into batch while they fit.
+void TxScheduler::TakeMessages(PacketRef& batch, size_t& used, vector<clock::time_point>& queued_at)
+{
+    while (!messages.empty())
+    {
+        Message& next = messages.front();
+        if (used + next.packet.size() > batch.size())
+            break;
+
+        copy(next.packet.begin(), next.packet.end(), batch.begin() + used);
+        used += next.packet.size();
+        queued_at.push_back(next.queued);
+        if (!stream.empty())
+            ++preempted;
+        messages.pop_front();
+    }
+}
+
+// Caller holds lock. Appends the stream frames that fit behind the messages.
+size_t TxScheduler::TakeStream(PacketRef& batch, size_t& used)
+{
+    if (stream.empty())
+        return 0;
+
+    PacketRef& frames = stream.front();
+    size_t end = ChunkEnd(frames, stream_offset, batch.size() - used);
+    size_t count = end - stream_offset;
+
+    copy(frames.begin() + stream_offset, frames.begin() + end, batch.begin() + used);
+    used += count;
+    stream_offset = end;
+    if (end == frames.size())
+    {
+        stream.pop_front();
+        stream_offset = 0;
+    }
+    return count;
+}
+
+void TxScheduler::Run(ThreadPolicy policy)
+{
+    ApplyThreadPolicy(policy);
+    const uint8_t message_channel = (config.message_channel < 0)?
+        config.stream_channel: static_cast<uint8_t>(config.message_channel);
+    const bool shared = (message_channel == config.stream_channel);
+
+    PacketRef batch = pool.Get(max<size_t>(config.coalesce_words, 1));
+    vector<clock::time_point> queued_at;
+
+    while (true)
+    {
+        work_ready.Wait([this]
+        {
+            return queued_messages.load(memory_order_acquire) > 0 ||
+                   queued_words.load(memory_order_acquire) > 0 || stopping;
+        });
+
+        PacketRef single;           // a message too large to batch
+        PacketRef frames;
+        size_t begin = 0;
+        size_t end = 0;
+        size_t used = 0;
+        size_t streamed = 0;
+        queued_at.clear();
+        {
+            lock_guard<mutex> guard(lock);
+            if (!messages.empty())
+            {
+                TakeMessages(batch, used, queued_at);
+                if (used == 0)
+                {
+                    single = move(messages.front().packet);
+                    queued_at.push_back(messages.front().queued);
+                    if (!stream.empty())
+                        ++preempted;
+                    messages.pop_front();
+                }
+            }
+            else if (!stream.empty())
+            {
+                frames = stream.front();
+                begin = stream_offset;
+                end = ChunkEnd(frames, begin, config.chunk_words);
+                if (end == begin)
+                    end = begin + 1 + F2FIFO(frames[begin]).num();
+                stream_offset = end;
+                if (end == frames.size())
+                {
+                    stream.pop_front();
+                    stream_offset = 0;
+                }
+            }
+            else if (stopping)
+                break;
+            else
+                continue;
+        }
+
+        if (used > 0)
+        {
+            // give later messages until the first one's linger bound to join
+            auto until = queued_at.front() + config.linger;
+            while (used < batch.size() && !stopping && clock::now() < until)
+            {
+                size_t taken = queued_at.size();
+                work_ready.WaitUntil([this, taken]
+                {
+                    return queued_messages.load(memory_order_acquire) > taken || stopping;
+                }, until);
+
+                lock_guard<mutex> guard(lock);
+                TakeMessages(batch, used, queued_at);
+                if (queued_at.size() == taken)
+                    break;
+            }
+
+            if (shared)
+            {
+                lock_guard<mutex> guard(lock);
+                streamed = TakeStream(batch, used);
+            }
+        }
+
+        if (!queued_at.empty())
+        {
+            bool ok = single? Write(message_channel, single.data(), single.size()):
+                              Write(message_channel, batch.data(), used);
+            auto now = clock::now();
+            {
+                lock_guard<mutex> guard(lock);
+                message_count += queued_at.size();
+                ++message_writes;
+                failed += ok? 0: 1;
+                for (auto queued: queued_at)
+                {
+                    auto delay = now - queued;
+                    delay_min = min(delay_min, delay);
+                    delay_max = max(delay_max, delay);
+                    delay_sum += delay;
+                }
+                stream_words += streamed;
+            }
+            size_t queued = queued_messages.fetch_sub(queued_at.size(), memory_order_release) - queued_at.size();
+            Metrics::Set(Metrics::TX_QUEUE_MESSAGES, queued);
+        }
+        else
+        {
+            streamed = end - begin;
+            bool ok = Write(config.stream_channel, frames.data() + begin, streamed);
+            {
+                lock_guard<mutex> guard(lock);
+                stream_words += streamed;
+                ++stream_writes;
+                failed += ok? 0: 1;
+            }
+        }
+
+        if (streamed > 0)
+        {
+            size_t queued = queued_words.fetch_sub(streamed, memory_order_release) - streamed;
+            Metrics::Set(Metrics::TX_QUEUE_WORDS, queued);
+            space.Notify();
+        }
+        idle.Notify();
+    }
+}
+
+bool TxScheduler::Write(uint8_t channel, const uint32_t* words, size_t count)
+{
+    ULONG size = count * sizeof(uint32_t);
+    ULONG sent = 0;
+
+    if (probe != nullptr)
+        probe->Transmitted(words, count);
+
+    while (sent < size)
+    {
+        ULONG count = 0;
+        if (FT_OK != FT_WritePipeEx(handle, channel,
+                    (PUCHAR)words + sent, size - sent, &count, 1000))
+        {
+            Metrics::Add(Metrics::TRANSFER_ERRORS, channel);
+            return false;
+        }
+        sent += count;
+        Metrics::Add(Metrics::TX_BYTES, channel, count);
+    }
+
+    return true;
+}
+
+TxScheduler::Stats TxScheduler::GetStats() const
+{
+    lock_guard<mutex> guard(lock);
+    Stats stats;
+
+    stats.messages = message_count;
+    stats.message_writes = message_writes;
+    stats.preempted = preempted;
+    stats.stream_words = stream_words;
+    stats.stream_writes = stream_writes;
+    stats.failed = failed;
+    stats.queued_words = queued_words.load(memory_order_relaxed);
+    stats.max_queued_words = queued_max;
+    stats.min_delay = chrono::duration_cast<chrono::microseconds>(message_count? delay_min: clock::duration(0));
+    stats.mean_delay = chrono::duration_cast<chrono::microseconds>(
+        message_count? delay_sum / static_cast<int64_t>(message_count): clock::duration(0));
+    stats.max_delay = chrono::duration_cast<chrono::microseconds>(delay_max);
+    return stats;
+}
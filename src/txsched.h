@@ -0,0 +1,115 @@
+#ifndef TXSCHED_H
+#define TXSCHED_H
+
+#include <deque>
+#include <mutex>
+#include "rtthread.h"
+#include "streamer.h"
+#include "waitstrategy.h"
+
+// Single owner of the TX pipe with two lanes. Stream data is written a few
+// whole frames at a time and the message lane is checked between every
+// write, so a control message waits for at most one chunk instead of the
+// whole stream backlog. With message_channel set, messages also use their
+// own FIFO channel and do not queue behind stream data inside the FT60x.
+class TxScheduler
+{
+public:
+    struct Config
+    {
+        uint8_t stream_channel = 1;
+        int message_channel = -1;       // -1: share the stream channel
+        size_t chunk_words = 8 * 1024;  // stream words per write, whole frames, at least one
+        size_t max_queued_words = 4 * 1024 * 1024;  // SendStream() blocks beyond this
+        // Queued messages are packed into one write of up to coalesce_words,
+        // topped up with stream frames when they share the channel. A message
+        // may wait up to linger for others to join it.
+        size_t coalesce_words = 4 * 1024;
+        chrono::microseconds linger{0};
+    };
+
+    struct Stats
+    {
+        uint64_t messages;
+        uint64_t message_writes;        // USB writes carrying messages
+        uint64_t preempted;             // messages that overtook queued stream data
+        uint64_t stream_words;
+        uint64_t stream_writes;
+        uint64_t failed;
+        size_t queued_words;
+        size_t max_queued_words;
+        // queueing plus transfer time of control messages
+        chrono::microseconds min_delay;
+        chrono::microseconds mean_delay;
+        chrono::microseconds max_delay;
+    };
+
+    explicit TxScheduler(FT_HANDLE handle);
+    TxScheduler(FT_HANDLE handle, const Config& config, const ThreadPolicy& policy = ThreadPolicy("sdr-tx"));
+    // Drains both lanes, then stops the writer
+    ~TxScheduler();
+
+    // Thread-safe. Stream words are framed into F2FIFO packets.
+    bool SendStream(const uint32_t* words, size_t count);
+    // false if msgId or count does not fit an F2CPU header
+    bool SendMessage(uint8_t msgId, const uint32_t* data, size_t count);
+    // Already framed packets, e.g. from OPacketStream
+    bool QueueFrames(PacketRef frames);
+    bool QueueMessage(PacketRef message);
+
+    // Blocks until both lanes are empty and written
+    void Drain();
+    // Stamps every write on the probe; set before sending anything
+    void Instrument(LatencyProbe* probe) {this->probe = probe;}
+
+    Stats GetStats() const;
+
+private:
+    typedef chrono::steady_clock clock;
+
+    struct Message
+    {
+        PacketRef packet;
+        clock::time_point queued;
+    };
+
+    FT_HANDLE handle;
+    const Config config;
+    BufferPool& pool;
+    LatencyProbe* probe;
+
+    mutable mutex lock;             // guards the lanes and counters
+    deque<Message> messages;
+    deque<PacketRef> stream;
+    size_t stream_offset;           // words of stream.front() already handed to the writer
+
+    // queued and not yet written, what the waiters below look at
+    atomic<size_t> queued_messages;
+    atomic<size_t> queued_words;
+    atomic<bool> stopping;
+
+    WaitPoint work_ready;
+    WaitPoint space;                // stream lane drained below the limit
+    WaitPoint idle;
+
+    uint64_t message_count;
+    uint64_t message_writes;
+    uint64_t preempted;
+    uint64_t stream_words;
+    uint64_t stream_writes;
+    uint64_t failed;
+    size_t queued_max;
+    clock::duration delay_min;
+    clock::duration delay_max;
+    clock::duration delay_sum;
+
+    thread writer;
+
+    void Run(ThreadPolicy policy);
+    bool Write(uint8_t channel, const uint32_t* words, size_t count);
+    size_t ChunkEnd(const PacketRef& frames, size_t offset, size_t limit) const;
+    void TakeMessages(PacketRef& batch, size_t& used, vector<clock::time_point>& queued_at);
+    size_t TakeStream(PacketRef& batch, size_t& used);
+};
+
+#endif // TXSCHED_H
@@ -0,0 +1,92 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include "waitstrategy.h"
+
+#ifdef __linux__
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+
+WaitConfig& WaitConfig::Default()
+{
+    static WaitConfig config = []
+    {
+        WaitConfig c;
+        const char* env = getenv("SDR_WAIT");
+        if (env != nullptr)
+            Parse(env, c);
+        return c;
+    }();
+    return config;
+}
+
+bool WaitConfig::Parse(const char* text, WaitConfig& config)
+{
+    if (strcmp(text, "spin") == 0)
+        config.mode = WaitMode::SPIN;
+    else if (strcmp(text, "hybrid") == 0)
+        config.mode = WaitMode::SPIN_THEN_PARK;
+    else if (strcmp(text, "block") == 0)
+        config.mode = WaitMode::BLOCK;
+    else
+        return false;
+    return true;
+}
+
+const char* WaitConfig::Name() const
+{
+    switch (mode)
+    {
+        case WaitMode::SPIN: return "spin";
+        case WaitMode::SPIN_THEN_PARK: return "hybrid";
+        case WaitMode::BLOCK: return "block";
+    }
+    return "?";
+}
+
+bool WaitPoint::Park(uint32_t seen, clock::time_point deadline)
+{
+#ifdef __linux__
+    const timespec* timeout = nullptr;
+    timespec ts;
+
+    if (deadline != clock::time_point::max())
+    {
+        // steady_clock is CLOCK_MONOTONIC, which FUTEX_WAIT_BITSET takes as absolute time
+        auto ns = chrono::duration_cast<chrono::nanoseconds>(deadline.time_since_epoch()).count();
+        if (ns < 0)
+            ns = 0;
+        ts.tv_sec = ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        timeout = &ts;
+    }
+
+    long ret = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch),
+                       FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, seen, timeout,
+                       nullptr, FUTEX_BITSET_MATCH_ANY);
+    return !(ret == -1 && errno == ETIMEDOUT);
+#else
+    // no futex: short sleeps
+    (void)seen;
+    if (clock::now() >= deadline)
+        return false;
+    this_thread::sleep_for(chrono::microseconds(50));
+    return true;
+#endif
+}
+
+void WaitPoint::Wake()
+{
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch),
+            FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, nullptr, nullptr, 0);
+#endif
+}
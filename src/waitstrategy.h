@@ -0,0 +1,146 @@
+#ifndef WAITSTRATEGY_H
+#define WAITSTRATEGY_H
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() do {} while (0)
+#endif
+
+// How internal loops wait for work:
+//  SPIN            burn the core, lowest latency, for dedicated boxes
+//  SPIN_THEN_PARK  spin for a while, then sleep on a futex
+//  BLOCK           sleep on a futex straight away, lowest idle CPU
+enum class WaitMode {SPIN, SPIN_THEN_PARK, BLOCK};
+
+struct WaitConfig
+{
+    WaitMode mode = WaitMode::SPIN_THEN_PARK;
+    unsigned spin = 4000;       // CPU_RELAX rounds before parking
+
+    // Process-wide default, initialised from SDR_WAIT=spin|hybrid|block
+    static WaitConfig& Default();
+    static bool Parse(const char* text, WaitConfig& config);
+    const char* Name() const;
+};
+
+// Consumer side waits for a predicate, producer side calls Notify() after
+// publishing. Notify() is lock-free (a fence, plus a futex wake only when
+// someone is parked), so it may be called from a signal handler.
+class WaitPoint
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    explicit WaitPoint(const WaitConfig& config = WaitConfig::Default())
+    : config(config), epoch(0), waiters(0) {}
+
+    template <typename Pred>
+    bool WaitUntil(Pred pred, clock::time_point deadline);
+
+    template <typename Pred>
+    void Wait(Pred pred) {WaitUntil(pred, clock::time_point::max());}
+
+    template <typename Pred, typename Rep, typename Period>
+    bool WaitFor(Pred pred, std::chrono::duration<Rep, Period> timeout)
+    {
+        return WaitUntil(pred, clock::now() + timeout);
+    }
+
+    void Notify()
+    {
+        // pairs with the waiter's increment: either it sees our data or we see it
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        epoch.fetch_add(1, std::memory_order_release);
+        Wake();
+    }
+
+    const WaitConfig& Config() const {return config;}
+
+private:
+    const WaitConfig config;
+    std::atomic<uint32_t> epoch;
+    std::atomic<uint32_t> waiters;
+
+    // false on timeout
+    bool Park(uint32_t seen, clock::time_point deadline);
+    void Wake();
+};
+
+template <typename Pred>
+bool WaitPoint::WaitUntil(Pred pred, clock::time_point deadline)
+{
+    unsigned spins = 0;
+
+    while (true)
+    {
+        if (pred())
+            return true;
+
+        if (config.mode == WaitMode::SPIN ||
+            (config.mode == WaitMode::SPIN_THEN_PARK && spins < config.spin))
+        {
+            CPU_RELAX();
+            if ((++spins & 63) == 0 && clock::now() >= deadline)
+                return pred();
+            continue;
+        }
+
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t seen = epoch.load(std::memory_order_acquire);
+        if (pred())
+        {
+            waiters.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        bool woken = Park(seen, deadline);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+
+        if (!woken)
+            return pred();
+    }
+}
+
+// Cancellation flag that sleepers can wait on and that wakes them promptly.
+// Request() is async-signal-safe.
+class StopFlag
+{
+public:
+    StopFlag(): flag(false), point(WaitConfig{WaitMode::BLOCK, 0}) {}
+
+    void Request()
+    {
+        flag.store(true, std::memory_order_release);
+        point.Notify();
+    }
+    bool Requested() const {return flag.load(std::memory_order_acquire);}
+    explicit operator bool() const {return Requested();}
+    // Re-arms the flag for a restart; only while nothing waits on it
+    void Reset() {flag.store(false, std::memory_order_release);}
+
+    void Wait() {point.Wait([this] {return Requested();});}
+
+    // false when the stop was requested before the deadline
+    bool SleepUntil(WaitPoint::clock::time_point deadline)
+    {
+        return !point.WaitUntil([this] {return Requested();}, deadline);
+    }
+    template <typename Rep, typename Period>
+    bool SleepFor(std::chrono::duration<Rep, Period> timeout)
+    {
+        return SleepUntil(WaitPoint::clock::now() + timeout);
+    }
+
+private:
+    std::atomic<bool> flag;
+    WaitPoint point;
+};
+
+#endif // WAITSTRATEGY_H
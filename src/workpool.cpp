@@ -0,0 +1,256 @@
+#include <algorithm>
+#include "workpool.h"
+
+using namespace std;
+
+
+static thread_local const WorkPool* current_pool = nullptr;
+static thread_local unsigned current_worker = 0;
+
+WorkPool::WorkPool(unsigned threads, const ThreadPolicy& policy)
+: next(0)
+, queued(0)
+, pending(0)
+, executed(0)
+, steals(0)
+, stopping(false)
+{
+    threads = max(threads, 1u);
+
+    for (unsigned idx = 0; idx < threads; ++idx)
+        workers.emplace_back(new Worker());
+
+    for (unsigned idx = 0; idx < threads; ++idx)
+        workers[idx]->runner = thread(&WorkPool::Run, this, idx, policy.Offset(idx, to_string(idx)));
+}
+
+WorkPool::~WorkPool()
+{
+    Wait();
+
+    stopping = true;
+    work_ready.Notify();
+
+    for (auto& worker: workers)
+        worker->runner.join();
+}
+
+void WorkPool::Submit(Task_t task)
+{
+    unsigned index = (current_pool == this)?
+        current_worker: next.fetch_add(1, memory_order_relaxed) % workers.size();
+
+    pending.fetch_add(1, memory_order_relaxed);
+    {
+        lock_guard<mutex> guard(workers[index]->lock);
+        workers[index]->tasks.push_back(move(task));
+    }
+    queued.fetch_add(1, memory_order_relaxed);
+    work_ready.Notify();
+}
+
+void WorkPool::Wait()
+{
+    all_done.Wait([this] {return pending.load(memory_order_acquire) == 0;});
+}
+
+bool WorkPool::Take(unsigned index, Task_t& task)
+{
+    {
+        Worker& own = *workers[index];
+        lock_guard<mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            task = move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (unsigned step = 1; step < workers.size(); ++step)
+    {
+        Worker& victim = *workers[(index + step) % workers.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            steals.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WorkPool::Run(unsigned index, ThreadPolicy policy)
+{
+    current_pool = this;
+    current_worker = index;
+    ApplyThreadPolicy(policy);
+
+    while (true)
+    {
+        Task_t task;
+        if (Take(index, task))
+        {
+            queued.fetch_sub(1, memory_order_relaxed);
+            task();
+            executed.fetch_add(1, memory_order_relaxed);
+
+            if (pending.fetch_sub(1) == 1)
+                all_done.Notify();
+            continue;
+        }
+
+        if (stopping && queued.load() == 0)
+            break;
+        work_ready.Wait([this] {return stopping || queued.load(memory_order_relaxed) > 0;});
+    }
+}
+
+
+FrameExecutor::FrameExecutor(WorkPool& pool, Work_t work, Deliver_t deliver,
+                             bool ordered, size_t batch, size_t window)
+: pool(pool)
+, buffers(BufferPool::Default())
+, work(work)
+, deliver(deliver)
+, ordered(ordered)
+, batch_size(max<size_t>(batch, 1))
+, window(max<size_t>(window, 1))
+, filling(nullptr)
+, submitted(0)
+, next_deliver(0)
+, delivering(false)
+, in_flight(0)
+, delivered(0)
+{
+    for (size_t idx = 0; idx < this->window + 1; ++idx)
+    {
+        Batch* b = new Batch();
+        b->items.resize(batch_size);
+        spare.push_back(b);
+    }
+}
+
+FrameExecutor::~FrameExecutor()
+{
+    Flush();
+
+    for (auto b: spare)
+        delete b;
+    if (filling != nullptr)
+        delete filling;
+}
+
+FrameExecutor::Item& FrameExecutor::Slot(uint8_t msgId)
+{
+    if (filling == nullptr)
+    {
+        unique_lock<mutex> guard(lock);
+        // backpressure: bound the number of batches in flight
+        space_cv.wait(guard, [this] {return in_flight < window && !spare.empty();});
+
+        filling = spare.back();
+        spare.pop_back();
+        filling->count = 0;
+    }
+
+    Item& item = filling->items[filling->count++];
+    item.msgId = msgId;
+    return item;
+}
+
+void FrameExecutor::Push(uint8_t msgId, PacketRef body)
+{
+    Slot(msgId).body = std::move(body);
+
+    if (filling->count == batch_size)
+        Submit();
+}
+
+void FrameExecutor::Push(uint8_t msgId, const uint32_t* words, size_t count)
+{
+    PacketRef body = buffers.Get(count);
+    copy(words, words + count, body.begin());
+    Push(msgId, std::move(body));
+}
+
+IPacketStream::Callback_t FrameExecutor::Callback()
+{
+    return [this](uint8_t msgId, const PacketRef& body)
+    {
+        Push(msgId, body);
+    };
+}
+
+void FrameExecutor::Submit()
+{
+    Batch* b = filling;
+    filling = nullptr;
+    b->seq = submitted++;
+
+    {
+        lock_guard<mutex> guard(lock);
+        ++in_flight;
+    }
+
+    pool.Submit([this, b]
+    {
+        for (size_t idx = 0; idx < b->count; ++idx)
+            work(b->items[idx].msgId, b->items[idx].body);
+        Complete(b);
+    });
+}
+
+void FrameExecutor::Complete(Batch* batch)
+{
+    unique_lock<mutex> guard(lock);
+    done.push_back(batch);
+
+    // one worker at a time delivers; the others just leave their batch behind
+    if (delivering)
+        return;
+    delivering = true;
+
+    while (!done.empty())
+    {
+        auto it = done.begin();
+        if (ordered)
+        {
+            it = find_if(done.begin(), done.end(),
+                         [this](Batch* b) {return b->seq == next_deliver;});
+            if (it == done.end())
+                break;
+        }
+
+        Batch* b = *it;
+        done.erase(it);
+        ++next_deliver;
+
+        guard.unlock();
+        for (size_t idx = 0; idx < b->count; ++idx)
+        {
+            deliver(b->items[idx].msgId, b->items[idx].body);
+            b->items[idx].body = PacketRef();
+        }
+        delivered.fetch_add(b->count, memory_order_relaxed);
+        guard.lock();
+
+        spare.push_back(b);
+        --in_flight;
+        space_cv.notify_all();
+    }
+
+    delivering = false;
+}
+
+void FrameExecutor::Flush()
+{
+    if (filling != nullptr && filling->count > 0)
+        Submit();
+
+    unique_lock<mutex> guard(lock);
+    space_cv.wait(guard, [this] {return in_flight == 0;});
+}
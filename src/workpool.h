@@ -0,0 +1,125 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "rtthread.h"
+#include "streamer.h"
+#include "waitstrategy.h"
+
+// Work-stealing executor: every worker owns a deque, pops its own work LIFO
+// and steals FIFO from the others when it runs dry.
+class WorkPool
+{
+public:
+    typedef std::function<void()> Task_t;
+
+    // Worker n runs with policy.Offset(n): consecutive cores when policy.core is set
+    explicit WorkPool(unsigned threads = thread::hardware_concurrency(),
+                      const ThreadPolicy& policy = ThreadPolicy("sdr-work"));
+    ~WorkPool();
+
+    // Safe from any thread; tasks submitted by a worker stay on its deque
+    void Submit(Task_t task);
+    // Blocks until every submitted task has finished
+    void Wait();
+
+    unsigned Threads() const {return workers.size();}
+    uint64_t Executed() const {return executed.load(memory_order_relaxed);}
+    uint64_t Steals() const {return steals.load(memory_order_relaxed);}
+
+private:
+    struct Worker
+    {
+        mutex lock;
+        deque<Task_t> tasks;
+        thread runner;
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    atomic<unsigned> next;
+    atomic<size_t> queued;          // tasks sitting in deques
+    atomic<size_t> pending;         // submitted and not yet finished
+    atomic<uint64_t> executed;
+    atomic<uint64_t> steals;
+    atomic<bool> stopping;
+
+    WaitPoint work_ready;           // signalled on Submit() and shutdown
+    WaitPoint all_done;             // signalled when pending drops to zero
+
+    bool Take(unsigned index, Task_t& task);
+    void Run(unsigned index, ThreadPolicy policy);
+};
+
+// Runs a per-frame operation on a WorkPool in batches of received frames and
+// hands the results to the consumer, in arrival order if requested. Frames
+// keep the received pool buffer, so up to (window + 1) * batch BufferPool
+// buffers are held at once.
+class FrameExecutor
+{
+public:
+    // Runs in parallel on pool workers, may modify the frame in place (the
+    // buffer is the received one, shared with any other RX callback)
+    typedef std::function<void(uint8_t msgId, PacketRef& body)> Work_t;
+    // Never called concurrently
+    typedef std::function<void(uint8_t msgId, const PacketRef& body)> Deliver_t;
+
+    FrameExecutor(WorkPool& pool, Work_t work, Deliver_t deliver,
+                  bool ordered = true, size_t batch = 8, size_t window = 64);
+    ~FrameExecutor();
+
+    // Producer side, single thread (normally the IPacketStream reader). The
+    // buffer is held until the frame is delivered.
+    void Push(uint8_t msgId, PacketRef body);
+    // Copies the words into a pooled buffer first
+    void Push(uint8_t msgId, const uint32_t* words, size_t count);
+    IPacketStream::Callback_t Callback();
+
+    // Submits the partial batch and waits until everything is delivered
+    void Flush();
+
+    uint64_t Delivered() const {return delivered.load(memory_order_relaxed);}
+
+private:
+    struct Item
+    {
+        uint8_t msgId;
+        PacketRef body;             // released once delivered
+    };
+
+    struct Batch
+    {
+        uint64_t seq;
+        size_t count;
+        vector<Item> items;
+    };
+
+    WorkPool& pool;
+    BufferPool& buffers;
+    Work_t work;
+    Deliver_t deliver;
+    const bool ordered;
+    const size_t batch_size;
+    const size_t window;
+
+    Batch* filling;
+    uint64_t submitted;
+
+    mutex lock;                     // guards everything below
+    condition_variable space_cv;
+    vector<Batch*> spare;
+    vector<Batch*> done;            // completed, waiting for their turn
+    uint64_t next_deliver;
+    bool delivering;
+    size_t in_flight;
+    atomic<uint64_t> delivered;
+
+    Item& Slot(uint8_t msgId);
+    void Submit();
+    void Complete(Batch* batch);
+};
+
+#endif // WORKPOOL_H